@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/// What an event says when it is printed: the message and the names of up to four values logged with it.
+/// Define these as statics next to the code that logs them; records only carry a pointer.
+struct LogEvent {
+    const char *message;
+    const char *fields[4];
+};
+
+/// Logger for real time threads: log() copies a fixed size record into a preallocated lock free ring and returns;
+/// a background thread formats the records and writes them to the stream. Any thread may log. A full ring drops
+/// the record and counts it instead of waiting, and the writer reports the count, so logging can never stall the
+/// thread that is logging. Slots carry a sequence number (a bounded MPMC queue), so a producer that loses a race
+/// for a slot just retries on the next one.
+class AsyncLog {
+public:
+    struct Record {
+        const LogEvent *event;
+        int64_t host_ns;
+        int64_t frame;
+        int64_t values[4];
+    };
+
+    /// capacity is rounded up to a power of two records
+    explicit AsyncLog(std::ostream &out = std::clog, uint32_t capacity = 4096) : out(out) {
+        uint32_t n = 2;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        slots = std::vector<Slot>(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask = n - 1;
+        start_ns = now_ns();
+        writer = std::thread([this] { run(); });
+    }
+
+    /// Writes out everything logged so far, then stops the writer.
+    ~AsyncLog() {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+    }
+
+    AsyncLog(const AsyncLog &) = delete;
+    AsyncLog &operator=(const AsyncLog &) = delete;
+
+    /// @retval false if the ring was full and the record was dropped
+    bool log(const LogEvent &event, int64_t frame, int64_t a = 0, int64_t b = 0, int64_t c = 0, int64_t d = 0) {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (1) {
+            slot = &slots[pos & mask];
+            int64_t lag = (int64_t) slot->sequence.load(std::memory_order_acquire) - (int64_t) pos;
+            if (lag == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (lag < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->record = Record{&event, now_ns(), frame, {a, b, c, d}};
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @retval records dropped so far because the ring was full
+    uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+
+    static int64_t now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence{0};
+        Record record;
+    };
+
+    void run() {
+        uint64_t reported_drops = 0;
+        while (1) {
+            bool finishing = stopping.load(std::memory_order_acquire);
+            int written = 0;
+            Slot *slot;
+            while ((slot = &slots[tail & mask])->sequence.load(std::memory_order_acquire) == tail + 1) {
+                print(slot->record);
+                slot->sequence.store(tail + mask + 1, std::memory_order_release);
+                tail++;
+                written++;
+            }
+            uint64_t d = drops();
+            if (d != reported_drops) {
+                out << "log dropped " << d - reported_drops << " records (" << d << " in total)\n";
+                reported_drops = d;
+                written++;
+            }
+            if (written) {
+                out.flush();
+            }
+            if (finishing) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+
+    void print(const Record &r) {
+        const int64_t ms = (r.host_ns - start_ns) / 1000000;
+        out << ms / 1000 << "." << (ms % 1000) / 100 << (ms % 100) / 10 << ms % 10 << " " << r.event->message
+            << " at frame " << r.frame;
+        for (int i = 0; i < 4 && r.event->fields[i]; ++i) {
+            out << " " << r.event->fields[i] << " " << r.values[i];
+        }
+        out << "\n";
+    }
+
+    std::ostream &out;
+    std::vector<Slot> slots;
+    uint64_t mask;
+    int64_t start_ns;
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> dropped{0};
+    uint64_t tail = 0; // writer thread only
+    std::atomic<bool> stopping{false};
+    std::thread writer;
+};
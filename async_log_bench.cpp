@@ -0,0 +1,56 @@
+// Cost of AsyncLog::log() on the calling thread, with the writer formatting to /dev/null, no card needed.
+//   g++ -std=c++17 -O2 -pthread async_log_bench.cpp -o async_log_bench
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "async_log.h"
+
+using std::clog;
+
+static const LogEvent bench_event{"bench", {"a", "b", "c", "d"}};
+
+int main(int argc, char **argv) {
+    const long bursts = argc > 1 ? atol(argv[1]) : 100000;
+    const int burst = 16; // a bad frame logs a handful of records at once
+    std::ofstream null("/dev/null");
+
+    std::vector<int64_t> per_call;
+    per_call.reserve(bursts);
+    uint64_t drops = 0;
+    {
+        AsyncLog log(null, 4096);
+        for (long i = 0; i < bursts; ++i) {
+            int64_t t0 = AsyncLog::now_ns();
+            for (int k = 0; k < burst; ++k) {
+                log.log(bench_event, i, k, i, -k, 42);
+            }
+            per_call.push_back((AsyncLog::now_ns() - t0) / burst);
+            // leave the writer time to keep up, as a playout loop sleeping between frames would
+            if (i % 16 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        drops = log.drops();
+    }
+    std::sort(per_call.begin(), per_call.end());
+    auto pct = [&](double p) { return per_call[std::min(per_call.size() - 1, (size_t) (p * per_call.size()))]; };
+    clog << "records " << bursts * burst << " dropped " << drops << std::endl;
+    clog << "ns per log() call, averaged over bursts of " << burst << ": p50 " << pct(0.5) << " p99 " << pct(0.99)
+         << " p99.9 " << pct(0.999) << " max " << per_call.back() << std::endl;
+
+    // with nothing draining, every call past capacity must return straight away
+    AsyncLog full(null, 1024);
+    for (int i = 0; i < 1024; ++i) {
+        full.log(bench_event, i);
+    }
+    int64_t t0 = AsyncLog::now_ns();
+    long rejected = 0;
+    for (int i = 0; i < 100000; ++i) {
+        rejected += full.log(bench_event, i) ? 0 : 1;
+    }
+    clog << "ns per call into a full ring " << (AsyncLog::now_ns() - t0) / 100000.0 << " (" << rejected
+         << " of 100000 dropped; the writer may have drained some)" << std::endl;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+
+#include "DeckLinkAPI.h"
+#include "audio_pipeline.h"
+
+/// How an output's playout loop batches its audio.
+struct AudioBatching {
+    uint32_t frames = 1;      // video frames of audio per write
+    uint32_t level_every = 1; // read the buffered level every this many frames, predict it in between
+    bool scheduled = false;   // ScheduleAudioSamples once scheduled playback runs, rather than WriteAudioSamplesSync
+    uint32_t target = 0;      // sample frames to keep buffered beyond the frame drained before the next wake, 0 for a frame
+
+    /// Parses "<frames>[x<level_every>][a][+<target>]", e.g. "4x8a+960": four frames per write, the level read
+    /// every eighth frame, scheduled writes, 960 sample frames of margin.
+    /// @retval false if spec is not of that form
+    bool parse(const std::string &spec) {
+        char *end = nullptr;
+        long k = strtol(spec.c_str(), &end, 10);
+        long n = 1;
+        if (*end == 'x') {
+            n = strtol(end + 1, &end, 10);
+        }
+        bool a = *end == 'a';
+        if (a) {
+            ++end;
+        }
+        long t = 0;
+        if (*end == '+') {
+            t = strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' || k < 1 || n < 1 || t < 0) {
+            return false;
+        }
+        frames = (uint32_t) k;
+        level_every = (uint32_t) n;
+        scheduled = a;
+        target = (uint32_t) t;
+        return true;
+    }
+
+    std::string name() const {
+        return std::to_string(frames) + "x" + std::to_string(level_every) + (scheduled ? "a" : "") +
+               (target ? "+" + std::to_string(target) : "");
+    }
+};
+
+/// The playout loop's audio step with fewer driver round trips: one write carries several frames' worth of audio,
+/// and the buffered level is read only every few frames and predicted in between from what was written since and
+/// the time passed, at the sample rate, so a loop that slips a frame does not leave the prediction ahead of the card.
+///
+/// A batch is written whenever the level, read or predicted, falls below the target plus the frame the card drains
+/// before the next wake. The target is the margin for a late wake, a slow write and the card's clock running ahead of
+/// the host's: AudioBatching's, or whatever the loop's AudioLevelController or AdaptivePreroll holds. The
+/// card so holds between the target and the target plus a batch and a frame, which is the latency traded for the
+/// calls, and a card clock running fast or slow only moves when the next batch goes.
+///
+/// With scheduled set, writes go through ScheduleAudioSamples, which queues without waiting on the driver, once the
+/// output reports scheduled playback running (asked along with the level until it does); a continuous stream
+/// ignores its stream time.
+class BatchedAudioWriter {
+public:
+    BatchedAudioWriter(IDeckLinkOutput *output, AudioPath *path, const AudioBatching &batching, uint32_t sample_rate,
+                       BMDTimeValue timeValue, BMDTimeScale timeScale)
+        : output(output), path(path), batching(batching), sample_rate(sample_rate),
+          samples_per_frame((double) sample_rate * timeValue / timeScale) {
+        target = batching.target ? batching.target : samples_per_frame;
+    }
+
+    /// What one frame's step did.
+    struct Step {
+        uint32_t buffered; // sample frames buffered before the write, read or predicted
+        bool measured;     // buffered was read from the card this frame
+        uint32_t frames;   // sample frames this frame wrote or tried to, 0 between batches
+        uint32_t written;  // of those, the ones the card took
+    };
+
+    /// Call once per video frame, after the frame has been shown.
+    Step frame() {
+        Step step{0, false, 0, 0};
+        const int64_t now = now_ns();
+        if (since_level == 0) {
+            output->GetBufferedAudioSampleFrameCount(&step.buffered);
+            calls++;
+            step.measured = true;
+            level = step.buffered;
+            level_ns = now;
+            if (batching.scheduled && !playing) {
+                // asked with the level, so an output that never starts scheduled playback costs no more than that
+                bool running = false;
+                output->IsScheduledPlaybackRunning(&running);
+                calls++;
+                playing = running;
+            }
+        }
+        else {
+            double predicted = level - (double) (now - level_ns) * sample_rate / 1e9;
+            if (predicted < 0) {
+                // a card that ran dry stops draining; count from empty
+                level -= predicted;
+                predicted = 0;
+            }
+            step.buffered = (uint32_t) predicted;
+        }
+        since_level = since_level + 1 == batching.level_every ? 0 : since_level + 1;
+
+        if (step.buffered < target + samples_per_frame) {
+            // the card would be into its margin before the next wake: top it up past target and frame in whole
+            // batches, which on the first frame, or after a raised target or a stall, is more than one
+            double batch = batching.frames * samples_per_frame;
+            uint32_t n = (uint32_t) std::max(1.0, std::ceil((target + samples_per_frame - step.buffered) / batch));
+            write_frames(batching.frames * n, step);
+            batches++;
+        }
+        level += step.written;
+        return step;
+    }
+
+    /// @retval driver calls made since construction: level reads, writes and playback state queries
+    uint64_t driver_calls() const { return calls; }
+
+    const AudioBatching &config() const { return batching; }
+
+    /// Moves the margin, e.g. to what AudioLevelController or AdaptivePreroll holds; 0 for a frame.
+    void set_target(uint32_t level) { target = level ? level : samples_per_frame; }
+
+    /// @retval sample frames kept buffered beyond the frame drained before the next wake
+    uint32_t target_level() const { return (uint32_t) llround(target); }
+
+    long batches = 0;
+
+private:
+    /// Steps the path n frames and writes them, in one call unless they wrap around the end of its loop.
+    void write_frames(uint32_t n, Step &step) {
+        const char *start = nullptr;
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            AudioFrame f = path->next(0);
+            const char *data = static_cast<const char *>(f.data);
+            if (start && data != start + (size_t) count * path->frame_bytes()) {
+                write(start, count, step);
+                start = nullptr;
+                count = 0;
+            }
+            if (!start) {
+                start = data;
+            }
+            count += f.frames;
+            step.frames += f.frames;
+        }
+        if (count) {
+            write(start, count, step);
+        }
+    }
+
+    static int64_t now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    void write(const char *data, uint32_t count, Step &step) {
+        uint32_t written = 0;
+        if (playing) {
+            output->ScheduleAudioSamples((void *) data, count, stream_time, sample_rate, &written);
+        }
+        else {
+            output->WriteAudioSamplesSync((void *) data, count, &written);
+        }
+        calls++;
+        stream_time += written;
+        step.written += written;
+    }
+
+    IDeckLinkOutput *output;
+    AudioPath *path;
+    AudioBatching batching;
+    uint32_t sample_rate;
+    double samples_per_frame;
+    double target;
+
+    double level = 0.0;       // buffered sample frames when last read, plus those written since
+    int64_t level_ns = 0;     // when it was read
+    uint32_t since_level = 0; // frames since the level was read
+    bool playing = false;     // scheduled playback seen running
+    BMDTimeValue stream_time = 0;
+    uint64_t calls = 0;
+};
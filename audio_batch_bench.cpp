@@ -0,0 +1,185 @@
+// Runs the frame loop's audio through BatchedAudioWriter under a few batching configurations at 24, 50 and 60p,
+// against fresh simulated outputs, and reports per output what each costs: driver calls and CPU per second of
+// video, the audio latency it adds (buffered level), and whether the card ran dry. Exits 1 if any output
+// underflowed. No card needed.
+//   g++ -std=c++17 -O2 -pthread -I<sdk>/include audio_batch_bench.cpp sim_decklink.cpp sim_decklink_dispatch.cpp -ldl -o audio_batch_bench
+//   ./audio_batch_bench -frames 250 -outputs 4
+//   SIM_DECKLINK_SPEED=10 ./audio_batch_bench -frames 3000 -batch 1x1,4x8,4x8a
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "audio_batch.h"
+#include "audio_pipeline.h"
+#include "display_mode_cache.h"
+#include "input_parser.h"
+#include "pacing_strategy.h"
+#include "sim_decklink.h"
+#include "signal_generator.h"
+#include "video_frame_pool.h"
+
+using std::clog;
+
+
+const int ch_count = 2;
+const int sample_rate = 48000;
+
+/// What one output did over a run.
+struct OutputResult {
+    double calls_per_s = 0.0;     // per second of video: show, pacing and the writer's level reads and writes
+    double cpu_us_per_s = 0.0;    // loop thread CPU per second of video
+    double level_avg_ms = 0.0;    // buffered audio as read, the latency batching adds
+    double level_max_ms = 0.0;
+    long card_underflows = 0;
+    long batches = 0;
+};
+
+static OutputResult run_output(const AudioBatching &batching, int fps, long frame_total, const char *signal) {
+    OutputResult r;
+    auto *sim = new SimDeckLinkOutput();
+    // a fresh simulated card each run, so its modes are enumerated into memory rather than cached in a file
+    DisplayModeCache modes;
+    modes.rebuild(sim);
+    const DisplayModeCache::Mode *displayMode = modes.find("p" + std::to_string(fps / 1000));
+    if (!displayMode || sim->EnableVideoOutput(displayMode->mode, bmdVideoOutputFlagDefault) != S_OK) {
+        std::clog << "the simulated output has no " << fps / 1000 << "p mode" << std::endl;
+        exit(1);
+    }
+    const BMDTimeValue timeValue = displayMode->timeValue;
+    const BMDTimeScale timeScale = displayMode->timeScale;
+    sim->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
+                           bmdAudioOutputStreamContinuous);
+    VideoFramePool frames(sim, displayMode->width, displayMode->height, bmdFormat8BitYUV);
+    frames.create(3);
+    AudioPath *path = make_audio_path(bmdAudioSampleType16bitInteger, ch_count, timeValue, timeScale, signal);
+    BatchedAudioWriter writer(sim, path, batching, sample_rate, timeValue, timeScale);
+    // scheduled writes need scheduled playback, which the callback strategy runs
+    PacingStrategy *pacing = make_pacing_strategy(batching.scheduled ? "callback" : "pacer", sim, timeValue, timeScale);
+
+    long measured = 0;
+    double level_sum = 0.0;
+    uint32_t level_max = 0;
+    int64_t cpu0 = FramePacer::thread_cpu_ns();
+    pacing->start();
+    for (long frame = 0; frame < frame_total; ++frame) {
+        pacing->wait();
+        pacing->show(frames.next(frame));
+        BatchedAudioWriter::Step step = writer.frame();
+        if (step.measured && frame > 0) {
+            measured++;
+            level_sum += step.buffered;
+            level_max = std::max(level_max, step.buffered);
+        }
+    }
+    int64_t cpu = FramePacer::thread_cpu_ns() - cpu0;
+    pacing->stop();
+    double video_s = (double) frame_total * timeValue / timeScale;
+    r.calls_per_s = (pacing->driver_calls() + frame_total + writer.driver_calls()) / video_s;
+    r.cpu_us_per_s = cpu / 1e3 / video_s;
+    r.level_avg_ms = measured ? level_sum / measured * 1000.0 / sample_rate : 0.0;
+    r.level_max_ms = level_max * 1000.0 / sample_rate;
+    r.card_underflows = sim->stats().audio_underflows;
+    r.batches = writer.batches;
+    delete pacing;
+    delete path;
+    // stops the card's thread, so it does not run on through the next configuration
+    sim->DisableAudioOutput();
+    sim->DisableVideoOutput();
+    return r;
+}
+
+
+int main(int argc, char **argv) {
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" -frames <n> per run (default 250), -outputs <n> run side by side, each its own simulated card and thread (default 1)"<<std::endl;
+        std::clog <<" -batch <list> of <frames per write>[x<read level every n frames>][a for scheduled writes][+<target sample frames>] (default 1x1,2x2,4x4,4x8,4x8a,8x25a)"<<std::endl;
+        std::clog <<" -csv <file> one row per rate and configuration; set SIM_DECKLINK_SPEED to run in accelerated virtual time"<<std::endl;
+        exit(0);
+    }
+    long frame_total = input.cmdOptionExists("-frames") ? atol(input.getCmdOption("-frames").c_str()) : 250;
+    int outputs = input.cmdOptionExists("-outputs") ? std::max(1, atoi(input.getCmdOption("-outputs").c_str())) : 1;
+    std::vector<AudioBatching> configs;
+    for (const std::string &spec : split(input.cmdOptionExists("-batch") ? input.getCmdOption("-batch")
+                                                                          : "1x1,2x2,4x4,4x8,4x8a,8x25a", ',')) {
+        AudioBatching b;
+        if (!b.parse(spec)) {
+            clog << "bad batching " << spec << std::endl;
+            exit(1);
+        }
+        configs.push_back(b);
+    }
+
+    std::vector<char> signal((size_t) sample_rate * ch_count * 2);
+    SignalGenerator generator(sample_rate, ch_count, 16);
+    for (int c = 0; c < ch_count; ++c) {
+        generator.set_sine(c, 1000, -15);
+    }
+    generator.fill(signal.data(), sample_rate);
+
+    struct Row {
+        int fps;
+        std::string config;
+        OutputResult mean; // over outputs
+        long underflows;   // summed over outputs
+    };
+    std::vector<Row> rows;
+    char line[512];
+    snprintf(line, sizeof(line), "%-4s %-11s %-9s %8s %11s %18s %8s %11s", "fps", "batch", "pacing", "calls/s",
+             "cpu us/s", "level ms avg/max", "batches", "underflows");
+    clog << line << std::endl;
+    for (int fps : {24000, 50000, 60000}) {
+        for (const AudioBatching &b : configs) {
+            std::vector<OutputResult> results(outputs);
+            std::vector<std::thread> threads;
+            for (int o = 0; o < outputs; ++o) {
+                threads.emplace_back([&, o] { results[o] = run_output(b, fps, frame_total, signal.data()); });
+            }
+            for (std::thread &t : threads) {
+                t.join();
+            }
+            Row row{fps / 1000, b.name(), OutputResult(), 0};
+            for (const OutputResult &r : results) {
+                row.mean.calls_per_s += r.calls_per_s / outputs;
+                row.mean.cpu_us_per_s += r.cpu_us_per_s / outputs;
+                row.mean.level_avg_ms += r.level_avg_ms / outputs;
+                row.mean.level_max_ms = std::max(row.mean.level_max_ms, r.level_max_ms);
+                row.mean.batches += r.batches / outputs;
+                row.underflows += r.card_underflows;
+            }
+            char level[32];
+            snprintf(level, sizeof(level), "%.1f/%.1f", row.mean.level_avg_ms, row.mean.level_max_ms);
+            snprintf(line, sizeof(line), "%-4d %-11s %-9s %8.1f %11.1f %18s %8ld %11ld", row.fps, row.config.c_str(),
+                     b.scheduled ? "callback" : "pacer", row.mean.calls_per_s, row.mean.cpu_us_per_s, level,
+                     row.mean.batches, row.underflows);
+            clog << line << std::endl;
+            rows.push_back(row);
+        }
+    }
+
+    long underflows = 0;
+    for (const Row &r : rows) {
+        underflows += r.underflows;
+    }
+    if (underflows) {
+        clog << "the cards ran dry " << underflows << " times" << std::endl;
+    }
+
+    if (input.cmdOptionExists("-csv")) {
+        std::ofstream csv(input.getCmdOption("-csv"));
+        csv << "fps,batch,outputs,frames,calls_per_s,cpu_us_per_s,level_avg_ms,level_max_ms,batches,card_underflows\n";
+        for (const Row &r : rows) {
+            csv << r.fps << "," << r.config << "," << outputs << "," << frame_total << "," << r.mean.calls_per_s << ","
+                << r.mean.cpu_us_per_s << "," << r.mean.level_avg_ms << "," << r.mean.level_max_ms << ","
+                << r.mean.batches << "," << r.underflows << "\n";
+        }
+    }
+    return underflows ? 1 : 0;
+}
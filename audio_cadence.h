@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+/// @retval samples that fall in frame n at sample_rate for a frame duration of timeValue/timeScale,
+/// taken as the difference of exact floors so the running total never drifts from sample_rate * t
+constexpr uint32_t cadence_samples(uint64_t sample_rate, uint64_t timeValue, uint64_t timeScale, uint64_t n) {
+    return (n + 1) * sample_rate * timeValue / timeScale - n * sample_rate * timeValue / timeScale;
+}
+
+static_assert(cadence_samples(48000, 1000, 25000, 7) == 1920, "25p");
+static_assert(cadence_samples(48000, 1001, 24000, 3) == 2002, "23.976p");
+static_assert(cadence_samples(48000, 1001, 30000, 0) == 1601 && cadence_samples(48000, 1001, 30000, 1) == 1602 &&
+              cadence_samples(48000, 1001, 30000, 2) == 1601 && cadence_samples(48000, 1001, 30000, 3) == 1602 &&
+              cadence_samples(48000, 1001, 30000, 4) == 1602, "29.97p");
+static_assert(cadence_samples(48000, 1001, 60000, 0) == 800 && cadence_samples(48000, 1001, 60000, 4) == 801, "59.94p");
+
+/// Cycles through the per frame sample counts for a frame rate.
+/// The pattern repeats every timeScale / gcd(sample_rate * timeValue, timeScale) frames
+/// (1 at 24/25p, 5 at 29.97/59.94p), so it is computed once into a table.
+class AudioCadence {
+public:
+    AudioCadence(uint32_t sample_rate, BMDTimeValue timeValue, BMDTimeScale timeScale)
+        : sample_rate(sample_rate), timeValue(timeValue), timeScale(timeScale) {
+        uint64_t per_frame = (uint64_t) sample_rate * timeValue;
+        uint64_t cycle = timeScale / std::gcd(per_frame, (uint64_t) timeScale);
+        table.reserve(cycle);
+        for (uint64_t n = 0; n < cycle; ++n) {
+            table.push_back(cadence_samples(sample_rate, timeValue, timeScale, n));
+            max_samples = std::max(max_samples, table.back());
+        }
+        cycle_samples = per_frame * cycle / timeScale;
+    }
+
+    /// @retval sample frames to write for the next video frame
+    uint32_t next() {
+        uint32_t count = table[pos];
+        if (++pos == table.size()) {
+            pos = 0;
+        }
+        return count;
+    }
+
+    /// @retval sample frames the next call to next() will return
+    uint32_t peek() const { return table[pos]; }
+
+    /// @retval the largest per frame count in the cycle
+    uint32_t max_count() const { return max_samples; }
+
+    /// @retval frames before the pattern repeats
+    size_t cycle_length() const { return table.size(); }
+
+    /// @retval exact sample frames in the first n frames
+    uint64_t samples_before(uint64_t n) const {
+        return n / table.size() * cycle_samples + ((n % table.size()) * sample_rate * timeValue) / timeScale;
+    }
+
+private:
+    uint32_t sample_rate;
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    std::vector<uint32_t> table;
+    size_t pos = 0;
+    uint32_t max_samples = 0;
+    uint64_t cycle_samples = 0;
+};
@@ -2,53 +2,67 @@
 #include <chrono>
 #include <cinttypes>
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
+#include <thread>
 
 #include <vector>
 #include "DeckLinkAPI.h"
+#include "async_log.h"
+#include "audio_batch.h"
+#include "audio_cadence.h"
+#include "audio_level_controller.h"
+#include "audio_pipeline.h"
+#include "audio_preroll.h"
+#include "clock_model.h"
+#include "display_mode_cache.h"
+#include "frame_pacer.h"
+#include "frame_telemetry.h"
+#include "input_parser.h"
+#include "loopback_analyzer.h"
+#include "pacing_strategy.h"
+#include "playout_setup.h"
+#include "realtime.h"
+#include "sample_convert.h"
+#include "shm_metrics.h"
+#include "signal_generator.h"
+#include "spsc_ring.h"
+#include "wav_source.h"
+#include "sim_decklink.h"
+#include "video_frame_pool.h"
 
 using namespace std::chrono;
 using std::clog;
 
-/// @retval 1 sec of sine wave
-static char *get_sine_signal(int sample_rate, int bps, int channels, int frequency, double volume) {
-    auto *data = new int16_t[sample_rate * channels * bps]; // allocate one sec
-    double scale = pow(10.0, volume / 20.0) * sqrt(2.0);
-
-    for (int i = 0; i < sample_rate; i += 1) {
-        for (int channel = 0; channel < channels; ++channel) {
-                int val = round(sin(((double) i / ((double) sample_rate / frequency)) * M_PI * 2. ) * ((1ll << (bps * 8)) / 2 - 1) * scale);
-                data[i * channels + channel] = val;
+/// @retval one plane of 1 sec of sine plus the first extra samples again, volume is the rms level in dBFS; free
+/// with delete[]
+static char *get_planar_sine(PlanarFormat format, int sample_rate, int extra, double frequency, double volume) {
+    const int size = SampleConverter::sample_bytes(format);
+    auto *data = new char[(size_t) (sample_rate + extra) * size];
+    const double amplitude = pow(10.0, volume / 20.0) * sqrt(2.0);
+    for (int i = 0; i < sample_rate + extra; ++i) {
+        double x = amplitude * sin(2 * M_PI * frequency * (i % sample_rate) / sample_rate);
+        if (format == PlanarFormat::float32) {
+            float v = (float) x;
+            memcpy(data + (size_t) i * size, &v, size);
+        }
+        else {
+            // left justified, so int24 is the top three bytes of the int32
+            int32_t v = (int32_t) lrint(x * 2147483520.0);
+            memcpy(data + (size_t) i * size, (char *) &v + 4 - size, size);
         }
     }
-
-    return reinterpret_cast<char *>(data);
+    return data;
 }
 
-
-class InputParser{
-    public:
-        InputParser (int &argc, char **argv){
-            for (int i=1; i < argc; ++i)
-                this->tokens.push_back(std::string(argv[i]));
-        }
-        const std::string& getCmdOption(const std::string &option) const{
-            std::vector<std::string>::const_iterator itr;
-            itr =  std::find(this->tokens.begin(), this->tokens.end(), option);
-            if (itr != this->tokens.end() && ++itr != this->tokens.end()){
-                return *itr;
-            }
-            static const std::string empty_string("");
-            return empty_string;
-        }
-        bool cmdOptionExists(const std::string &option) const{
-            return std::find(this->tokens.begin(), this->tokens.end(), option)
-                   != this->tokens.end();
-        }
-    private:
-        std::vector <std::string> tokens;
-};
-
+// error paths in the frame loop log through AsyncLog so reporting one underflow cannot cause the next
+static const LogEvent display_failed{"DisplayVideoFrameSync Fail", {}};
+static const LogEvent display_denied{"DisplayVideoFrameSync Access Denied", {}};
+static const LogEvent display_invalid{"DisplayVideoFrameSync Invalid arg", {}};
+static const LogEvent audio_underflow{"audio buffer underflow!", {"overflows", "underflows"}};
+static const LogEvent audio_overflow{"audio buffer overflow!", {"overflows", "underflows", "sampleFrameCount", "sampleFramesWritten"}};
+static const LogEvent producer_behind{"producer behind", {"wanted", "got", "ring underruns"}};
 
 
 const int bps = 2;
@@ -63,134 +77,428 @@ int main(int argc, char **argv){
     InputParser input(argc, argv);
     if(input.cmdOptionExists("-h")){
         std::clog <<" Choose -a for 24 fps -b for 25 fps -v for verbose"<<std::endl;
+        std::clog <<" -mode <[[w]x][h]<p|i|psf><rate>> any mode the output lists, e.g. 1080p23.98, 2160p50, 1080i59.94; -modecache <file> where its modes are kept (default /var/tmp/decklink-modes-<model>.bin)"<<std::endl;
+        std::clog <<" -pll [target] hold the audio buffer at target sample frames (default: one frame)"<<std::endl;
+        std::clog <<" -preroll [bound] start three frames deep (or at the -pll target) and tune the depth down to the least that keeps underflows per frame under bound (default 1e-3)"<<std::endl;
+        std::clog <<" -sim use the simulated output, -skew <ppm> run its clock fast or slow"<<std::endl;
+        std::clog <<" -pacer sleep to absolute deadlines instead of spinning on the clock"<<std::endl;
+        std::clog <<" -pacing <host_spin|sleep|pacer|hw_pacer|hw_poll|callback> pick the pacing strategy by name (default host_spin, pacer with -pacer)"<<std::endl;
+        std::clog <<" -batch <k>[x<n>][a][+<target>] write k frames of audio per call, read the buffered level every n frames, a: ScheduleAudioSamples once scheduled playback runs (-pacing callback), write once fewer than target sample frames (default one frame, or the -pll / -preroll depth) would be left after the next frame; the plain sine only"<<std::endl;
+        std::clog <<" -producer generate audio ahead on its own thread, the frame loop only copies it out"<<std::endl;
+        std::clog <<" -stats <seconds> print timing percentiles this often (default 10, 0 for never), -trace <file> dump the per frame trace there on SIGUSR1"<<std::endl;
+        std::clog <<" -metrics [name] publish the loop's counters to shared memory segment name (default /decklink_playout) for shm_metrics_reader"<<std::endl;
+        std::clog <<" -pool <n> frames to rotate through (default 3), -v210 send 10 bit instead of 8 bit video"<<std::endl;
+        std::clog <<" -wav <file> play a 48 kHz 16/32 bit WAV/BWF in a loop, -raw <file> the same for headerless 2 channel 16 bit PCM"<<std::endl;
+        std::clog <<" -planar <float|int24|int32> send a planar source through SampleConverter as -channels <2|8|16> (default 16) of -bits <16|32> (default 32)"<<std::endl;
+        std::clog <<" -channels/-bits on their own send the sine in that format instead of 2 channel 16 bit"<<std::endl;
+        std::clog <<" -loopback [n] capture on device n (default 0, the simulator's own input with -sim) and check it against the sine: latency, A/V offset, clicks, gaps, repeats; -timeline <file> CSV of every event"<<std::endl;
+        std::clog <<" -realtime lock memory, pin to -cpu <n> and run SCHED_FIFO at -prio <n> (default 80) after -baseline <seconds> (default 10) in the default profile"<<std::endl;
     }
-    if(input.cmdOptionExists("-a")){
-        fps = 24000;
-    }
-    if(input.cmdOptionExists("-b")){
-        // Do stuff
-        fps = 25000;
-    }
-
-    if (fps==0){
-        std::clog <<" Choose -a for 24 fps -b for 25 fps"<<std::endl;
-        exit(1);
-    }
+    const int64_t started_ns = FramePacer::now_ns();
     if(input.cmdOptionExists("-v")){
         verbose = 1;
     }
-    IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
-    IDeckLink *deckLink = nullptr;
     IDeckLinkOutput *deckLinkOutput = nullptr;
     BMDTimeValue timeValue = 0;
     BMDTimeScale timeScale = 0;
-    IDeckLinkDisplayModeIterator *displayModeIterator = nullptr;
-    IDeckLinkDisplayMode *displayMode = nullptr;
-
-    deckLinkIterator->Next(&deckLink); // use first device
-    deckLink->QueryInterface(IID_IDeckLinkOutput, (void **) &deckLinkOutput);
-    deckLinkOutput->GetDisplayModeIterator(&displayModeIterator);
-    while (displayModeIterator->Next(&displayMode) == S_OK) {
-            displayMode->GetFrameRate(&timeValue, &timeScale);
-            std::clog <<timeValue<<" == "<<timeScale<<std::endl;
-            if (displayMode->GetFieldDominance() == bmdProgressiveFrame && timeValue == 1000) {
-                if ( timeScale == fps)
-                {
-                    std::clog <<"Selected "<<timeValue<<" == "<<timeScale<<std::endl;
-                    break; //
-                }
-                else {
-                    std::clog <<"Skipping "<<timeValue<<" == "<<timeScale<<std::endl;
-                }
-            }
+    SimDeckLinkOutput *sim = nullptr;
+    std::string device_key;
+
+    if(input.cmdOptionExists("-sim")){
+        sim = new SimDeckLinkOutput();
+        sim->set_clock_skew(atof(input.getCmdOption("-skew").c_str()));
+        deckLinkOutput = sim;
+        device_key = DisplayModeCache::device_key("Simulated DeckLink");
     }
-    deckLinkOutput->EnableVideoOutput(displayMode->GetDisplayMode(), bmdVideoOutputFlagDefault);
-    deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
-                    bmdAudioOutputStreamContinuous);
+    else {
+        IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+        IDeckLink *deckLink = nullptr;
+        deckLinkIterator->Next(&deckLink); // use first device
+        deckLink->QueryInterface(IID_IDeckLinkOutput, (void **) &deckLinkOutput);
+        device_key = DisplayModeCache::device_key(deckLink);
+    }
+    // the device's modes from the cache file when it matches this model and driver, enumerated (and saved) otherwise
+    DisplayModeCache modes;
+    const DisplayModeCache::Mode *displayMode = select_display_mode(input, deckLinkOutput, device_key, modes, verbose);
+    timeValue = displayMode->timeValue;
+    timeScale = displayMode->timeScale;
+    fps = (int) displayMode->millihertz();
+    MappedAudioSource *file = open_audio_file(input, sample_rate, ch_count, bps * 8);
+    // -planar: the production chain's planar multichannel audio, converted and interleaved just before each write
+    PlanarFormat planar_format = PlanarFormat::float32;
+    SampleConverter *converter = nullptr;
+    int out_channels = file ? file->channels() : ch_count;
+    int out_bits = file ? file->bits() : bps * 8;
+    if(!file && (input.cmdOptionExists("-planar") || input.cmdOptionExists("-channels") || input.cmdOptionExists("-bits"))){
+        const bool planar = input.cmdOptionExists("-planar");
+        out_channels = input.cmdOptionExists("-channels") ? atoi(input.getCmdOption("-channels").c_str()) : planar ? 16 : ch_count;
+        out_bits = input.cmdOptionExists("-bits") ? atoi(input.getCmdOption("-bits").c_str()) : planar ? 32 : bps * 8;
+        if ((out_channels != 2 && out_channels != 8 && out_channels != 16) || (out_bits != 16 && out_bits != 32)) {
+            std::clog << "the card takes 2, 8 or 16 channels of 16 or 32 bit audio" << std::endl;
+            exit(1);
+        }
+    }
+    if(input.cmdOptionExists("-planar") && !file){
+        const std::string &name = input.getCmdOption("-planar");
+        planar_format = name == "int24" ? PlanarFormat::int24 : name == "int32" ? PlanarFormat::int32 : PlanarFormat::float32;
+        converter = new SampleConverter(planar_format, out_channels, out_bits);
+        std::clog << "converting planar " << (name.empty() ? "float" : name) << " to " << out_channels << " channel "
+                  << out_bits << " bit with the " << converter->kernel_name() << " kernel" << std::endl;
+    }
+    const BMDAudioSampleType sample_type = out_bits == 32 ? bmdAudioSampleType32bitInteger : bmdAudioSampleType16bitInteger;
+    const BMDPixelFormat pixel_format = input.cmdOptionExists("-v210") ? bmdFormat10BitYUV : bmdFormat8BitYUV;
+    displayMode = enable_video_output(deckLinkOutput, modes, mode_spec(input), verbose);
+    timeValue = displayMode->timeValue;
+    timeScale = displayMode->timeScale;
+    fps = (int) displayMode->millihertz();
+    deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz, sample_type, out_channels, bmdAudioOutputStreamContinuous);
 
-    IDeckLinkMutableVideoFrame *f = nullptr;
-    deckLinkOutput->CreateVideoFrame(displayMode->GetWidth(), displayMode->GetHeight(), displayMode->GetWidth() * 2,
-                    bmdFormat8BitYUV, bmdFrameFlagDefault, &f);
+    // bars with a frame counter, rotated through a pool so the frame being sent is never the one being drawn
+    VideoFramePool frames(deckLinkOutput, displayMode->width, displayMode->height, pixel_format);
+    frames.create(input.cmdOptionExists("-pool") ? atoi(input.getCmdOption("-pool").c_str()) : 3);
     
     BMDTimeScale hardware_time =0;
     BMDTimeScale timeInFrame =0;
     BMDTimeScale ticksPerFrame =0;
-    
-    BMDTimeScale last_hardware_time =0;
-    BMDTimeScale last_timeInFrame =0;
-    BMDTimeScale last_ticksPerFrame =0;
     deckLinkOutput->GetHardwareReferenceClock(timeScale, &hardware_time, &timeInFrame, &ticksPerFrame);
     clog << "hardware_time= "<<hardware_time<<" timeInFrame= " <<timeInFrame<<" ticksPerFrame= "<<ticksPerFrame<<std::endl;
-    last_timeInFrame = timeInFrame;
-    last_hardware_time = hardware_time;
-    last_ticksPerFrame = ticksPerFrame;
-
-    char *audio = get_sine_signal(sample_rate, bps, ch_count, 1000, -18);
-    char *audio_start = audio;
-    char *audio_end = audio + sample_rate * bps * ch_count;
-
-    auto t0 = high_resolution_clock::now();
-    const uint32_t sampleFrameCount = sample_rate * timeValue / timeScale;
-    assert(sample_rate % sampleFrameCount == 0);
-    auto long  frame_count = 0;
+
+    AudioLevelController *pll = nullptr;
+    AdaptivePreroll *preroll = nullptr;
+    if(input.cmdOptionExists("-preroll")){
+        // the PLL holds whatever depth the tuner asks for, up to its ceiling
+        double bound = atof(input.getCmdOption("-preroll").c_str());
+        preroll = new AdaptivePreroll(sample_rate, timeValue, timeScale, bound > 0 && bound < 1 ? bound : 1e-3,
+                                      atoi(input.getCmdOption("-pll").c_str()));
+        pll = new AudioLevelController(preroll->max(), sample_rate, timeValue, timeScale);
+        pll->set_target(preroll->depth());
+    }
+    else if(input.cmdOptionExists("-pll")){
+        pll = new AudioLevelController(atoi(input.getCmdOption("-pll").c_str()), sample_rate, timeValue, timeScale);
+    }
+
+    const uint32_t frame_bytes = bps * ch_count;
+    char *signal = sine_signal(sample_rate, out_bits / 8, out_channels, 1000, -18);
+
+    // -loopback: what comes back on an input is checked against the sine; noise at -40 dBFS under it makes every
+    // position in the loop distinct, so the analyser can tell which part of the loop any stretch of capture is
+    LoopbackAnalyzer *loopback = nullptr;
+    if(input.cmdOptionExists("-loopback") && !file && !converter){
+        IDeckLinkInput *deckLinkInput = nullptr;
+        if (sim) {
+            deckLinkInput = new SimDeckLinkInput(sim);
+        }
+        else {
+            IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+            IDeckLink *deckLink = nullptr;
+            int skip = atoi(input.getCmdOption("-loopback").c_str());
+            while (deckLinkIterator->Next(&deckLink) == S_OK && skip-- > 0) {
+                deckLink->Release();
+                deckLink = nullptr;
+            }
+            if (deckLink) {
+                deckLink->QueryInterface(IID_IDeckLinkInput, (void **) &deckLinkInput);
+            }
+        }
+        if (!deckLinkInput) {
+            std::clog << "no input to capture the loopback on" << std::endl;
+            exit(1);
+        }
+        add_reference_noise(signal, sample_rate, out_bits, out_channels, -40);
+        loopback = new LoopbackAnalyzer(signal, sample_rate, out_bits, out_channels);
+        auto *capture = new LoopbackCapture(deckLinkInput, loopback);
+        if (capture->start(displayMode->mode, pixel_format, sample_type, out_channels) != S_OK) {
+            std::clog << "could not start the loopback capture" << std::endl;
+            exit(1);
+        }
+        loopback->start(clog, input.cmdOptionExists("-timeline") ? input.getCmdOption("-timeline").c_str() : nullptr,
+                        stats_interval(input));
+    }
+
+    // the per frame audio step, compiled for this sample type, channel count and frame rate where there is a
+    // specialisation; the start of its loop is mirrored after the end so a frame that straddles the wrap is still one write
+    AudioPath *audio_path = make_audio_path(sample_type, out_channels, timeValue, timeScale, signal,
+                                            pll ? pll->max_correction() : 0);
+    delete[] signal;
+    const uint32_t max_write = audio_path->max_count();
+    clog << "audio path " << audio_path->name() << std::endl;
+
+    // planar loops mirrored the same way, each channel a different multiple of 250 Hz so a swapped pair shows on a capture
+    const void *planes[SampleConverter::max_channels] = {};
+    char *converted = nullptr;
+    uint32_t planar_pos = 0;
+    if (converter) {
+        for (int c = 0; c < out_channels; ++c) {
+            planes[c] = get_planar_sine(planar_format, sample_rate, max_write, 250.0 * (c + 1), -18);
+        }
+        converted = new char[(size_t) max_write * out_channels * out_bits / 8];
+    }
+
+    // the producer thread keeps up to a second of audio queued ahead of the frame loop
+    SpscAudioRing *ring = nullptr;
+    long ring_underruns = 0;
+    if(input.cmdOptionExists("-producer") && !file && !converter && !loopback && out_channels == ch_count && out_bits == bps * 8){
+        ring = new SpscAudioRing(sample_rate, frame_bytes);
+        std::thread([ring] {
+            // generated inline rather than copied from the one second loop, so there is no loop point at all
+            SignalGenerator generator(sample_rate, ch_count, bps * 8);
+            for (int channel = 0; channel < ch_count; ++channel) {
+                generator.set_sine(channel, 1000, -18 + 20 * log10(sqrt(2.0)));
+            }
+            while (1) {
+                SpscAudioRing::Spans s = ring->write_spans(ring->capacity_frames());
+                if (s.frames() < ring->capacity_frames() / 4) {
+                    std::this_thread::sleep_for(milliseconds(10));
+                    continue;
+                }
+                generator.fill(s.first, s.first_frames);
+                generator.fill(s.second, s.second_frames);
+                ring->commit_write(s.frames());
+            }
+        }).detach();
+    }
+
+    // the original spin on the host clock unless -pacer or -pacing picks another, see pacing_strategy.h
+    const bool report_pacing = input.cmdOptionExists("-pacer") || input.cmdOptionExists("-pacing");
+    std::string pacing_name = input.cmdOptionExists("-pacing") ? input.getCmdOption("-pacing")
+                              : input.cmdOptionExists("-pacer") ? "pacer" : "host_spin";
+    PacingStrategy *pacing = make_pacing_strategy(pacing_name, deckLinkOutput, timeValue, timeScale);
+    if (!pacing) {
+        std::clog << "no pacing strategy " << pacing_name << std::endl;
+        exit(1);
+    }
+
+    // -batch: fewer driver round trips per frame for a little audio latency, see audio_batch.h; the writer steps the
+    // audio path itself, so it only takes the plain sine
+    BatchedAudioWriter *batch_writer = nullptr;
+    if(input.cmdOptionExists("-batch")){
+        AudioBatching batching;
+        if (!batching.parse(input.getCmdOption("-batch"))) {
+            std::clog << "-batch takes <frames per write>[x<read the level every n frames>][a][+<target sample frames>]" << std::endl;
+            exit(1);
+        }
+        if (file || converter || ring || loopback) {
+            std::clog << "-batch only batches the plain sine, without -wav, -raw, -planar, -producer or -loopback" << std::endl;
+            exit(1);
+        }
+        if (pll) {
+            // writing whenever the level falls to the target holds it there without the PLL's corrections; the
+            // PLL's target, and from now on -preroll's depth, become the writer's
+            batching.target = pll->target_level();
+            delete pll;
+            pll = nullptr;
+        }
+        batch_writer = new BatchedAudioWriter(deckLinkOutput, audio_path, batching, sample_rate, timeValue, timeScale);
+    }
+
+    AsyncLog events;
+
+    FrameTelemetry telemetry;
+    start_telemetry(telemetry, input);
+
+    // -metrics: the loop's counters and gauges, copied to shared memory once a frame for monitoring to poll
+    ShmMetrics *metrics = nullptr;
+    int64_t published[ShmMetrics::metric_count] = {};
+    if(input.cmdOptionExists("-metrics")){
+        const std::string &name = input.getCmdOption("-metrics");
+        metrics = new ShmMetrics();
+        if (!metrics->create(name.empty() || name[0] == '-' ? "/decklink_playout" : name, 1)) {
+            std::clog << metrics->error() << std::endl;
+            exit(1);
+        }
+        metrics->set_label(0, device_key + " " + displayMode->name);
+        published[ShmMetrics::time_scale] = timeScale;
+    }
+
+    RealtimeSwitch realtime(input, fps, [&] {
+        RealtimeProfile::prefault(audio_path->loop(), audio_path->loop_bytes());
+        if (ring) {
+            RealtimeProfile::prefault(ring->buffer(), (size_t) ring->capacity_frames() * frame_bytes);
+        }
+        if (converter) {
+            for (int c = 0; c < out_channels; ++c) {
+                RealtimeProfile::prefault(planes[c], (size_t) (sample_rate + max_write) * SampleConverter::sample_bytes(planar_format));
+            }
+            RealtimeProfile::prefault(converted, (size_t) max_write * out_channels * out_bits / 8);
+        }
+        for (uint32_t i = 0; i < frames.size(); ++i) {
+            RealtimeProfile::prefault(frames.bytes(i), frames.frame_bytes());
+        }
+    });
+
+    FrameClock clock(deckLinkOutput, timeValue, timeScale, telemetry);
+
+    long  frame_count = 0;
     long underflow_count = 0;
     long overflow_count = 0;
+    pacing->start();
+    if (pacing->reading()) {
+        clock.observe(*pacing->reading(), -1);
+    }
     while (1) {
-        high_resolution_clock::time_point now;
-        do {
-                now = high_resolution_clock::now();
-        } while (duration_cast<std::chrono::duration<double> >(now - t0).count() < (double) timeValue / timeScale);
-        
-        t0 = now;
+        int64_t wake_error = pacing->wait();
+        telemetry.record(FrameTelemetry::wake_latency_ns, wake_error);
+        if (pacing->reading()) {
+            clock.observe(*pacing->reading(), frame_count);
+        }
 
-        int result = deckLinkOutput->DisplayVideoFrameSync(f);
+        int result = pacing->show(frames.next(frame_count));
+        if (frame_count == 0) {
+            std::clog << "first frame out " << (FramePacer::now_ns() - started_ns) / 1000000.0 << " ms after start"
+                      << std::endl;
+        }
+        if (result != S_OK) {
+            telemetry.count(FrameTelemetry::display_failures);
+            published[ShmMetrics::display_failures]++;
+        }
         if (result == E_FAIL){
-            clog << frame_count << "DisplayVideoFrameSync Fail" <<std::endl;
+            events.log(display_failed, frame_count);
         }
         else if(result == E_ACCESSDENIED){
-            clog << frame_count << "DisplayVideoFrameSync Access Denied" <<std::endl;
+            events.log(display_denied, frame_count);
         }
         else if(result == E_INVALIDARG){
-            clog << frame_count << "DisplayVideoFrameSync Invalid arg" <<std::endl;
-        }
-        if (verbose){
-            deckLinkOutput->GetHardwareReferenceClock(timeScale, &hardware_time, &timeInFrame, &ticksPerFrame);
-            clog << "frame= " << frame_count <<" hardware_time= "<<hardware_time<<" timeInFrame= " <<timeInFrame<<" ticksPerFrame= "<<ticksPerFrame<<std::endl;
-            clog << "frame= " << frame_count <<" diffhardware_time= "<<hardware_time-last_hardware_time<<" difftimeInFrame= " <<timeInFrame-last_timeInFrame<<" diffticksPerFrame= "<<ticksPerFrame-last_ticksPerFrame<<std::endl;
-            last_timeInFrame = timeInFrame;
-            last_hardware_time = hardware_time;
-        
-            last_ticksPerFrame = ticksPerFrame;
+            events.log(display_invalid, frame_count);
+        }
+        // a strategy that polls has already read the clock for this frame
+        if (verbose && clock.last_frame() != frame_count){
+            clock.read(frame_count);
         }
 
+        int correction = 0;
         uint32_t sampleFramesWritten = 0;
         uint32_t buffered = 0;
-        deckLinkOutput->GetBufferedAudioSampleFrameCount(&buffered);
-        if (buffered == 0) {
+        bool level_read = true;
+        BatchedAudioWriter::Step batch{0, false, 0, 0};
+        int64_t level_ns = preroll ? FramePacer::now_ns() : 0;
+        if (batch_writer) {
+            // reads the level and writes only on the frames it has to
+            batch = batch_writer->frame();
+            buffered = batch.buffered;
+            level_read = batch.measured;
+        }
+        else {
+            deckLinkOutput->GetBufferedAudioSampleFrameCount(&buffered);
+        }
+        if (level_read) {
+            telemetry.record(FrameTelemetry::audio_buffered, buffered);
+        }
+        if (buffered == 0 && level_read) {
             // Skip first one as will always be empty
             if (frame_count !=0 ){
                 underflow_count = underflow_count + 1;
-                clog << "audio buffer underflow!\n";
-                clog << "at frame " << frame_count << " overflows "<< overflow_count<<" "<<" underflows "<<underflow_count<<std::endl;
+                telemetry.count(FrameTelemetry::audio_underflows);
+                events.log(audio_underflow, frame_count, overflow_count, underflow_count);
+            }
+        }
+        if (pll) {
+            correction = pll->update(buffered, clock.read(frame_count).hardware_time);
+            published[ShmMetrics::audio_target] = pll->target_level();
+        }
+        else if (batch_writer) {
+            published[ShmMetrics::audio_target] = batch_writer->target_level();
+        }
+        AudioFrame audio = batch_writer ? AudioFrame{nullptr, batch.frames} : audio_path->next(correction);
+        uint32_t sampleFrameCount = audio.frames;
+        if (batch_writer) {
+            sampleFramesWritten = batch.written;
+        }
+        else if (ring || file) {
+            SpscAudioRing::Spans s = ring ? ring->read_spans(sampleFrameCount) : file->read_spans(sampleFrameCount);
+            if (s.frames() < sampleFrameCount) {
+                ring_underruns = ring_underruns + 1;
+                events.log(producer_behind, frame_count, sampleFrameCount, s.frames(), ring_underruns);
+                sampleFrameCount = s.frames();
+            }
+            deckLinkOutput->WriteAudioSamplesSync(s.first, s.first_frames, &sampleFramesWritten);
+            if (s.second_frames && sampleFramesWritten == s.first_frames) {
+                uint32_t more = 0;
+                deckLinkOutput->WriteAudioSamplesSync(s.second, s.second_frames, &more);
+                sampleFramesWritten += more;
+            }
+            if (ring) {
+                ring->commit_read(s.frames());
+            }
+            else {
+                file->commit_read(s.frames());
+            }
+        }
+        else if (converter) {
+            converter->convert(planes, planar_pos, sampleFrameCount, converted);
+            deckLinkOutput->WriteAudioSamplesSync(converted, sampleFrameCount, &sampleFramesWritten);
+            planar_pos = (planar_pos + sampleFrameCount) % sample_rate;
+        }
+        else {
+            int64_t write_ns = loopback ? FramePacer::now_ns() : 0;
+            deckLinkOutput->WriteAudioSamplesSync((void *) audio.data, sampleFrameCount,
+                            &sampleFramesWritten);
+            if (loopback) {
+                uint32_t loop_position = (uint32_t) (((const char *) audio.data - (const char *) audio_path->loop()) /
+                                                     audio_path->frame_bytes());
+                loopback->sent(SentFrame{frame_count, write_ns, loop_position, sampleFrameCount, sampleFramesWritten,
+                                         buffered});
             }
         }
-        deckLinkOutput->WriteAudioSamplesSync(audio, sampleFrameCount,
-                        &sampleFramesWritten);
         if (sampleFramesWritten < sampleFrameCount) {
                 overflow_count = overflow_count + 1;
-
-            clog << "audio buffer overflow!\n";
-            clog << "at frame " << frame_count << " overflows "<< overflow_count<<" "<<" underflows "<<underflow_count<<std::endl;
-            clog << "audio overflow frame_count= " << frame_count << " sampleFrameCount= "<<sampleFrameCount<<" sampleFramesWritten= " << sampleFramesWritten
-                 << " Diff= "<<  sampleFrameCount - sampleFramesWritten << std::endl;
+                telemetry.count(FrameTelemetry::audio_overflows);
+            events.log(audio_overflow, frame_count, overflow_count, underflow_count, sampleFrameCount,
+                       sampleFramesWritten);
          }
-        audio += sampleFrameCount * bps * ch_count;
-        if (audio == audio_end) {
-                audio = audio_start;
+        if (preroll && level_read) {
+            uint32_t depth = preroll->update(buffered, FramePacer::now_ns() - level_ns);
+            if (batch_writer) {
+                batch_writer->set_target(depth);
+            }
+            else {
+                pll->set_target(depth);
+            }
+        }
+        telemetry.end_frame(frame_count);
+        if (metrics) {
+            published[ShmMetrics::frames] = frame_count + 1;
+            published[ShmMetrics::audio_underflows] = underflow_count;
+            published[ShmMetrics::audio_overflows] = overflow_count;
+            if (level_read) {
+                published[ShmMetrics::audio_buffered] = buffered;
+            }
+            published[ShmMetrics::wake_latency_ns] = wake_error;
+            if (clock.readings) {
+                published[ShmMetrics::hardware_time] = clock.last.hardware_time;
+                published[ShmMetrics::time_in_frame] = clock.last.timeInFrame;
+                published[ShmMetrics::clock_delta] = clock.delta;
+                published[ShmMetrics::off_nominal_frames] = clock.off_nominal;
+            }
+            metrics->publish(0, published);
         }
         frame_count = frame_count + 1;
+        realtime.frame(frame_count, telemetry, events);
         if (frame_count % (fps /1000) == 0){
-            clog << frame_count <<std::endl;
+            clog << frame_count;
+            if (pll) {
+                clog << " buffered " << buffered << " target " << pll->target_level() << " ppm " << pll->ppm()
+                     << " inserted " << pll->inserted << " dropped " << pll->dropped;
+            }
+            if (preroll) {
+                clog << " preroll " << preroll->depth() * 1000.0 / sample_rate << " ms underflow rate "
+                     << preroll->underflow_rate() << " over " << preroll->evidence() << " frames near misses "
+                     << preroll->near_misses << " grown " << preroll->grown << " shrunk " << preroll->shrunk;
+            }
+            if (report_pacing && pacing->stats.frames) {
+                clog << " " << pacing->name() << " wake error avg " << pacing->stats.sum_wake_error_ns / pacing->stats.frames / 1000
+                     << "us max " << pacing->stats.max_wake_error_ns / 1000 << "us late " << pacing->stats.late
+                     << " cpu " << 100.0 * pacing->stats.cpu_ns / pacing->stats.wall_ns << "%";
+                pacing->reset_stats();
+            }
+            if (batch_writer) {
+                clog << " batch " << batch_writer->config().name() << " target " << batch_writer->target_level()
+                     << " audio calls " << batch_writer->driver_calls() << " in " << batch_writer->batches << " batches";
+            }
+            ClockEstimate e = clock.model.estimate();
+            if (e.samples) {
+                clog << " card clock " << e.rate_ppm << " ppm jitter " << e.jitter_ns / 1000 << "us";
+            }
+            clog << std::endl;
         }
     }
 }
@@ -3,53 +3,28 @@
 #include <cinttypes>
 #include <cmath>
 #include <iostream>
+#include <cstring>
 #include <algorithm>
 
 #include <vector>
 #include "DeckLinkAPI.h"
+#include "async_log.h"
+#include "audio_cadence.h"
+#include "frame_telemetry.h"
+#include "input_parser.h"
+#include "pacing_strategy.h"
+#include "playout_setup.h"
+#include "video_frame_pool.h"
 
 using namespace std::chrono;
 using std::clog;
 
-/// @retval 1 sec of sine wave
-static char *get_sine_signal(int sample_rate, int bps, int channels, int frequency, double volume) {
-    auto *data = new int16_t[sample_rate * channels * bps]; // allocate one sec
-    double scale = pow(10.0, volume / 20.0) * sqrt(2.0);
-
-    for (int i = 0; i < sample_rate; i += 1) {
-        for (int channel = 0; channel < channels; ++channel) {
-                int val = round(sin(((double) i / ((double) sample_rate / frequency)) * M_PI * 2. ) * ((1ll << (bps * 8)) / 2 - 1) * scale);
-                data[i * channels + channel] = val;
-        }
-    }
-
-    return reinterpret_cast<char *>(data);
-}
-
-
-class InputParser{
-    public:
-        InputParser (int &argc, char **argv){
-            for (int i=1; i < argc; ++i)
-                this->tokens.push_back(std::string(argv[i]));
-        }
-        const std::string& getCmdOption(const std::string &option) const{
-            std::vector<std::string>::const_iterator itr;
-            itr =  std::find(this->tokens.begin(), this->tokens.end(), option);
-            if (itr != this->tokens.end() && ++itr != this->tokens.end()){
-                return *itr;
-            }
-            static const std::string empty_string("");
-            return empty_string;
-        }
-        bool cmdOptionExists(const std::string &option) const{
-            return std::find(this->tokens.begin(), this->tokens.end(), option)
-                   != this->tokens.end();
-        }
-    private:
-        std::vector <std::string> tokens;
-};
-
+// error paths in the frame loop log through AsyncLog so reporting one underflow cannot cause the next
+static const LogEvent display_failed{"DisplayVideoFrameSync Fail", {}};
+static const LogEvent display_denied{"DisplayVideoFrameSync Access Denied", {}};
+static const LogEvent display_invalid{"DisplayVideoFrameSync Invalid arg", {}};
+static const LogEvent audio_underflow{"audio buffer underflow!", {"overflows", "underflows"}};
+static const LogEvent audio_overflow{"audio buffer overflow!", {"overflows", "underflows", "sampleFrameCount", "sampleFramesWritten"}};
 
 
 const int bps = 2;
@@ -64,18 +39,13 @@ int main(int argc, char **argv){
     InputParser input(argc, argv);
     if(input.cmdOptionExists("-h")){
         std::clog <<" Choose -a for 24 fps -b for 25 fps -v for verbose"<<std::endl;
-    }
-    if(input.cmdOptionExists("-a")){
-        fps = 24000;
-    }
-    if(input.cmdOptionExists("-b")){
-        // Do stuff
-        fps = 25000;
-    }
-
-    if (fps==0){
-        std::clog <<" Choose -a for 24 fps -b for 25 fps"<<std::endl;
-        exit(1);
+        std::clog <<" -mode <[[w]x][h]<p|i|psf><rate>> any mode the output lists, e.g. 1080p23.98, 2160p50, 1080i59.94; -modecache <file> where its modes are kept (default /var/tmp/decklink-modes-<model>.bin)"<<std::endl;
+        std::clog <<" -pacer sleep to the predicted hardware frame edge instead of polling the hardware clock"<<std::endl;
+        std::clog <<" -pacing <host_spin|sleep|pacer|hw_pacer|hw_poll|callback> pick the pacing strategy by name (default hw_poll, hw_pacer with -pacer)"<<std::endl;
+        std::clog <<" -stats <seconds> print timing percentiles this often (default 10, 0 for never), -trace <file> dump the per frame trace there on SIGUSR1"<<std::endl;
+        std::clog <<" -pool <n> frames to rotate through (default 3), -v210 send 10 bit instead of 8 bit video"<<std::endl;
+        std::clog <<" -wav <file> play a 48 kHz 16/32 bit WAV/BWF in a loop, -raw <file> the same for headerless 2 channel 16 bit PCM"<<std::endl;
+        std::clog <<" -realtime lock memory, pin to -cpu <n> and run SCHED_FIFO at -prio <n> (default 80) after -baseline <seconds> (default 10) in the default profile"<<std::endl;
     }
     if(input.cmdOptionExists("-v")){
         verbose = 1;
@@ -83,137 +53,158 @@ int main(int argc, char **argv){
     IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
     IDeckLink *deckLink = nullptr;
     IDeckLinkOutput *deckLinkOutput = nullptr;
-    BMDTimeValue timeValue = 0;
-    BMDTimeScale timeScale = 0;
-    IDeckLinkDisplayModeIterator *displayModeIterator = nullptr;
-    IDeckLinkDisplayMode *displayMode = nullptr;
 
     deckLinkIterator->Next(&deckLink); // use first device
     deckLink->QueryInterface(IID_IDeckLinkOutput, (void **) &deckLinkOutput);
-    deckLinkOutput->GetDisplayModeIterator(&displayModeIterator);
-    while (displayModeIterator->Next(&displayMode) == S_OK) {
-            displayMode->GetFrameRate(&timeValue, &timeScale);
-            std::clog <<timeValue<<" == "<<timeScale<<std::endl;
-            if (displayMode->GetFieldDominance() == bmdProgressiveFrame && timeValue == 1000) {
-                if ( timeScale == fps)
-                {
-                    std::clog <<"Selected "<<timeValue<<" == "<<timeScale<<std::endl;
-                    break; //
-                }
-                else {
-                    std::clog <<"Skipping "<<timeValue<<" == "<<timeScale<<std::endl;
-                }
-            }
-    }
-    deckLinkOutput->EnableVideoOutput(displayMode->GetDisplayMode(), bmdVideoOutputFlagDefault);
-    deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
-                    bmdAudioOutputStreamContinuous);
-
-    IDeckLinkMutableVideoFrame *f = nullptr;
-    deckLinkOutput->CreateVideoFrame(displayMode->GetWidth(), displayMode->GetHeight(), displayMode->GetWidth() * 2,
-                    bmdFormat8BitYUV, bmdFrameFlagDefault, &f);
+    // the device's modes from the cache file when it matches this model and driver, enumerated (and saved) otherwise
+    const std::string device_key = DisplayModeCache::device_key(deckLink);
+    DisplayModeCache modes;
+    select_display_mode(input, deckLinkOutput, device_key, modes, verbose);
+    MappedAudioSource *file = open_audio_file(input, sample_rate, ch_count, bps * 8);
+    const DisplayModeCache::Mode *displayMode = enable_video_output(deckLinkOutput, modes, mode_spec(input), verbose);
+    const BMDTimeValue timeValue = displayMode->timeValue;
+    const BMDTimeScale timeScale = displayMode->timeScale;
+    fps = (int) displayMode->millihertz();
+    deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz,
+                    file && file->bits() == 32 ? bmdAudioSampleType32bitInteger : bmdAudioSampleType16bitInteger,
+                    file ? file->channels() : ch_count, bmdAudioOutputStreamContinuous);
+
+    // bars with a frame counter, rotated through a pool so the frame being sent is never the one being drawn
+    VideoFramePool frames(deckLinkOutput, displayMode->width, displayMode->height,
+                          input.cmdOptionExists("-v210") ? bmdFormat10BitYUV : bmdFormat8BitYUV);
+    frames.create(input.cmdOptionExists("-pool") ? atoi(input.getCmdOption("-pool").c_str()) : 3);
     
     BMDTimeScale hardware_time =0;
     BMDTimeScale timeInFrame =0;
     BMDTimeScale ticksPerFrame =0;
-    
-    BMDTimeScale last_hardware_time =0;
-    BMDTimeScale last_timeInFrame =0;
-    BMDTimeScale last_ticksPerFrame =0;
     deckLinkOutput->GetHardwareReferenceClock(timeScale, &hardware_time, &timeInFrame, &ticksPerFrame);
     clog << "hardware_time= "<<hardware_time<<" timeInFrame= " <<timeInFrame<<" ticksPerFrame= "<<ticksPerFrame<<std::endl;
-    last_timeInFrame = timeInFrame;
-    last_hardware_time = hardware_time;
-    last_ticksPerFrame = ticksPerFrame;
 
-    char *audio = get_sine_signal(sample_rate, bps, ch_count, 1000, -18);
+    AudioCadence cadence(sample_rate, timeValue, timeScale);
+    const uint32_t frame_bytes = bps * ch_count;
+    // the start of the loop is mirrored after its end so a frame that straddles the wrap is still one write
+    char *signal = sine_signal(sample_rate, bps, ch_count, 1000, -18);
+    char *audio = new char[(sample_rate + cadence.max_count()) * frame_bytes];
+    memcpy(audio, signal, sample_rate * frame_bytes);
+    memcpy(audio + sample_rate * frame_bytes, signal, cadence.max_count() * frame_bytes);
+    delete[] signal;
     char *audio_start = audio;
-    char *audio_end = audio + sample_rate * bps * ch_count;
-
-    auto BMDTimeValue t0 = 0;
-    BMDTimeValue blk_hardware_time;
-    BMDTimeValue blk_timeInFrame;
-    BMDTimeValue blk_ticksPerFrame;
-    BMDTimeValue last_blk_ticksPerFrame =0;
-
-    
-    deckLinkOutput->GetHardwareReferenceClock(timeScale, &t0, &blk_timeInFrame, &blk_ticksPerFrame);
+    char *audio_end = audio + sample_rate * frame_bytes;
+
+    // polls the card's clock for each frame edge, or with -pacer sleeps to where it predicts the edge, see pacing_strategy.h
+    const bool report_pacing = input.cmdOptionExists("-pacer") || input.cmdOptionExists("-pacing");
+    std::string pacing_name = input.cmdOptionExists("-pacing") ? input.getCmdOption("-pacing")
+                              : input.cmdOptionExists("-pacer") ? "hw_pacer" : "hw_poll";
+    PacingStrategy *pacing = make_pacing_strategy(pacing_name, deckLinkOutput, timeValue, timeScale);
+    if (!pacing) {
+        std::clog << "no pacing strategy " << pacing_name << std::endl;
+        exit(1);
+    }
 
-    const uint32_t sampleFrameCount = sample_rate * timeValue / timeScale;
-    assert(sample_rate % sampleFrameCount == 0);
     long  frame_count = 0;
     long underflow_count = 0;
     long overflow_count = 0;
-    
-    
-    
 
-    
-    deckLinkOutput->GetHardwareReferenceClock(timeScale, &blk_hardware_time, &blk_timeInFrame, &blk_ticksPerFrame);
-    
+    AsyncLog events;
+
+    FrameTelemetry telemetry;
+    start_telemetry(telemetry, input);
+
+    RealtimeSwitch realtime(input, fps, [&] {
+        RealtimeProfile::prefault(audio_start, (sample_rate + cadence.max_count()) * frame_bytes);
+        for (uint32_t i = 0; i < frames.size(); ++i) {
+            RealtimeProfile::prefault(frames.bytes(i), frames.frame_bytes());
+        }
+    });
+
+    FrameClock clock(deckLinkOutput, timeValue, timeScale, telemetry);
+
+    pacing->start();
+    if (pacing->reading()) {
+        clock.observe(*pacing->reading(), -1);
+    }
     while (1) {
-        BMDTimeValue now=0;
-        BMDTimeValue last_blk_ticksPerFrame = blk_ticksPerFrame;
-        do {
-                deckLinkOutput->GetHardwareReferenceClock(timeScale, &now, &blk_timeInFrame, &blk_ticksPerFrame);
-            if (last_blk_ticksPerFrame != blk_ticksPerFrame){
-                clog << "TICKS CHANGED blk_ticksPerFrame " << blk_ticksPerFrame << " last_blk_ticksPerFrame " << last_blk_ticksPerFrame << " diff " <<last_blk_ticksPerFrame - blk_ticksPerFrame <<std::endl;
-            }
-        } while (now - t0 < blk_ticksPerFrame);
-        if(now -t0 != 1000) {
-            clog << "blk_ticksPerFrame " << blk_ticksPerFrame  << " blk_timeInFrame "<< blk_timeInFrame << " now " <<now<<" t0 "<<t0<<" diff "<<now -t0<<std::endl;
+        uint64_t calls = pacing->driver_calls();
+        telemetry.record(FrameTelemetry::wake_latency_ns, pacing->wait());
+        if (pacing->driver_calls() != calls) {
+            telemetry.record(FrameTelemetry::clock_polls, pacing->driver_calls() - calls);
+        }
+        if (pacing->reading()) {
+            clock.observe(*pacing->reading(), frame_count);
         }
-        t0 = now;
-        
 
-        int result = deckLinkOutput->DisplayVideoFrameSync(f);
+        int result = pacing->show(frames.next(frame_count));
+        if (result != S_OK) {
+            telemetry.count(FrameTelemetry::display_failures);
+        }
         if (result == E_FAIL){
-            clog << frame_count << "DisplayVideoFrameSync Fail" <<std::endl;
+            events.log(display_failed, frame_count);
         }
         else if(result == E_ACCESSDENIED){
-            clog << frame_count << "DisplayVideoFrameSync Access Denied" <<std::endl;
+            events.log(display_denied, frame_count);
         }
         else if(result == E_INVALIDARG){
-            clog << frame_count << "DisplayVideoFrameSync Invalid arg" <<std::endl;
+            events.log(display_invalid, frame_count);
         }
-        if (verbose){
-            deckLinkOutput->GetHardwareReferenceClock(timeScale, &hardware_time, &timeInFrame, &ticksPerFrame);
-            clog << "frame= " << frame_count <<" hardware_time= "<<hardware_time<<" timeInFrame= " <<timeInFrame<<" ticksPerFrame= "<<ticksPerFrame<<std::endl;
-            clog << "frame= " << frame_count <<" diffhardware_time= "<<hardware_time-last_hardware_time<<" difftimeInFrame= " <<timeInFrame-last_timeInFrame<<" diffticksPerFrame= "<<ticksPerFrame-last_ticksPerFrame<<std::endl;
-            last_timeInFrame = timeInFrame;
-            last_hardware_time = hardware_time;
-        
-            last_ticksPerFrame = ticksPerFrame;
+        // a strategy that polls has already read the clock for this frame
+        if (verbose && clock.last_frame() != frame_count){
+            clock.read(frame_count);
         }
 
+        const uint32_t sampleFrameCount = cadence.next();
         uint32_t sampleFramesWritten = 0;
         uint32_t buffered = 0;
         deckLinkOutput->GetBufferedAudioSampleFrameCount(&buffered);
+        telemetry.record(FrameTelemetry::audio_buffered, buffered);
         if (buffered == 0) {
             // Skip first one as will always be empty
             if (frame_count !=0 ){
                 underflow_count = underflow_count + 1;
-                clog << "audio buffer underflow!\n";
-                clog << "at frame " << frame_count << " overflows "<< overflow_count<<" "<<" underflows "<<underflow_count<<std::endl;
+                telemetry.count(FrameTelemetry::audio_underflows);
+                events.log(audio_underflow, frame_count, overflow_count, underflow_count);
             }
         }
-        deckLinkOutput->WriteAudioSamplesSync(audio, sampleFrameCount,
-                        &sampleFramesWritten);
+        if (file) {
+            // two writes where the file loops, each straight from the mapping
+            SpscAudioRing::Spans s = file->read_spans(sampleFrameCount);
+            deckLinkOutput->WriteAudioSamplesSync(s.first, s.first_frames, &sampleFramesWritten);
+            if (s.second_frames && sampleFramesWritten == s.first_frames) {
+                uint32_t more = 0;
+                deckLinkOutput->WriteAudioSamplesSync(s.second, s.second_frames, &more);
+                sampleFramesWritten += more;
+            }
+            file->commit_read(s.frames());
+        }
+        else {
+            deckLinkOutput->WriteAudioSamplesSync(audio, sampleFrameCount,
+                            &sampleFramesWritten);
+        }
         if (sampleFramesWritten < sampleFrameCount) {
                 overflow_count = overflow_count + 1;
-
-            clog << "audio buffer overflow!\n";
-            clog << "at frame " << frame_count << " overflows "<< overflow_count<<" "<<" underflows "<<underflow_count<<std::endl;
-            clog << "audio overflow frame_count= " << frame_count << " sampleFrameCount= "<<sampleFrameCount<<" sampleFramesWritten= " << sampleFramesWritten
-                 << " Diff= "<<  sampleFrameCount - sampleFramesWritten << std::endl;
+                telemetry.count(FrameTelemetry::audio_overflows);
+            events.log(audio_overflow, frame_count, overflow_count, underflow_count, sampleFrameCount,
+                       sampleFramesWritten);
          }
-        audio += sampleFrameCount * bps * ch_count;
-        if (audio == audio_end) {
-                audio = audio_start;
+        audio += sampleFrameCount * frame_bytes;
+        if (audio >= audio_end) {
+                audio -= audio_end - audio_start;
         }
+        telemetry.end_frame(frame_count);
         frame_count = frame_count + 1;
+        realtime.frame(frame_count, telemetry, events);
         if (frame_count % (fps /1000) == 0){
-            clog << frame_count <<std::endl;
+            clog << frame_count;
+            if (report_pacing && pacing->stats.frames) {
+                clog << " " << pacing->name() << " wake error avg " << pacing->stats.sum_wake_error_ns / pacing->stats.frames / 1000
+                     << "us max " << pacing->stats.max_wake_error_ns / 1000 << "us late " << pacing->stats.late
+                     << " cpu " << 100.0 * pacing->stats.cpu_ns / pacing->stats.wall_ns << "%";
+                pacing->reset_stats();
+            }
+            ClockEstimate e = clock.model.estimate();
+            if (e.samples) {
+                clog << " card clock " << e.rate_ppm << " ppm jitter " << e.jitter_ns / 1000 << "us";
+            }
+            clog << std::endl;
         }
     }
 }
@@ -0,0 +1,109 @@
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+
+#include <vector>
+#include "DeckLinkAPI.h"
+#include "input_parser.h"
+#include "playout_setup.h"
+#include "scheduled_playout.h"
+#include "sim_decklink.h"
+
+using namespace std::chrono;
+using std::clog;
+
+const int bps = 2;
+const int ch_count = 2;
+const int sample_rate = 48000;
+
+int fps = 24000;
+int verbose = 0;
+// cleanup & error checks are intentionally skipped
+int main(int argc, char **argv){
+
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" Choose -a for 24 fps -b for 25 fps -v for verbose"<<std::endl;
+        std::clog <<" -mode <[[w]x][h]<p|i|psf><rate>> any mode the output lists, e.g. 1080p23.98, 2160p50, 1080i59.94; -modecache <file> where its modes are kept (default /var/tmp/decklink-modes-<model>.bin)"<<std::endl;
+        std::clog <<" -p <frames> preroll depth, -n <frames> stop after n frames, -sim use the simulated output"<<std::endl;
+        std::clog <<" -v210 send 10 bit instead of 8 bit video"<<std::endl;
+    }
+    if(input.cmdOptionExists("-v")){
+        verbose = 1;
+    }
+    uint32_t preroll = 3;
+    if(!input.getCmdOption("-p").empty()){
+        preroll = std::max(1, atoi(input.getCmdOption("-p").c_str()));
+    }
+    long run_frames = 0;
+    if(!input.getCmdOption("-n").empty()){
+        run_frames = atol(input.getCmdOption("-n").c_str());
+    }
+
+    IDeckLinkOutput *deckLinkOutput = nullptr;
+    std::string device_key;
+    if(input.cmdOptionExists("-sim")){
+        deckLinkOutput = new SimDeckLinkOutput();
+        device_key = DisplayModeCache::device_key("Simulated DeckLink");
+    }
+    else {
+        IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+        IDeckLink *deckLink = nullptr;
+        deckLinkIterator->Next(&deckLink); // use first device
+        deckLink->QueryInterface(IID_IDeckLinkOutput, (void **) &deckLinkOutput);
+        device_key = DisplayModeCache::device_key(deckLink);
+    }
+
+    // the device's modes from the cache file when it matches this model and driver, enumerated (and saved) otherwise
+    DisplayModeCache modes;
+    select_display_mode(input, deckLinkOutput, device_key, modes, verbose);
+    const DisplayModeCache::Mode *displayMode = enable_video_output(deckLinkOutput, modes, mode_spec(input), verbose);
+    fps = (int) displayMode->millihertz();
+    deckLinkOutput->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
+                    bmdAudioOutputStreamTimestamped);
+
+    char *audio = sine_signal(sample_rate, bps, ch_count, 1000, -18);
+    ScheduledPlayout playout(deckLinkOutput, *displayMode, preroll, audio, sample_rate, bps * ch_count, sample_rate,
+                             input.cmdOptionExists("-v210") ? bmdFormat10BitYUV : bmdFormat8BitYUV);
+    if (playout.start() != S_OK) {
+        clog << "failed to start scheduled playback" << std::endl;
+        exit(1);
+    }
+
+    // the card paces everything from here, this thread only wakes to report
+    long last_late = 0;
+    long last_dropped = 0;
+    long last_underflows = 0;
+    while (run_frames == 0 || playout.completed < run_frames) {
+        long next = playout.completed + fps / 1000;
+        playout.wait_for(run_frames ? std::min(next, run_frames) : next, seconds(2));
+        if (playout.late != last_late || playout.dropped != last_dropped || playout.audio_underflows != last_underflows) {
+            clog << "at frame " << playout.completed << " late " << playout.late << " dropped " << playout.dropped
+                 << " audio underflows " << playout.audio_underflows << std::endl;
+            last_late = playout.late;
+            last_dropped = playout.dropped;
+            last_underflows = playout.audio_underflows;
+        }
+        else if (verbose) {
+            clog << playout.completed << std::endl;
+        }
+    }
+    playout.stop();
+    // nothing reads the sine once the audio callback is gone
+    deckLinkOutput->SetAudioCallback(nullptr);
+    deckLinkOutput->DisableAudioOutput();
+    delete[] audio;
+
+    clog << "frames " << playout.completed << " late " << playout.late << " dropped " << playout.dropped
+         << " audio underflows " << playout.audio_underflows << std::endl;
+    if (auto *sim = dynamic_cast<SimDeckLinkOutput *>(deckLinkOutput)) {
+        SimOutputStats s = sim->stats();
+        clog << "sim displayed " << s.frames_displayed << " late " << s.frames_late << " dropped " << s.frames_dropped
+             << " video underruns " << s.video_underruns << " audio underflows " << s.audio_underflows
+             << " audio overflows " << s.audio_overflows << std::endl;
+    }
+    return playout.late + playout.dropped + playout.audio_underflows == 0 ? 0 : 2;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "DeckLinkAPI.h"
+
+/// Software PLL that holds the card's audio buffer at a target depth.
+///
+/// Every frame it is given the buffered level and the card's hardware reference clock. The rate of our frames
+/// measured on the card's clock gives the ppm offset between producer and card, which is fed forward; the level
+/// error is fed back on top. The result is accumulated and applied as whole sample inserts or drops of at most
+/// max_step per frame (4 covers about 2000 ppm at 25p), which is inaudible and needs no resampler. The only larger
+/// step is the first frame, which is padded up to the target so playout starts with that much margin.
+class AudioLevelController {
+public:
+    /// target: buffered sample frames to hold just before each write, 0 for one frame's worth; set_target() can
+    /// lower it and raise it again, never above this
+    /// settle_frames: time constant, in frames, for pulling a level error back to the target
+    AudioLevelController(uint32_t target, uint32_t sample_rate, BMDTimeValue timeValue, BMDTimeScale timeScale,
+                         uint32_t settle_frames = 250, int max_step = 4)
+        : target(target), ceiling(target), timeValue(timeValue), timeScale(timeScale), settle_frames(settle_frames),
+          max_step(max_step) {
+        samples_per_frame = (double) sample_rate * timeValue / timeScale;
+        if (target == 0) {
+            this->target = ceiling = (uint32_t) llround(samples_per_frame);
+        }
+        // forget old rate measurements over roughly a minute of frames
+        forget = 1.0 - 1.0 / (60.0 * timeScale / timeValue);
+    }
+
+    /// Call once per frame before writing audio.
+    /// hardware_time must be in the mode's timeScale, as returned by GetHardwareReferenceClock(timeScale, ...).
+    /// @retval sample frames to add to (> 0) or remove from (< 0) this frame's write, up to max_correction()
+    int update(uint32_t buffered, BMDTimeValue hardware_time) {
+        frames++;
+        if (frames == 1) {
+            last_hardware_time = hardware_time;
+            return buffered < target ? target - buffered : 0;
+        }
+        if (pad) {
+            // a raised target is padded up to at once, as on the first frame; the rate estimate skips this frame
+            int step = (int) pad;
+            pad = 0;
+            inserted += step;
+            frame_ticks = frame_ticks * forget + timeValue;
+            hardware_ticks = hardware_ticks * forget + (double) (hardware_time - last_hardware_time);
+            last_hardware_time = hardware_time;
+            return step;
+        }
+        // producer frames against elapsed card time, exponentially weighted
+        frame_ticks = frame_ticks * forget + timeValue;
+        hardware_ticks = hardware_ticks * forget + (double) (hardware_time - last_hardware_time);
+        last_hardware_time = hardware_time;
+
+        estimated_ppm = hardware_ticks > 0 ? (frame_ticks / hardware_ticks - 1.0) * 1e6 : 0.0;
+        double feed_forward = -estimated_ppm * 1e-6 * samples_per_frame;
+        double feedback = ((double) target - buffered) / settle_frames;
+        accumulator += feed_forward + feedback;
+        accumulator = std::max(-max_step - 1.0, std::min(max_step + 1.0, accumulator));
+        int step = std::max(-max_step, std::min(max_step, (int) accumulator));
+        accumulator -= step;
+        if (step > 0) {
+            inserted += step;
+        }
+        else {
+            dropped -= step;
+        }
+        return step;
+    }
+
+    /// Moves the target, clamped to the constructor's. A higher one is padded up to on the next update(); a lower
+    /// one is reached by the usual drops of at most max_step per frame, which is inaudible.
+    void set_target(uint32_t level) {
+        level = std::min(level, ceiling);
+        if (level > target && frames > 0) {
+            pad = std::min(pad + (level - target), ceiling);
+        }
+        target = level;
+    }
+
+    /// @retval estimated producer clock offset against the card, positive when we run fast
+    double ppm() const { return estimated_ppm; }
+    uint32_t target_level() const { return target; }
+    /// @retval the most update() will ever ask for on top of a frame
+    uint32_t max_correction() const { return std::max<uint32_t>(ceiling, max_step); }
+
+    long inserted = 0;
+    long dropped = 0;
+
+private:
+    uint32_t target;
+    uint32_t ceiling;
+    uint32_t pad = 0; // sample frames to add on the next update for a raised target
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    uint32_t settle_frames;
+    int max_step;
+    double samples_per_frame;
+    double forget;
+
+    long frames = 0;
+    BMDTimeValue last_hardware_time = 0;
+    double frame_ticks = 0.0;
+    double hardware_ticks = 0.0;
+    double estimated_ppm = 0.0;
+    double accumulator = 0.0;
+};
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <ratio>
+#include <utility>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "audio_cadence.h"
+
+/// One video frame's worth of audio, ready for WriteAudioSamples*.
+struct AudioFrame {
+    const void *data;
+    uint32_t frames; // sample frames
+};
+
+/// The per frame audio step of the playout loop: how many sample frames this video frame gets, where they start in
+/// a looped one second buffer, and stepping past them. next() is called once per frame by the loop; whatever
+/// decides the count (cadence, PLL correction) and the stride lives behind it.
+class AudioPath {
+public:
+    virtual ~AudioPath() = default;
+
+    /// correction: sample frames to add (> 0) or drop (< 0) this frame, at most max_correction from the constructor
+    /// @retval this frame's samples, contiguous; the loop is mirrored past its end so a frame never wraps
+    virtual AudioFrame next(int correction) = 0;
+
+    /// Copies the next frame into dst instead, for an output that needs the samples in a buffer of its own.
+    /// @retval sample frames copied
+    virtual uint32_t copy_next(void *dst, int correction) = 0;
+
+    virtual uint32_t frame_bytes() const = 0;
+    /// @retval the largest count next() can return
+    virtual uint32_t max_count() const = 0;
+    virtual const char *name() const = 0;
+
+    /// @retval a path of its own that goes on from where this one is, over the same loop: the loop is read only,
+    /// so any number of outputs can step through it without a copy each
+    virtual AudioPath *fork() const = 0;
+
+    /// The loop buffer, for prefaulting.
+    const void *loop() const { return buffer->data(); }
+    size_t loop_bytes() const { return buffer->size(); }
+
+protected:
+    /// Copies one second of interleaved audio into the loop and mirrors its start after the end.
+    void make_loop(const char *one_second, uint32_t sample_rate, uint32_t frame_bytes, uint32_t extra_frames) {
+        auto loop = std::make_shared<std::vector<char>>((size_t) (sample_rate + extra_frames) * frame_bytes);
+        memcpy(loop->data(), one_second, (size_t) sample_rate * frame_bytes);
+        memcpy(loop->data() + (size_t) sample_rate * frame_bytes, one_second, (size_t) extra_frames * frame_bytes);
+        buffer = loop;
+    }
+
+    std::shared_ptr<const std::vector<char>> buffer;
+};
+
+/// Any sample size, channel count and frame rate, all known only at run time: AudioCadence's table, and strides
+/// multiplied out every frame. The fallback for combinations make_audio_path() has no specialisation for.
+class GenericAudioPath : public AudioPath {
+public:
+    GenericAudioPath(const char *one_second, uint32_t sample_rate, int bytes_per_sample, int channels,
+                     BMDTimeValue timeValue, BMDTimeScale timeScale, int max_correction)
+        : cadence(sample_rate, timeValue, timeScale), sample_rate(sample_rate), bytes_per_sample(bytes_per_sample),
+          channels(channels), max_correction(max_correction) {
+        make_loop(one_second, sample_rate, frame_bytes(), cadence.max_count() + max_correction);
+        audio = buffer->data();
+        audio_end = buffer->data() + (size_t) sample_rate * frame_bytes();
+    }
+
+    AudioFrame next(int correction) override {
+        uint32_t count = cadence.next() + correction;
+        const char *p = audio;
+        audio += count * bytes_per_sample * channels;
+        if (audio >= audio_end) {
+            audio -= (size_t) sample_rate * bytes_per_sample * channels;
+        }
+        return {p, count};
+    }
+
+    uint32_t copy_next(void *dst, int correction) override {
+        AudioFrame f = next(correction);
+        memcpy(dst, f.data, (size_t) f.frames * bytes_per_sample * channels);
+        return f.frames;
+    }
+
+    uint32_t frame_bytes() const override { return bytes_per_sample * channels; }
+    uint32_t max_count() const override { return cadence.max_count() + max_correction; }
+    const char *name() const override { return "generic"; }
+    AudioPath *fork() const override { return new GenericAudioPath(*this); }
+
+private:
+    AudioCadence cadence;
+    uint32_t sample_rate;
+    int bytes_per_sample;
+    int channels;
+    int max_correction;
+    const char *audio = nullptr;
+    const char *audio_end = nullptr;
+};
+
+/// The same step with the sample type, channel count and frame rate (frames per second as a std::ratio, e.g.
+/// std::ratio<30000, 1001>) fixed at compile time. The cadence table is a constexpr array, so at 24, 25, 30, 50
+/// and 60p, where every frame gets the same count, the count is a constant and no table is read at all. Strides are
+/// constants, the position is kept in sample frames rather than bytes, and copy_next() copies a fixed number of
+/// fixed size frames, which the compiler unrolls and vectorises.
+template <typename Sample, int Channels, typename Rate, uint32_t SampleRate = 48000>
+class AudioPipeline final : public AudioPath {
+public:
+    using Period = std::ratio_divide<std::ratio<1>, Rate>; // frame duration in seconds, timeValue / timeScale
+    static constexpr uint32_t frame_size = sizeof(Sample) * Channels;
+    static constexpr uint64_t cycle =
+        Period::den / std::gcd((uint64_t) SampleRate * Period::num, (uint64_t) Period::den);
+
+    AudioPipeline(const char *one_second, int max_correction) : max_correction(max_correction) {
+        make_loop(one_second, SampleRate, frame_size, max_cadence() + max_correction);
+        loop_start = reinterpret_cast<const Sample *>(buffer->data());
+    }
+
+    AudioFrame next(int correction) override {
+        uint32_t count = step() + correction;
+        const Sample *p = loop_start + (size_t) position * Channels;
+        position += count;
+        if (position >= SampleRate) {
+            position -= SampleRate;
+        }
+        return {p, count};
+    }
+
+    uint32_t copy_next(void *dst, int correction) override {
+        AudioFrame f = next(correction);
+        Sample *out = static_cast<Sample *>(dst);
+        const Sample *in = static_cast<const Sample *>(f.data);
+        if constexpr (cycle == 1) {
+            if (correction == 0) {
+                copy_frames<cadence[0]>(out, in); // the common case: a count the compiler knows
+                return f.frames;
+            }
+        }
+        memcpy(out, in, (size_t) f.frames * frame_size);
+        return f.frames;
+    }
+
+    uint32_t frame_bytes() const override { return frame_size; }
+    uint32_t max_count() const override { return max_cadence() + max_correction; }
+    const char *name() const override { return "specialised"; }
+    AudioPath *fork() const override { return new AudioPipeline(*this); }
+
+    static constexpr std::array<uint32_t, cycle> cadence = [] {
+        std::array<uint32_t, cycle> t{};
+        for (uint64_t n = 0; n < cycle; ++n) {
+            t[n] = cadence_samples(SampleRate, Period::num, Period::den, n);
+        }
+        return t;
+    }();
+
+    static constexpr uint32_t max_cadence() {
+        uint32_t m = 0;
+        for (uint32_t c : cadence) {
+            m = c > m ? c : m;
+        }
+        return m;
+    }
+
+private:
+    uint32_t step() {
+        if constexpr (cycle == 1) {
+            return cadence[0];
+        }
+        else {
+            uint32_t count = cadence[phase];
+            phase = phase + 1 == cycle ? 0 : phase + 1;
+            return count;
+        }
+    }
+
+    template <uint32_t Frames>
+    static void copy_frames(Sample *__restrict out, const Sample *__restrict in) {
+        for (uint32_t i = 0; i < Frames * Channels; ++i) {
+            out[i] = in[i];
+        }
+    }
+
+    int max_correction;
+    const Sample *loop_start = nullptr;
+    uint32_t position = 0; // sample frames into the loop
+    uint32_t phase = 0;    // into the cadence cycle
+};
+
+/// A row of the dispatch table: which AudioPipeline instantiation serves a sample type, channel count and frame rate.
+struct AudioPathEntry {
+    BMDAudioSampleType sample_type;
+    int channels;
+    BMDTimeValue timeValue; // reduced, so 1000/25000 is stored as 1/25
+    BMDTimeScale timeScale;
+    AudioPath *(*make)(const char *one_second, int max_correction);
+};
+
+template <typename Sample, int Channels, typename Rate>
+AudioPath *make_audio_pipeline(const char *one_second, int max_correction) {
+    return new AudioPipeline<Sample, Channels, Rate>(one_second, max_correction);
+}
+
+template <typename Sample, int Channels, typename... Rates>
+void add_audio_rates(std::vector<AudioPathEntry> &table, BMDAudioSampleType sample_type) {
+    (table.push_back({sample_type, Channels, (BMDTimeValue) Rates::den, (BMDTimeScale) Rates::num,
+                      &make_audio_pipeline<Sample, Channels, Rates>}),
+     ...);
+}
+
+template <typename Sample, int... Channels>
+void add_audio_channels(std::vector<AudioPathEntry> &table, BMDAudioSampleType sample_type) {
+    (add_audio_rates<Sample, Channels, std::ratio<24000, 1001>, std::ratio<24>, std::ratio<25>,
+                     std::ratio<30000, 1001>, std::ratio<30>, std::ratio<50>, std::ratio<60000, 1001>,
+                     std::ratio<60>>(table, sample_type),
+     ...);
+}
+
+/// @retval every specialisation built in: 16 and 32 bit, 2, 8 and 16 channels, 23.98 to 60p
+inline const std::vector<AudioPathEntry> &audio_path_table() {
+    static const std::vector<AudioPathEntry> table = [] {
+        std::vector<AudioPathEntry> t;
+        add_audio_channels<int16_t, 2, 8, 16>(t, bmdAudioSampleType16bitInteger);
+        add_audio_channels<int32_t, 2, 8, 16>(t, bmdAudioSampleType32bitInteger);
+        return t;
+    }();
+    return table;
+}
+
+/// Picks the specialisation for a display mode's frame rate, or a GenericAudioPath if there is none.
+/// one_second: a second of interleaved audio in the given format, copied into the path's own loop
+inline AudioPath *make_audio_path(BMDAudioSampleType sample_type, int channels, BMDTimeValue timeValue,
+                                  BMDTimeScale timeScale, const char *one_second, int max_correction = 0) {
+    for (const AudioPathEntry &e : audio_path_table()) {
+        if (e.sample_type == sample_type && e.channels == channels && timeValue * e.timeScale == timeScale * e.timeValue) {
+            return e.make(one_second, max_correction);
+        }
+    }
+    return new GenericAudioPath(one_second, 48000, sample_type / 8, channels, timeValue, timeScale, max_correction);
+}
@@ -0,0 +1,62 @@
+// Per frame cost of the playout loop's audio step, the AudioPipeline specialisation make_audio_path() picks
+// against GenericAudioPath, for a few sample types, channel counts and frame rates. No card needed.
+//   g++ -std=c++17 -O2 -I<sdk>/include audio_pipeline_bench.cpp -o audio_pipeline_bench
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "audio_pipeline.h"
+
+using namespace std::chrono;
+using std::clog;
+
+/// @retval ns per call of step over frames calls
+template <typename Step>
+static double time_frames(long frames, Step step) {
+    auto t0 = steady_clock::now();
+    for (long i = 0; i < frames; ++i) {
+        step();
+    }
+    return duration<double, std::nano>(steady_clock::now() - t0).count() / frames;
+}
+
+int main(int argc, char **argv) {
+    const long frames = argc > 1 ? atol(argv[1]) : 2000000;
+    struct Case {
+        BMDAudioSampleType type;
+        int channels;
+        BMDTimeValue timeValue;
+        BMDTimeScale timeScale;
+    };
+    const Case cases[] = {
+        {bmdAudioSampleType16bitInteger, 2, 1000, 25000},  {bmdAudioSampleType16bitInteger, 2, 1001, 30000},
+        {bmdAudioSampleType32bitInteger, 8, 1000, 50000},  {bmdAudioSampleType32bitInteger, 16, 1000, 25000},
+        {bmdAudioSampleType32bitInteger, 16, 1001, 60000},
+    };
+    for (const Case &c : cases) {
+        std::vector<char> second((size_t) 48000 * c.channels * c.type / 8, 1);
+        std::unique_ptr<AudioPath> paths[2] = {
+            std::unique_ptr<AudioPath>(new GenericAudioPath(second.data(), 48000, c.type / 8, c.channels, c.timeValue,
+                                                            c.timeScale, 0)),
+            std::unique_ptr<AudioPath>(make_audio_path(c.type, c.channels, c.timeValue, c.timeScale, second.data())),
+        };
+        std::vector<char> staging((size_t) paths[0]->max_count() * paths[0]->frame_bytes());
+        double next_ns[2], copy_ns[2];
+        for (int p = 0; p < 2; ++p) {
+            AudioPath *path = paths[p].get();
+            uintptr_t sink = 0;
+            next_ns[p] = time_frames(frames, [&] {
+                AudioFrame f = path->next(0);
+                sink += (uintptr_t) f.data + f.frames;
+            });
+            copy_ns[p] = time_frames(frames / 20, [&] { sink += path->copy_next(staging.data(), 0); });
+            if (sink == 1) {
+                clog << "";
+            }
+        }
+        clog << c.type << " bit " << c.channels << " ch " << (double) c.timeScale / c.timeValue << " fps: next "
+             << paths[0]->name() << " " << next_ns[0] << " ns, " << paths[1]->name() << " " << next_ns[1]
+             << " ns; copy " << copy_ns[0] << " ns, " << copy_ns[1] << " ns per frame" << std::endl;
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+/// Picks how deep the playout loop's audio buffer is held: as shallow as it can be, for the least audio latency,
+/// while the measured chance of running dry on any one frame stays under a bound.
+///
+/// Every frame it is given the buffered level read just before the write and how long the read and write took,
+/// which is the card draining while the loop still holds the samples. How far that combination falls below the
+/// level's running mean is the frame's dip: it is what the loop being woken late, the write being slow and the
+/// card's own reporting jitter cost the buffer between two writes. Dips go into a histogram covering the last one
+/// to two epochs of frames, an epoch being long enough (3 / bound frames) that seeing no dip at a depth means the
+/// probability of one is under the bound with 95% confidence.
+///
+/// At the end of each epoch the depth becomes the smallest at which the dips that would have emptied the buffer
+/// are rare enough, with a third on top so a near miss is as rare as an underflow should be. Stress grows it at
+/// once rather than an epoch later: a near miss (the level falling to a quarter of the depth) to a third more than
+/// that dip, an underflow to twice the depth. Depths are whole milliseconds.
+class AdaptivePreroll {
+public:
+    /// bound: acceptable underflows per frame, e.g. 1e-3
+    /// start: depth to begin at, sample frames, 0 for three frames; max: the most it ever grows to, 0 for 0.5 s
+    AdaptivePreroll(uint32_t sample_rate, BMDTimeValue timeValue, BMDTimeScale timeScale, double bound,
+                    uint32_t start = 0, uint32_t max = 0)
+        : sample_rate(sample_rate), bound(bound), quantum(sample_rate / 1000) {
+        uint32_t frame = (uint32_t) llround((double) sample_rate * timeValue / timeScale);
+        max_depth = round_up(max ? max : sample_rate / 2);
+        current = std::min(max_depth, round_up(start ? start : 3 * frame));
+        epoch = std::max<long>((long) std::ceil(3.0 / bound), 10l * timeScale / timeValue);
+        warmup = 2l * timeScale / timeValue;
+        histogram[0].assign(max_depth / quantum + 2, 0);
+        histogram[1].assign(max_depth / quantum + 2, 0);
+    }
+
+    /// Call once per frame after the write.
+    /// buffered: sample frames buffered just before the write; write_ns: from reading that to the write returning
+    /// @retval the depth to hold the buffer at from now on, sample frames
+    uint32_t update(uint32_t buffered, int64_t write_ns) {
+        frames++;
+        if (frames <= warmup) {
+            // the level is still being padded or pulled to the first depth
+            mean = buffered;
+            return current;
+        }
+        if (buffered == 0) {
+            // ran dry: how far it would have gone below empty is unknown, so count it as the whole level
+            underflows++;
+            record(mean);
+            grow(2 * current);
+        }
+        else {
+            double dip = mean - buffered + (double) write_ns * sample_rate / 1e9;
+            record(dip);
+            if (buffered < current / 4) {
+                near_misses++;
+                grow((uint32_t) std::ceil((std::max(dip, 0.0) + quantum) * 4 / 3));
+            }
+        }
+        mean += (buffered - mean) / 64;
+
+        if (++counted[0] == epoch) {
+            settle();
+            std::swap(histogram[0], histogram[1]);
+            std::fill(histogram[0].begin(), histogram[0].end(), 0);
+            counted[1] = counted[0];
+            counted[0] = 0;
+        }
+        return current;
+    }
+
+    uint32_t depth() const { return current; }
+    uint32_t max() const { return max_depth; }
+    /// @retval frames of dips an estimate is made from, at most two epochs
+    long evidence() const { return counted[0] + counted[1]; }
+    /// @retval measured underflows per frame at the current depth, from the dips behind it
+    double underflow_rate() const {
+        long n = evidence();
+        return n ? (double) at_or_above(current) / n : 0.0;
+    }
+
+    long underflows = 0;
+    long near_misses = 0;
+    long grown = 0;
+    long shrunk = 0;
+
+private:
+    uint32_t round_up(uint32_t samples) const {
+        return std::max(quantum, (samples + quantum - 1) / quantum * quantum);
+    }
+
+    void record(double dip) {
+        size_t bucket = dip <= 0 ? 0 : std::min<size_t>((size_t) (dip / quantum) + 1, histogram[0].size() - 1);
+        histogram[0][bucket]++;
+    }
+
+    /// @retval dips of depth or more across both epochs
+    long at_or_above(uint32_t depth) const {
+        long n = 0;
+        for (size_t b = depth / quantum + 1; b < histogram[0].size(); ++b) {
+            n += histogram[0][b] + histogram[1][b];
+        }
+        return n;
+    }
+
+    void grow(uint32_t to) {
+        to = std::min(max_depth, round_up(to));
+        if (to > current) {
+            current = to;
+            grown++;
+        }
+    }
+
+    /// The smallest depth whose underflow rate is under bound at 95% confidence, roughly: k events in n frames
+    /// put the rate under (k + 1 + 2 sqrt(k + 1)) / n, which is the rule of three for k = 0.
+    void settle() {
+        long n = evidence();
+        uint32_t needed = max_depth;
+        long k = 0;
+        for (size_t b = histogram[0].size() - 1; b > 0; --b) {
+            k += histogram[0][b] + histogram[1][b];
+            if ((k + 1 + 2 * std::sqrt(k + 1.0)) / n > bound) {
+                break;
+            }
+            needed = (uint32_t) (b - 1) * quantum;
+        }
+        uint32_t to = std::min(max_depth, round_up(needed * 4 / 3 + quantum));
+        if (to < current) {
+            shrunk++;
+        }
+        else if (to > current) {
+            grown++;
+        }
+        current = to;
+    }
+
+    uint32_t sample_rate;
+    double bound;
+    uint32_t quantum; // sample frames per millisecond, the histogram's bucket width
+    uint32_t max_depth;
+    uint32_t current;
+    long epoch;
+    long warmup;
+
+    long frames = 0;
+    double mean = 0.0;
+    // [0] the epoch being filled, [1] the one before; bucket 0 holds dips of none, bucket b of (b - 1) to b ms
+    std::vector<uint32_t> histogram[2];
+    long counted[2] = {0, 0};
+};
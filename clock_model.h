@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "DeckLinkAPI.h"
+
+/// The card clock as a function of the host clock, as last estimated by ClockModel.
+struct ClockEstimate {
+    int64_t anchor_host_ns = 0; // host time of the latest sample
+    double offset_ns = 0.0;     // hardware minus host at anchor_host_ns
+    double rate_ppm = 0.0;      // how much faster the card runs, positive when fast
+    double jitter_ns = 0.0;     // standard deviation of a single reading about the model
+    double offset_sd_ns = 0.0;  // standard deviation of offset_ns itself
+    uint64_t samples = 0;
+    uint64_t outliers = 0;      // readings rejected as too far off the model, e.g. preempted between reads
+
+    /// @retval card time in ns at host time host_ns
+    int64_t to_hardware_ns(int64_t host_ns) const {
+        int64_t dt = host_ns - anchor_host_ns;
+        return host_ns + llround(offset_ns + rate_ppm * 1e-6 * dt);
+    }
+
+    /// @retval host time in ns at card time hardware_ns
+    int64_t to_host_ns(int64_t hardware_ns) const {
+        int64_t dt = hardware_ns - (anchor_host_ns + llround(offset_ns));
+        return anchor_host_ns + llround(dt / (1.0 + rate_ppm * 1e-6));
+    }
+
+    /// @retval card time at host time host_ns, in the timeScale GetHardwareReferenceClock was called with
+    BMDTimeValue to_hardware(int64_t host_ns, BMDTimeScale timeScale) const {
+        int64_t ns = to_hardware_ns(host_ns);
+        return ns / 1000000000 * timeScale + ns % 1000000000 * timeScale / 1000000000;
+    }
+};
+
+/// Online estimate of the card's hardware reference clock against CLOCK_MONOTONIC, so pacing, audio rate
+/// correction and monitoring can convert between the two without calling the driver.
+///
+/// A two state Kalman filter, offset and rate, fed one (host time, GetHardwareReferenceClock) pair at a time:
+/// constant work per sample and no history. The measurement noise is learned from the innovations, floored at the
+/// reading's quantisation (one tick of the timeScale asked for, so ask for a fine one), and a reading further than
+/// five sigma off the prediction is counted and ignored rather than let it drag the model.
+///
+/// update() is for one thread. Every update publishes a ClockEstimate through a seqlock, which any number of
+/// threads can read with estimate() without blocking the writer.
+class ClockModel {
+public:
+    /// rate_wander_ppm: how far the card's rate is expected to drift per square root second, e.g. with temperature
+    explicit ClockModel(double rate_wander_ppm = 0.01) : rate_noise(rate_wander_ppm * 1e3 * rate_wander_ppm * 1e3) {}
+
+    ClockModel(const ClockModel &) = delete;
+    ClockModel &operator=(const ClockModel &) = delete;
+
+    /// host_ns: CLOCK_MONOTONIC when the clock was read, ideally the midpoint of a reading taken either side of it
+    /// hardware_time: the reading, in timeScale units
+    /// @retval false if the reading was rejected as an outlier
+    bool update(int64_t host_ns, BMDTimeValue hardware_time, BMDTimeScale timeScale) {
+        int64_t hardware_ns = hardware_time / timeScale * 1000000000 + hardware_time % timeScale * 1000000000 / timeScale;
+        double tick_ns = 1e9 / timeScale;
+        double floor_var = tick_ns * tick_ns / 12.0;
+        // a reading of n ticks means somewhere in [n, n + 1), so on average half a tick later than n
+        hardware_ns += (int64_t) (tick_ns / 2);
+        bool accepted = true;
+
+        if (est.samples == 0) {
+            delta0 = hardware_ns - host_ns;
+            offset = 0.0;
+            rate = 0.0;
+            // start out assuming noisy readings and learn better; the other way round the filter locks onto the
+            // first few readings' noise and then takes its own error for noise
+            noise_var = std::max(floor_var, initial_noise_sd * initial_noise_sd);
+            p00 = noise_var;
+            p01 = 0.0;
+            p11 = initial_rate_sd * initial_rate_sd;
+        }
+        else {
+            // predict forward to this reading
+            double dt = (host_ns - last_host_ns) * 1e-9;
+            offset += rate * dt;
+            p00 += dt * (2.0 * p01 + dt * p11);
+            p01 += dt * p11;
+            p11 += rate_noise * dt;
+
+            double z = (double) ((hardware_ns - host_ns) - delta0);
+            double innovation = z - offset;
+            double prior = p00;
+            double s = prior + noise_var;
+            if (est.samples > warmup && innovation * innovation > 25.0 * s) {
+                est.outliers++;
+                accepted = false;
+            }
+            else {
+                double k0 = p00 / s;
+                double k1 = p01 / s;
+                offset += k0 * innovation;
+                rate += k1 * innovation;
+                p11 -= k1 * p01;
+                p01 -= k0 * p01;
+                p00 -= k0 * p00;
+                // what the innovations say about the readings, less what the model itself was unsure of
+                noise_var += (std::max(innovation * innovation - prior, floor_var) - noise_var) / 64.0;
+            }
+        }
+        last_host_ns = host_ns;
+        est.samples++;
+        publish(host_ns);
+        return accepted;
+    }
+
+    /// Any thread. Retries while an update is being published, which takes nanoseconds.
+    ClockEstimate estimate() const {
+        ClockEstimate copy;
+        while (1) {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            copy.anchor_host_ns = shared.anchor_host_ns.load(std::memory_order_relaxed);
+            copy.offset_ns = shared.offset_ns.load(std::memory_order_relaxed);
+            copy.rate_ppm = shared.rate_ppm.load(std::memory_order_relaxed);
+            copy.jitter_ns = shared.jitter_ns.load(std::memory_order_relaxed);
+            copy.offset_sd_ns = shared.offset_sd_ns.load(std::memory_order_relaxed);
+            copy.samples = shared.samples.load(std::memory_order_relaxed);
+            copy.outliers = shared.outliers.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+                return copy;
+            }
+        }
+    }
+
+private:
+    static constexpr double initial_rate_sd = 1e5; // ns/s, 100 ppm
+    static constexpr double initial_noise_sd = 1e5; // ns
+    static constexpr uint64_t warmup = 16;
+
+    void publish(int64_t host_ns) {
+        est.anchor_host_ns = host_ns;
+        est.offset_ns = delta0 + offset;
+        est.rate_ppm = rate * 1e-3;
+        est.jitter_ns = sqrt(noise_var);
+        est.offset_sd_ns = sqrt(std::max(p00, 0.0));
+
+        uint64_t s = sequence.load(std::memory_order_relaxed);
+        sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        shared.anchor_host_ns.store(est.anchor_host_ns, std::memory_order_relaxed);
+        shared.offset_ns.store(est.offset_ns, std::memory_order_relaxed);
+        shared.rate_ppm.store(est.rate_ppm, std::memory_order_relaxed);
+        shared.jitter_ns.store(est.jitter_ns, std::memory_order_relaxed);
+        shared.offset_sd_ns.store(est.offset_sd_ns, std::memory_order_relaxed);
+        shared.samples.store(est.samples, std::memory_order_relaxed);
+        shared.outliers.store(est.outliers, std::memory_order_relaxed);
+        sequence.store(s + 2, std::memory_order_release);
+    }
+
+    // writer state; offset is hardware minus host, in ns, relative to delta0 to keep it small
+    double rate_noise;
+    int64_t delta0 = 0;
+    int64_t last_host_ns = 0;
+    double offset = 0.0;
+    double rate = 0.0; // ns per s
+    double noise_var = 0.0;
+    double p00 = 0.0, p01 = 0.0, p11 = 0.0;
+    ClockEstimate est;
+
+    struct Shared {
+        std::atomic<int64_t> anchor_host_ns{0};
+        std::atomic<double> offset_ns{0.0};
+        std::atomic<double> rate_ppm{0.0};
+        std::atomic<double> jitter_ns{0.0};
+        std::atomic<double> offset_sd_ns{0.0};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> outliers{0};
+    };
+    alignas(64) std::atomic<uint64_t> sequence{0};
+    Shared shared;
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+/// A device's display modes, enumerated once and kept in a small binary file so a restart, after a failover say,
+/// looks its mode up instead of walking IDeckLinkDisplayModeIterator again. Modes are indexed by resolution, frame
+/// rate in millihertz (so 23.976 and 24 are different modes) and field dominance; a lookup is one hash probe.
+///
+/// The file is tagged with the device's model and the driver's API version. When either changes the file is
+/// ignored and rebuilt, and a program that finds a cached mode refused by the card should rebuild() too.
+class DisplayModeCache {
+public:
+    /// One mode as enumerated; plain data, written to the file as is.
+    struct Mode {
+        BMDDisplayMode mode;
+        uint32_t width;
+        uint32_t height;
+        BMDTimeValue timeValue;
+        BMDTimeScale timeScale;
+        BMDFieldDominance dominance;
+        BMDDisplayModeFlags flags;
+        char name[32];
+
+        /// @retval frames per second times 1000, rounded: 23976 for 24000/1001
+        uint32_t millihertz() const { return (uint32_t) llround(1000.0 * timeScale / timeValue); }
+    };
+
+    /// @retval "<model>/<API version>", what a cache file has to match; the version is 0 where it cannot be read
+    static std::string device_key(IDeckLink *deckLink) {
+        const char *model = nullptr;
+        if (deckLink->GetModelName(&model) != S_OK || !model) {
+            model = "unknown";
+        }
+        return device_key(model);
+    }
+
+    static std::string device_key(const char *model) {
+        int64_t version = 0;
+        if (IDeckLinkAPIInformation *info = CreateDeckLinkAPIInformationInstance()) {
+            info->GetInt(bmdDeckLinkAPIVersion, &version);
+            info->Release();
+        }
+        char hex[24];
+        snprintf(hex, sizeof(hex), "%llx", (unsigned long long) version);
+        return std::string(model) + "/" + hex;
+    }
+
+    /// @retval where the cache for this device lives unless told otherwise: one file per model under /var/tmp
+    static std::string default_path(const std::string &key) {
+        std::string path = "/var/tmp/decklink-modes-";
+        for (char c : key.substr(0, key.find('/'))) {
+            path += isalnum((unsigned char) c) ? c : '_';
+        }
+        return path + ".bin";
+    }
+
+    /// Loads the cache from path if it was written for key, else enumerates output and writes it there.
+    /// @retval false if neither gave any modes
+    bool open(IDeckLinkOutput *output, const std::string &key, const std::string &path, bool verbose = false) {
+        this->key = key;
+        this->path = path;
+        if (load()) {
+            loaded = true;
+            return true;
+        }
+        loaded = false;
+        return rebuild(output, verbose);
+    }
+
+    /// Enumerates output's modes afresh and rewrites the file; on a cache never open()ed there is no file, and the
+    /// modes are kept in memory only.
+    /// @retval false if the output reported no modes
+    bool rebuild(IDeckLinkOutput *output, bool verbose = false) {
+        IDeckLinkDisplayModeIterator *displayModeIterator = nullptr;
+        IDeckLinkDisplayMode *displayMode = nullptr;
+        std::vector<Mode> found;
+        if (output->GetDisplayModeIterator(&displayModeIterator) == S_OK) {
+            while (displayModeIterator->Next(&displayMode) == S_OK && displayMode) {
+                Mode m{};
+                m.mode = displayMode->GetDisplayMode();
+                m.width = (uint32_t) displayMode->GetWidth();
+                m.height = (uint32_t) displayMode->GetHeight();
+                displayMode->GetFrameRate(&m.timeValue, &m.timeScale);
+                m.dominance = displayMode->GetFieldDominance();
+                m.flags = displayMode->GetFlags();
+                const char *name = nullptr;
+                if (displayMode->GetName(&name) == S_OK && name) {
+                    strncpy(m.name, name, sizeof(m.name) - 1);
+                }
+                if (verbose) {
+                    std::clog << m.name << " " << m.width << "x" << m.height << " " << m.timeValue << "/"
+                              << m.timeScale << std::endl;
+                }
+                found.push_back(m);
+                displayMode->Release();
+            }
+            displayModeIterator->Release();
+        }
+        index(found);
+        if (!modes.empty() && !path.empty() && !save()) {
+            std::clog << "could not write the display mode cache " << path << std::endl;
+        }
+        return !modes.empty();
+    }
+
+    /// @retval the mode of exactly this resolution, rate and dominance, or nullptr
+    const Mode *find(uint32_t width, uint32_t height, uint32_t millihertz, BMDFieldDominance dominance) const {
+        auto it = table.find(pack(width, height, millihertz, dominance));
+        return it == table.end() ? nullptr : &modes[it->second];
+    }
+
+    /// Finds a mode by "[[<width>x]<height>]<p|i|psf><rate>", e.g. 1080p25, 2160p59.94, 1080i50, p23.98 or
+    /// 2048x1080p24. Without a resolution the first one the device listed at that rate matches. A rate with a
+    /// fraction is the x/1001 rate of the integer above it, and an interlaced rate is in fields.
+    /// @retval the mode, or nullptr if spec is malformed or the device has no such mode
+    const Mode *find(const std::string &spec) const {
+        const char *s = spec.c_str();
+        char *end = nullptr;
+        uint32_t width = 0, height = 0;
+        if (isdigit((unsigned char) *s)) {
+            height = (uint32_t) strtoul(s, &end, 10);
+            s = end;
+            if (*s == 'x') {
+                width = height;
+                height = (uint32_t) strtoul(s + 1, &end, 10);
+                s = end;
+            }
+        }
+        BMDFieldDominance dominance;
+        if (strncmp(s, "psf", 3) == 0) {
+            dominance = bmdProgressiveSegmentedFrame;
+            s += 3;
+        }
+        else if (*s == 'p' || *s == 'i') {
+            dominance = *s == 'p' ? bmdProgressiveFrame : bmdUpperFieldFirst;
+            s += 1;
+        }
+        else {
+            return nullptr;
+        }
+        double rate = strtod(s, &end);
+        if (end == s || *end != '\0' || rate <= 0) {
+            return nullptr;
+        }
+        double frames = rate != floor(rate) ? ceil(rate) * 1000.0 / 1001.0 : rate;
+        if (dominance == bmdUpperFieldFirst) {
+            frames /= 2;
+        }
+        uint32_t millihertz = (uint32_t) llround(frames * 1000.0);
+        const Mode *m = find(width, height, millihertz, dominance);
+        if (!m && dominance == bmdUpperFieldFirst) {
+            m = find(width, height, millihertz, bmdLowerFieldFirst);
+        }
+        return m;
+    }
+
+    const std::vector<Mode> &all() const { return modes; }
+    /// @retval whether open() found the modes in the file rather than enumerating them
+    bool from_file() const { return loaded; }
+    const std::string &file() const { return path; }
+
+private:
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t key_bytes;
+        uint32_t count;
+    };
+    static constexpr uint32_t format_version = 1;
+
+    static uint64_t pack(uint32_t width, uint32_t height, uint32_t millihertz, BMDFieldDominance dominance) {
+        return (uint64_t) (width & 0xffff) << 48 | (uint64_t) (height & 0xffff) << 32 |
+               (uint64_t) (millihertz & 0xffffff) << 8 | field_code(dominance);
+    }
+
+    /// @retval a dominance's four character code as a small number, 0 for unknown
+    static uint32_t field_code(BMDFieldDominance dominance) {
+        switch (dominance) {
+        case bmdProgressiveFrame: return 1;
+        case bmdUpperFieldFirst: return 2;
+        case bmdLowerFieldFirst: return 3;
+        case bmdProgressiveSegmentedFrame: return 4;
+        default: return 0;
+        }
+    }
+
+    /// Indexes each mode under its full key, its height alone and its rate alone, the first listed winning the
+    /// partial keys.
+    void index(const std::vector<Mode> &found) {
+        modes = found;
+        table.clear();
+        table.reserve(modes.size() * 3);
+        for (size_t i = 0; i < modes.size(); ++i) {
+            const Mode &m = modes[i];
+            table.emplace(pack(m.width, m.height, m.millihertz(), m.dominance), i);
+            table.emplace(pack(0, m.height, m.millihertz(), m.dominance), i);
+            table.emplace(pack(0, 0, m.millihertz(), m.dominance), i);
+        }
+    }
+
+    bool load() {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        Header h{};
+        std::string stored;
+        std::vector<Mode> found;
+        bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, "DLMC", 4) == 0 &&
+                  h.version == format_version && h.key_bytes == key.size() && h.count > 0 && h.count < 4096;
+        if (ok) {
+            stored.resize(h.key_bytes);
+            found.resize(h.count);
+            ok = fread(&stored[0], 1, stored.size(), f) == stored.size() && stored == key &&
+                 fread(found.data(), sizeof(Mode), found.size(), f) == found.size();
+        }
+        fclose(f);
+        if (ok) {
+            index(found);
+        }
+        return ok;
+    }
+
+    /// Writes beside the file and renames over it, so a process starting meanwhile reads the old one or the new one.
+    bool save() const {
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        Header h{{'D', 'L', 'M', 'C'}, format_version, (uint32_t) key.size(), (uint32_t) modes.size()};
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(key.data(), 1, key.size(), f) == key.size() &&
+                  fwrite(modes.data(), sizeof(Mode), modes.size(), f) == modes.size();
+        ok = fclose(f) == 0 && ok;
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    std::string key;
+    std::string path;
+    bool loaded = false;
+    std::vector<Mode> modes;
+    std::unordered_map<uint64_t, size_t> table;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "DeckLinkAPI.h"
+#include "audio_cadence.h"
+#include "audio_level_controller.h"
+
+/// How the modelled frame loop decides when to write the next frame.
+enum class DriftPacing {
+    spin,     // audio_issue.cpp: busy wait one frame from the last wake, so each wake's overshoot adds up
+    pacer,    // FramePacer: absolute deadlines on the host clock, wake error does not accumulate
+    hw_clock, // audio_issue_blk_clock.cpp: frames follow the card's clock, host ppm does not matter
+    pll,      // pacer plus AudioLevelController trimming each write to hold the buffer level
+    count
+};
+
+inline const char *drift_pacing_name(DriftPacing p) {
+    static const char *names[] = {"spin", "pacer", "hw_clock", "pll"};
+    return names[(int) p];
+}
+
+/// One point of the sweep.
+struct DriftScenario {
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    double ppm;        // card clock against the host, positive when the card runs fast
+    uint32_t capacity; // card audio buffer, sample frames
+    DriftPacing pacing;
+};
+
+/// Host behaviour shared by every scenario of a sweep.
+struct DriftHost {
+    uint32_t sample_rate = 48000;
+    int64_t overshoot_ns = 250;  // spin: mean lateness of each wake, uniform over 0..2x, e.g. the last clock read
+    int64_t jitter_ns = 50000;   // pacer, hw_clock and pll: each wake lands uniformly 0..jitter_ns late
+    double latency_frames = 1.0; // the card starts playing this long after the first write
+    double horizon_s = 3 * 86400.0;
+    uint32_t pll_target = 0;     // AudioLevelController target, 0 for one frame
+};
+
+enum class DriftOutcome { none, underflow, overflow };
+
+struct DriftResult {
+    DriftOutcome outcome = DriftOutcome::none;
+    double seconds = 0.0; // host time of the failure, or the horizon if none
+    int64_t frames = 0;   // frames written before it
+    double min_level = 0.0; // buffered sample frames just before a write, lowest and highest seen
+    double max_level = 0.0;
+};
+
+/// Discrete event model of the audio_issue.cpp frame loop against a card, with no card or clocks involved.
+///
+/// Each event is one frame: the loop wakes at a host time given by the pacing strategy, reads the buffered level
+/// (what the card has not yet played), and writes that frame's AudioCadence count, plus or minus a PLL step. The
+/// card drains the buffer continuously at sample_rate on its own clock, ppm off the host's, from latency_frames
+/// after the first write. A level at or below zero before a write is an underflow, as audio_issue.cpp sees
+/// buffered == 0; a write that does not fit the capacity is an overflow. The run stops at the first of either.
+/// Simulating a day of 25p takes tens of milliseconds.
+inline DriftResult run_drift_scenario(const DriftScenario &s, const DriftHost &host, uint64_t seed) {
+    const int64_t period_num = 1000000000ll * s.timeValue; // host frame period is period_num / timeScale ns
+    const double card_rate = host.sample_rate * (1.0 + s.ppm * 1e-6) * 1e-9; // sample frames per host ns
+    const double card_period_ns = (double) period_num / s.timeScale / (1.0 + s.ppm * 1e-6);
+    const double play_start_ns = host.latency_frames * period_num / s.timeScale;
+    const int64_t horizon_ns = (int64_t) (host.horizon_s * 1e9);
+    const uint64_t spin_range = (uint64_t) std::max<int64_t>(host.overshoot_ns, 0) * 2 + 1;
+    const uint64_t jitter_range = (uint64_t) std::max<int64_t>(host.jitter_ns, 0) + 1;
+
+    AudioCadence cadence(host.sample_rate, s.timeValue, s.timeScale);
+    AudioLevelController pll(host.pll_target, host.sample_rate, s.timeValue, s.timeScale);
+
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ull + 1;
+    auto random = [&](uint64_t range) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return (int64_t) (rng % range);
+    };
+
+    DriftResult r;
+    r.min_level = 1e300;
+    r.max_level = -1e300;
+    double written = 0.0; // sample frames handed to the card so far
+    int64_t last_wake = 0;
+    for (int64_t frame = 0;; ++frame) {
+        int64_t t;
+        if (frame == 0) {
+            t = 0;
+        }
+        else if (s.pacing == DriftPacing::spin) {
+            t = last_wake + period_num / s.timeScale + random(spin_range);
+        }
+        else if (s.pacing == DriftPacing::hw_clock) {
+            t = (int64_t) (frame * card_period_ns) + random(jitter_range);
+        }
+        else {
+            t = (int64_t) ((__int128) frame * period_num / s.timeScale) + random(jitter_range);
+        }
+        last_wake = t;
+        if (t > horizon_ns) {
+            r.seconds = host.horizon_s;
+            break;
+        }
+
+        double played = t > play_start_ns ? (t - play_start_ns) * card_rate : 0.0;
+        double level = written - played;
+        if (frame > 0) {
+            r.min_level = std::min(r.min_level, level);
+            r.max_level = std::max(r.max_level, level);
+        }
+        if (frame > 0 && level <= 0.0) {
+            r.outcome = DriftOutcome::underflow;
+            // the card ran dry when it had played everything written
+            r.seconds = (play_start_ns + written / card_rate) * 1e-9;
+            break;
+        }
+
+        int64_t count = cadence.next();
+        if (s.pacing == DriftPacing::pll) {
+            BMDTimeValue hardware_time = (BMDTimeValue) (t * (1.0 + s.ppm * 1e-6) * s.timeScale * 1e-9);
+            count += pll.update((uint32_t) std::max(level, 0.0), hardware_time);
+        }
+        if (level + count > s.capacity) {
+            r.outcome = DriftOutcome::overflow;
+            r.seconds = t * 1e-9;
+            break;
+        }
+        written += count;
+        r.frames = frame + 1;
+    }
+    if (r.min_level > r.max_level) {
+        r.min_level = r.max_level = 0.0;
+    }
+    return r;
+}
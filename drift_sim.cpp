@@ -0,0 +1,263 @@
+// Sweeps DriftModel over frame rates, card clock offsets, buffer sizes and pacing strategies and reports how long
+// each combination plays before the card's audio buffer underflows or overflows. No card needed.
+//   g++ -std=c++17 -O2 -pthread -I<sdk>/include drift_sim.cpp -o drift_sim
+//   ./drift_sim -ppm -100:100:5 -capacity 4800,9600,48000 -days 3 -csv drift.csv
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "drift_model.h"
+#include "input_parser.h"
+
+using namespace std::chrono;
+using std::clog;
+
+
+/// Runs jobs 0..count-1 on a fixed set of threads. Each thread starts with a contiguous share of the jobs in its own
+/// deque and takes from the front; one that runs dry steals from the back of another's. Scenarios that fail in the
+/// first minute and ones that run the whole horizon differ in cost by orders of magnitude, so a static split
+/// would leave most threads idle behind the unlucky one.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned threads) : queues(std::max(threads, 1u)) {}
+
+    template <typename Job>
+    void run(size_t count, Job job) {
+        const size_t n = queues.size();
+        for (size_t q = 0; q < n; ++q) {
+            for (size_t i = count * q / n; i < count * (q + 1) / n; ++i) {
+                queues[q].jobs.push_back(i);
+            }
+        }
+        std::vector<std::thread> workers;
+        for (size_t q = 0; q < n; ++q) {
+            workers.emplace_back([this, q, n, &job] {
+                size_t i;
+                while (pop(q, i) || steal(q, n, i)) {
+                    job(i);
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    /// @retval jobs taken from another thread's queue
+    uint64_t steals() const { return stolen.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) Queue {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    bool pop(size_t q, size_t &i) {
+        std::lock_guard<std::mutex> guard(queues[q].lock);
+        if (queues[q].jobs.empty()) {
+            return false;
+        }
+        i = queues[q].jobs.front();
+        queues[q].jobs.pop_front();
+        return true;
+    }
+
+    bool steal(size_t q, size_t n, size_t &i) {
+        for (size_t k = 1; k < n; ++k) {
+            Queue &victim = queues[(q + k) % n];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.jobs.empty()) {
+                i = victim.jobs.back();
+                victim.jobs.pop_back();
+                stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues;
+    std::atomic<uint64_t> stolen{0};
+};
+
+
+/// "a,b,c" or "start:stop:step", or a mix: "-50:50:10,100"
+static std::vector<double> parse_values(const std::string &s) {
+    std::vector<double> values;
+    for (const std::string &item : split(s, ',')) {
+        std::vector<std::string> range = split(item, ':');
+        if (range.size() == 3) {
+            double start = atof(range[0].c_str()), stop = atof(range[1].c_str()), step = atof(range[2].c_str());
+            for (int i = 0; step > 0 && start + i * step <= stop + step * 1e-9; ++i) {
+                values.push_back(start + i * step);
+            }
+        }
+        else {
+            values.push_back(atof(item.c_str()));
+        }
+    }
+    return values;
+}
+
+/// Rates as timeScale/timeValue, so 30000/1001 is 29.97p; a bare number is whole frames per second.
+static std::vector<std::pair<BMDTimeValue, BMDTimeScale>> parse_rates(const std::string &s) {
+    std::vector<std::pair<BMDTimeValue, BMDTimeScale>> rates;
+    for (const std::string &item : split(s, ',')) {
+        std::vector<std::string> parts = split(item, '/');
+        if (parts.size() == 2) {
+            rates.push_back({atoll(parts[1].c_str()), atoll(parts[0].c_str())});
+        }
+        else {
+            rates.push_back({1000, atoll(item.c_str()) * 1000});
+        }
+    }
+    return rates;
+}
+
+static char heat(const DriftResult &r) {
+    if (r.outcome == DriftOutcome::none) {
+        return '.';
+    }
+    const double limits[] = {1, 60, 600, 3600, 6 * 3600, 86400};
+    const char marks[] = "@%#*+=";
+    for (int i = 0; i < 6; ++i) {
+        if (r.seconds < limits[i]) {
+            return marks[i];
+        }
+    }
+    return '-';
+}
+
+static const char *outcome_name(DriftOutcome o) {
+    return o == DriftOutcome::underflow ? "underflow" : o == DriftOutcome::overflow ? "overflow" : "none";
+}
+
+int main(int argc, char **argv) {
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" -fps <list> rates as timeScale/timeValue or whole fps (default 24000/1001,24,25,30000/1001,50)"<<std::endl;
+        std::clog <<" -ppm <list|start:stop:step> card clock offsets (default -100:100:5)"<<std::endl;
+        std::clog <<" -capacity <list> card audio buffer in sample frames (default 4800,9600,48000)"<<std::endl;
+        std::clog <<" -pacing <list> of spin,pacer,hw_clock,pll (default all)"<<std::endl;
+        std::clog <<" -days <d> horizon (default 3), -latency <frames> card start delay (default 1)"<<std::endl;
+        std::clog <<" -overshoot <ns> mean spin overshoot per frame (default 250), -jitter <ns> sleeping wake error (default 50000), -pll-target <samples>"<<std::endl;
+        std::clog <<" -threads <n> (default all cores), -csv <file> (default stdout), -seed <n>"<<std::endl;
+        exit(0);
+    }
+    auto option = [&](const char *name, const char *fallback) {
+        return input.cmdOptionExists(name) ? input.getCmdOption(name) : std::string(fallback);
+    };
+
+    auto rates = parse_rates(option("-fps", "24000/1001,24,25,30000/1001,50"));
+    std::vector<double> ppms = parse_values(option("-ppm", "-100:100:5"));
+    std::vector<double> capacities = parse_values(option("-capacity", "4800,9600,48000"));
+    std::vector<DriftPacing> pacings;
+    for (const std::string &name : split(option("-pacing", "spin,pacer,hw_clock,pll"), ',')) {
+        for (int p = 0; p < (int) DriftPacing::count; ++p) {
+            if (name == drift_pacing_name((DriftPacing) p)) {
+                pacings.push_back((DriftPacing) p);
+            }
+        }
+    }
+
+    DriftHost host;
+    host.horizon_s = atof(option("-days", "3").c_str()) * 86400.0;
+    host.latency_frames = atof(option("-latency", "1").c_str());
+    host.overshoot_ns = atoll(option("-overshoot", "250").c_str());
+    host.jitter_ns = atoll(option("-jitter", "50000").c_str());
+    host.pll_target = atoi(option("-pll-target", "0").c_str());
+    const uint64_t seed = atoll(option("-seed", "1").c_str());
+    unsigned threads = atoi(option("-threads", "0").c_str());
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    // laid out so each heatmap panel (rate x pacing) is capacities x ppms in row order
+    std::vector<DriftScenario> scenarios;
+    for (auto &rate : rates) {
+        for (DriftPacing pacing : pacings) {
+            for (double capacity : capacities) {
+                for (double ppm : ppms) {
+                    scenarios.push_back({rate.first, rate.second, ppm, (uint32_t) capacity, pacing});
+                }
+            }
+        }
+    }
+    if (scenarios.empty()) {
+        std::clog << "nothing to run" << std::endl;
+        exit(1);
+    }
+    std::vector<DriftResult> results(scenarios.size());
+
+    std::atomic<size_t> done{0};
+    std::atomic<bool> finished{false};
+    auto t0 = steady_clock::now();
+    std::thread progress([&] {
+        auto next = t0 + seconds(2);
+        while (!finished.load()) {
+            std::this_thread::sleep_for(milliseconds(50));
+            if (steady_clock::now() >= next) {
+                std::clog << "\r" << done.load() << "/" << scenarios.size() << std::flush;
+                next += seconds(1);
+            }
+        }
+    });
+    WorkStealingPool pool(threads);
+    pool.run(scenarios.size(), [&](size_t i) {
+        // seeded by position, so results do not depend on which thread ran what
+        results[i] = run_drift_scenario(scenarios[i], host, seed + i);
+        done.fetch_add(1, std::memory_order_relaxed);
+    });
+    finished = true;
+    progress.join();
+    double elapsed = duration<double>(steady_clock::now() - t0).count();
+    std::clog << "\r" << scenarios.size() << " scenarios of up to " << host.horizon_s / 86400 << " days in "
+              << elapsed << " s on " << threads << " threads (" << pool.steals() << " steals)" << std::endl;
+
+    std::ofstream file;
+    if (input.cmdOptionExists("-csv")) {
+        file.open(input.getCmdOption("-csv"));
+    }
+    std::ostream &csv = file.is_open() ? file : std::cout;
+    csv << "fps,time_value,time_scale,ppm,capacity,pacing,outcome,seconds,frames,min_level,max_level\n";
+    for (size_t i = 0; i < scenarios.size(); ++i) {
+        const DriftScenario &s = scenarios[i];
+        const DriftResult &r = results[i];
+        char line[256];
+        snprintf(line, sizeof(line), "%.3f,%lld,%lld,%g,%u,%s,%s,%.3f,%lld,%.1f,%.1f\n",
+                 (double) s.timeScale / s.timeValue, (long long) s.timeValue, (long long) s.timeScale, s.ppm,
+                 s.capacity, drift_pacing_name(s.pacing), outcome_name(r.outcome), r.seconds, (long long) r.frames,
+                 r.min_level, r.max_level);
+        csv << line;
+    }
+
+    // one panel per rate and pacing: a row per capacity, a column per ppm
+    std::clog << "time to first underflow/overflow: @ <1s % <1min # <10min * <1h + <6h = <1day - later . never"
+              << std::endl;
+    size_t i = 0;
+    for (auto &rate : rates) {
+        for (DriftPacing pacing : pacings) {
+            std::clog << (double) rate.second / rate.first << " fps " << drift_pacing_name(pacing) << ", ppm "
+                      << ppms.front() << " .. " << ppms.back() << std::endl;
+            for (double capacity : capacities) {
+                char label[16];
+                snprintf(label, sizeof(label), "%8u ", (uint32_t) capacity);
+                std::string row = label;
+                for (size_t p = 0; p < ppms.size(); ++p) {
+                    row += heat(results[i++]);
+                }
+                std::clog << row << std::endl;
+            }
+        }
+    }
+}
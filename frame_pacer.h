@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+
+#include "DeckLinkAPI.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACER_CPU_RELAX() _mm_pause()
+#elif defined(__aarch64__)
+#define PACER_CPU_RELAX() asm volatile("yield")
+#else
+#define PACER_CPU_RELAX()
+#endif
+
+/// What the pacer measured since start() or the last reset_stats().
+struct PacerStats {
+    long frames = 0;
+    long late = 0;             // woke after the deadline had already passed by more than the spin tail
+    int64_t wake_error_ns = 0; // last frame, how far past the deadline we returned
+    int64_t max_wake_error_ns = 0;
+    int64_t sum_wake_error_ns = 0;
+    int64_t cpu_ns = 0;        // thread cpu time spent inside wait()
+    int64_t wall_ns = 0;       // wall time covered by those frames
+};
+
+/// Paces frames against absolute CLOCK_MONOTONIC deadlines: clock_nanosleep until a calibrated margin before each
+/// deadline, then a short spin for the rest. Deadlines are start + n * timeValue / timeScale computed exactly,
+/// so wake error never accumulates into drift. The frame grid can be phase locked to the card's frame edges from a
+/// single GetHardwareReferenceClock reading instead of polling it.
+class FramePacer {
+public:
+    FramePacer(BMDTimeValue timeValue, BMDTimeScale timeScale) : timeValue(timeValue), timeScale(timeScale) {
+    }
+
+    static int64_t now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    static int64_t thread_cpu_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    /// The first deadline is one frame from now.
+    void start() {
+        start_ns = now_ns();
+        frame = 0;
+        last_wake_ns = start_ns;
+    }
+
+    /// Predicts the card's next frame edge from one GetHardwareReferenceClock(timeScale, ...) reading taken just
+    /// now, and moves the frame grid onto it. Call once at start and again occasionally to follow the card's clock.
+    void align_to_hardware(BMDTimeValue timeInFrame, BMDTimeValue ticksPerFrame) {
+        if (ticksPerFrame <= 0) {
+            return;
+        }
+        int64_t now = now_ns();
+        int64_t period = ticks_to_ns(ticksPerFrame, timeScale);
+        int64_t edge = now + ticks_to_ns(ticksPerFrame - timeInFrame, timeScale);
+        if (start_ns == 0) {
+            last_wake_ns = now;
+        }
+        else {
+            // a reading taken just before an edge must not skip or repeat a frame: use the edge nearest the
+            // deadline we were already heading for
+            int64_t expected = start_ns + ticks_to_ns((frame + 1) * timeValue, timeScale);
+            while (edge < expected - period / 2) {
+                edge += period;
+            }
+            while (edge > expected + period / 2) {
+                edge -= period;
+            }
+        }
+        // keep the frame count, move the grid so the next deadline lands on the edge
+        start_ns = edge - ticks_to_ns((frame + 1) * timeValue, timeScale);
+    }
+
+    /// Sleeps until the next frame deadline.
+    /// @retval ns past the deadline at which we returned
+    int64_t wait() {
+        int64_t cpu_before = thread_cpu_ns();
+        int64_t deadline = start_ns + ticks_to_ns(++frame * timeValue, timeScale);
+        int64_t sleep_until = deadline - spin_ns;
+        int64_t now = now_ns();
+        if (now < sleep_until) {
+            timespec ts{(time_t) (sleep_until / 1000000000), (long) (sleep_until % 1000000000)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+            }
+            now = now_ns();
+            calibrate(now - sleep_until);
+        }
+        else if (now > deadline + spin_ns) {
+            stats.late++;
+        }
+        while (now < deadline) {
+            PACER_CPU_RELAX();
+            now = now_ns();
+        }
+
+        int64_t error = now - deadline;
+        stats.frames++;
+        stats.wake_error_ns = error;
+        stats.max_wake_error_ns = std::max(stats.max_wake_error_ns, error);
+        stats.sum_wake_error_ns += error;
+        stats.cpu_ns += thread_cpu_ns() - cpu_before;
+        stats.wall_ns += now - last_wake_ns;
+        last_wake_ns = now;
+        return error;
+    }
+
+    void reset_stats() { stats = PacerStats(); }
+
+    /// @retval where the frame grid starts: deadline n is this plus n frame periods
+    int64_t grid_ns() const { return start_ns; }
+
+    /// Moves onto another pacer's frame grid, keeping the frame count, so pacers started together wake for the
+    /// same frame at the same time, e.g. one per output all following a reference output's align_to_hardware().
+    void follow_grid(int64_t grid_start_ns) { start_ns = grid_start_ns; }
+
+    /// @retval the current spin tail, the margin before each deadline that is busy waited
+    int64_t spin_tail_ns() const { return spin_ns; }
+
+    PacerStats stats;
+
+private:
+    static int64_t ticks_to_ns(int64_t ticks, int64_t scale) {
+        return ticks / scale * 1000000000 + ticks % scale * 1000000000 / scale;
+    }
+
+    /// Sizes the spin tail from how late clock_nanosleep wakes us: a slow moving average of the oversleep
+    /// plus headroom, so almost every wake lands before the deadline and the spin stays short.
+    void calibrate(int64_t oversleep) {
+        oversleep = std::max<int64_t>(oversleep, 0);
+        oversleep_avg += (oversleep - oversleep_avg) / 16;
+        oversleep_peak = std::max(oversleep, oversleep_peak - oversleep_peak / 256);
+        spin_ns = std::clamp<int64_t>(std::max(oversleep_avg * 3, oversleep_peak) + 10000, min_spin_ns, max_spin_ns);
+    }
+
+    static constexpr int64_t min_spin_ns = 20000;
+    static constexpr int64_t max_spin_ns = 2000000;
+
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    int64_t start_ns = 0;
+    int64_t frame = 0;
+    int64_t last_wake_ns = 0;
+    int64_t spin_ns = 100000;
+    int64_t oversleep_avg = 50000;
+    int64_t oversleep_peak = 50000;
+};
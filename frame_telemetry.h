@@ -0,0 +1,353 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Log linear histogram of non negative integers with under 1.6% relative error, in a fixed array sized for the
+/// whole int64 range. Values below 128 are counted exactly; above that each power of two is split into 64 buckets.
+/// One thread records, any thread may read: counts only ever grow, so a reader takes the difference of two
+/// snapshots to get an interval without the writer ever resetting anything.
+class HdrHistogram {
+public:
+    static constexpr int linear_bits = 7;
+    static constexpr int sub_buckets = 1 << (linear_bits - 1);
+    static constexpr int bucket_count = (1 << linear_bits) + (63 - linear_bits) * sub_buckets;
+
+    struct Snapshot {
+        uint64_t counts[bucket_count];
+        uint64_t total;
+        int64_t max;
+
+        /// @retval the value at quantile q (0..1), as the top of its bucket; 0 if empty
+        int64_t value_at(double q) const {
+            if (total == 0) {
+                return 0;
+            }
+            uint64_t rank = (uint64_t) (q * (total - 1)) + 1;
+            uint64_t seen = 0;
+            for (int i = 0; i < bucket_count; ++i) {
+                seen += counts[i];
+                if (seen >= rank) {
+                    return std::min(bucket_top(i), max);
+                }
+            }
+            return max;
+        }
+
+        /// Turns this cumulative snapshot into the counts since earlier; max stays the all time max.
+        void subtract(const Snapshot &earlier) {
+            for (int i = 0; i < bucket_count; ++i) {
+                counts[i] -= earlier.counts[i];
+            }
+            total -= earlier.total;
+        }
+    };
+
+    /// Writer side, from one thread only. Negative values are counted as 0.
+    void record(int64_t value) {
+        uint64_t v = value < 0 ? 0 : (uint64_t) value;
+        std::atomic<uint64_t> &c = counts[index(v)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if ((int64_t) v > max.load(std::memory_order_relaxed)) {
+            max.store((int64_t) v, std::memory_order_relaxed);
+        }
+        total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void snapshot(Snapshot &s) const {
+        s.total = total.load(std::memory_order_acquire);
+        for (int i = 0; i < bucket_count; ++i) {
+            s.counts[i] = counts[i].load(std::memory_order_relaxed);
+        }
+        s.max = max.load(std::memory_order_relaxed);
+        // the writer may have moved on while we copied; make total agree with the buckets we actually saw
+        uint64_t sum = 0;
+        for (int i = 0; i < bucket_count; ++i) {
+            sum += s.counts[i];
+        }
+        s.total = sum;
+    }
+
+    static int index(uint64_t v) {
+        if (v < (1u << linear_bits)) {
+            return (int) v;
+        }
+        int shift = 63 - __builtin_clzll(v) - (linear_bits - 1);
+        return (1 << linear_bits) + (shift - 1) * sub_buckets + (int) ((v >> shift) - sub_buckets);
+    }
+
+    static int64_t bucket_top(int i) {
+        if (i < (1 << linear_bits)) {
+            return i;
+        }
+        int shift = (i - (1 << linear_bits)) / sub_buckets + 1;
+        uint64_t sub = (i - (1 << linear_bits)) % sub_buckets + sub_buckets;
+        return (int64_t) (((sub + 1) << shift) - 1);
+    }
+
+private:
+    std::atomic<uint64_t> counts[bucket_count] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<int64_t> max{0};
+};
+
+/// Per frame timing telemetry for the playout loop.
+///
+/// The playout thread calls record() for whichever metrics it has this frame and end_frame() once per frame;
+/// both are a handful of relaxed stores into memory allocated up front, with no locks, syscalls or formatting.
+/// A reporter thread prints interval p50/p99/p99.9/max per metric every few seconds, and on SIGUSR1 writes the
+/// last trace_frames frames to a binary trace file:
+///   TraceHeader, then TraceHeader::records x TraceRecord, little endian, metric values -1 where not recorded.
+/// Each trace slot is a seqlock, so the dump never reads a record while the playout thread is writing it.
+class FrameTelemetry {
+public:
+    enum Metric {
+        wake_latency_ns,  // how far past the frame deadline the loop woke
+        clock_delta,      // hardware clock advance since the previous frame, in the mode's timeScale
+        time_in_frame,    // timeInFrame from GetHardwareReferenceClock
+        audio_buffered,   // buffered audio sample frames before this frame's write
+        clock_polls,      // GetHardwareReferenceClock calls made waiting for this frame
+        metric_count
+    };
+
+    enum Counter {
+        audio_underflows,
+        audio_overflows,
+        display_failures,
+        off_nominal_frames, // clock_delta differed from the nominal frame duration
+        ticks_changed,      // ticksPerFrame changed while polling
+        counter_count
+    };
+
+    struct TraceHeader {
+        char magic[8];   // "FRMTRACE"
+        uint32_t version; // 1
+        uint32_t metrics; // metric_count
+        uint64_t records;
+    };
+
+    struct TraceRecord {
+        int64_t frame;
+        int64_t host_ns; // CLOCK_MONOTONIC at end_frame()
+        int64_t values[metric_count];
+    };
+
+    static const char *metric_name(int m) {
+        static const char *names[metric_count] = {"wake_latency_ns", "clock_delta", "time_in_frame", "audio_buffered",
+                                                  "clock_polls"};
+        return names[m];
+    }
+
+    static const char *counter_name(int c) {
+        static const char *names[counter_count] = {"audio_underflows", "audio_overflows", "display_failures",
+                                                   "off_nominal_frames", "ticks_changed"};
+        return names[c];
+    }
+
+    /// trace_frames is rounded up to a power of two
+    explicit FrameTelemetry(uint32_t trace_frames = 1 << 16) {
+        uint32_t n = 1;
+        while (n < trace_frames) {
+            n <<= 1;
+        }
+        trace.reset(new TraceSlot[n]());
+        trace_size = n;
+        trace_mask = n - 1;
+        clear_current();
+    }
+
+    ~FrameTelemetry() { stop_reporter(); }
+
+    FrameTelemetry(const FrameTelemetry &) = delete;
+    FrameTelemetry &operator=(const FrameTelemetry &) = delete;
+
+    // playout thread
+
+    void record(Metric m, int64_t value) {
+        histograms[m].record(value);
+        current.values[m] = value;
+    }
+
+    void count(Counter c, uint64_t n = 1) {
+        counters[c].store(counters[c].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void end_frame(int64_t frame) {
+        current.frame = frame;
+        current.host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now().time_since_epoch()).count();
+        uint64_t n = frames.load(std::memory_order_relaxed);
+        // the slot's sequence is odd while frame n is written into it and 2(n + 1) once it holds frame n
+        TraceSlot &slot = trace[n & trace_mask];
+        slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.frame.store(current.frame, std::memory_order_relaxed);
+        slot.host_ns.store(current.host_ns, std::memory_order_relaxed);
+        for (int m = 0; m < metric_count; ++m) {
+            slot.values[m].store(current.values[m], std::memory_order_relaxed);
+        }
+        slot.sequence.store(2 * n + 2, std::memory_order_release);
+        frames.store(n + 1, std::memory_order_release);
+        clear_current();
+    }
+
+    // any thread
+
+    /// Copies the cumulative histogram for one metric; subtract an earlier copy to get an interval.
+    void snapshot(Metric m, HdrHistogram::Snapshot &s) const { histograms[m].snapshot(s); }
+
+    /// Prints percentiles of everything recorded since the last call, plus the counters.
+    void print_summary(std::ostream &out) {
+        std::lock_guard<std::mutex> guard(report_lock);
+        uint64_t now_frames = frames.load(std::memory_order_acquire);
+        out << "telemetry frames " << now_frames - reported_frames << "\n";
+        reported_frames = now_frames;
+        for (int m = 0; m < metric_count; ++m) {
+            histograms[m].snapshot(scratch);
+            HdrHistogram::Snapshot interval = scratch;
+            interval.subtract(last[m]);
+            last[m] = scratch;
+            if (interval.total == 0) {
+                continue;
+            }
+            out << "  " << metric_name(m) << " p50 " << interval.value_at(0.5) << " p99 " << interval.value_at(0.99)
+                << " p99.9 " << interval.value_at(0.999) << " max " << interval.value_at(1.0) << " (all time "
+                << interval.max << ")\n";
+        }
+        out << " ";
+        for (int c = 0; c < counter_count; ++c) {
+            out << " " << counter_name(c) << " " << counters[c].load(std::memory_order_relaxed);
+        }
+        out << std::endl;
+    }
+
+    /// Writes the frames still held in the trace ring. Records the playout thread overwrites during the copy are
+    /// left out.
+    /// @retval false if the file could not be written
+    bool dump_trace(const char *path) {
+        uint64_t end = frames.load(std::memory_order_acquire);
+        uint64_t begin = end > trace_size ? end - trace_size : 0;
+        std::vector<TraceRecord> copy;
+        copy.reserve(end - begin);
+        for (uint64_t i = begin; i < end; ++i) {
+            const TraceSlot &slot = trace[i & trace_mask];
+            // keep the record only if the slot held frame i, finished, both before and after copying it
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if (before != 2 * i + 2) {
+                continue;
+            }
+            TraceRecord r;
+            r.frame = slot.frame.load(std::memory_order_relaxed);
+            r.host_ns = slot.host_ns.load(std::memory_order_relaxed);
+            for (int m = 0; m < metric_count; ++m) {
+                r.values[m] = slot.values[m].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == before) {
+                copy.push_back(r);
+            }
+        }
+
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+            return false;
+        }
+        TraceHeader header;
+        memcpy(header.magic, "FRMTRACE", 8);
+        header.version = 1;
+        header.metrics = metric_count;
+        header.records = copy.size();
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && fwrite(copy.data(), sizeof(TraceRecord), header.records, f) == header.records;
+        return fclose(f) == 0 && ok;
+    }
+
+    /// Starts a thread that prints a summary every period to clog and dumps the trace to trace_path, if given,
+    /// whenever the process gets SIGUSR1.
+    void start_reporter(std::chrono::milliseconds period, const char *trace_path = nullptr) {
+        if (trace_path) {
+            this->trace_path = trace_path;
+            signal(SIGUSR1, [](int) { dump_requested() = 1; });
+        }
+        reporter = std::thread([this, period] {
+            auto next = std::chrono::steady_clock::now() + period;
+            std::unique_lock<std::mutex> guard(wake_lock);
+            while (!stopping) {
+                // wake often enough to notice a dump request promptly
+                wake.wait_until(guard, std::min(next, std::chrono::steady_clock::now() + std::chrono::milliseconds(100)));
+                if (dump_requested()) {
+                    dump_requested() = 0;
+                    std::clog << "trace " << (dump_trace(this->trace_path.c_str()) ? "written to " : "FAILED for ")
+                              << this->trace_path << std::endl;
+                }
+                if (period.count() > 0 && std::chrono::steady_clock::now() >= next) {
+                    print_summary(std::clog);
+                    next += period;
+                }
+            }
+        });
+    }
+
+    void stop_reporter() {
+        {
+            std::lock_guard<std::mutex> guard(wake_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (reporter.joinable()) {
+            reporter.join();
+        }
+    }
+
+private:
+    // a TraceRecord as relaxed atomics behind a sequence, so the reporter can copy it while the playout thread
+    // moves on to the next slot
+    struct TraceSlot {
+        std::atomic<uint64_t> sequence;
+        std::atomic<int64_t> frame;
+        std::atomic<int64_t> host_ns;
+        std::atomic<int64_t> values[metric_count];
+    };
+
+    static volatile sig_atomic_t &dump_requested() {
+        static volatile sig_atomic_t requested = 0;
+        return requested;
+    }
+
+    void clear_current() {
+        for (int m = 0; m < metric_count; ++m) {
+            current.values[m] = -1;
+        }
+    }
+
+    HdrHistogram histograms[metric_count];
+    std::atomic<uint64_t> counters[counter_count] = {};
+    std::unique_ptr<TraceSlot[]> trace;
+    uint64_t trace_size;
+    uint64_t trace_mask;
+    std::atomic<uint64_t> frames{0};
+    TraceRecord current{};
+
+    std::mutex report_lock;
+    HdrHistogram::Snapshot last[metric_count] = {};
+    HdrHistogram::Snapshot scratch;
+    uint64_t reported_frames = 0;
+
+    std::string trace_path;
+    std::thread reporter;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+};
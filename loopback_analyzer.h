@@ -0,0 +1,861 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "frame_pacer.h"
+#include "spsc_ring.h"
+#include "video_frame_pool.h"
+
+/// In place radix 2 complex FFT on separate real and imaginary arrays. Each stage's twiddles are stored one after
+/// another and the butterflies of a stage run over contiguous halves, so the inner loop is plain float arithmetic
+/// on unit stride arrays that the compiler vectorises (at -O3).
+class Fft {
+public:
+    /// size: a power of two
+    explicit Fft(uint32_t size) : n(size) {
+        int bits = 0;
+        while ((1u << bits) < n) {
+            ++bits;
+        }
+        reversed.resize(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t r = 0;
+            for (int b = 0; b < bits; ++b) {
+                r |= (i >> b & 1) << (bits - 1 - b);
+            }
+            reversed[i] = r;
+        }
+        for (uint32_t half = 1; half < n; half <<= 1) {
+            for (uint32_t j = 0; j < half; ++j) {
+                twiddle_re.push_back((float) cos(M_PI * j / half));
+                twiddle_im.push_back((float) -sin(M_PI * j / half));
+            }
+        }
+    }
+
+    uint32_t size() const { return n; }
+
+    /// The inverse is unscaled, n times too large.
+    void transform(float *re, float *im, bool inverse) const {
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t r = reversed[i];
+            if (r > i) {
+                std::swap(re[i], re[r]);
+                std::swap(im[i], im[r]);
+            }
+        }
+        const float sign = inverse ? -1.0f : 1.0f;
+        const float *wr = twiddle_re.data();
+        const float *wi = twiddle_im.data();
+        for (uint32_t half = 1; half < n; half <<= 1) {
+            for (uint32_t start = 0; start < n; start += 2 * half) {
+                butterflies(re + start, im + start, re + start + half, im + start + half, wr, wi, sign, half);
+            }
+            wr += half;
+            wi += half;
+        }
+    }
+
+private:
+    static void butterflies(float *__restrict ar, float *__restrict ai, float *__restrict br, float *__restrict bi,
+                            const float *__restrict wr, const float *__restrict wi, float sign, uint32_t half) {
+        for (uint32_t j = 0; j < half; ++j) {
+            float c = wr[j], s = sign * wi[j];
+            float tr = br[j] * c - bi[j] * s;
+            float ti = br[j] * s + bi[j] * c;
+            br[j] = ar[j] - tr;
+            bi[j] = ai[j] - ti;
+            ar[j] += tr;
+            ai[j] += ti;
+        }
+    }
+
+    uint32_t n;
+    std::vector<uint32_t> reversed;
+    std::vector<float> twiddle_re;
+    std::vector<float> twiddle_im;
+};
+
+/// Finds where a window of captured audio sits in a periodic reference by generalised cross-correlation with the
+/// phase transform (GCC-PHAT): the cross spectrum is whitened before the inverse transform, so a loud sine that
+/// repeats every millisecond adds one bin rather than a comb of equal peaks, and the broadband part of the
+/// reference decides the answer. The reference spectrum is computed once; each locate() is one forward and one
+/// inverse FFT of the next power of two above period + window.
+class ReferenceLocator {
+public:
+    /// reference: one period of a mono signal
+    ReferenceLocator(const float *reference, uint32_t period, uint32_t window)
+        : period(period), window(window), fft(fft_size(period + window)), ref_re(fft.size()), ref_im(fft.size()),
+          re(fft.size()), im(fft.size()) {
+        for (uint32_t i = 0; i < period + window; ++i) {
+            ref_re[i] = reference[i % period];
+        }
+        fft.transform(ref_re.data(), ref_im.data(), false);
+    }
+
+    /// capture: window samples
+    /// @retval confidence, the correlation peak over its rms; offset is where capture[0] lines up in the reference
+    float locate(const float *capture, uint32_t &offset) {
+        std::fill(re.begin(), re.end(), 0.0f);
+        std::fill(im.begin(), im.end(), 0.0f);
+        std::copy(capture, capture + window, re.begin());
+        fft.transform(re.data(), im.data(), false);
+        // conj(X) R, whitened
+        const uint32_t n = fft.size();
+        for (uint32_t i = 0; i < n; ++i) {
+            float gr = re[i] * ref_re[i] + im[i] * ref_im[i];
+            float gi = re[i] * ref_im[i] - im[i] * ref_re[i];
+            float m = 1.0f / (std::sqrt(gr * gr + gi * gi) + 1e-20f);
+            re[i] = gr * m;
+            im[i] = gi * m;
+        }
+        fft.transform(re.data(), im.data(), true);
+        // lags up to period only: past that the correlation runs off the end of the extended reference
+        double sum = 0.0;
+        float peak = 0.0f;
+        offset = 0;
+        for (uint32_t k = 0; k < period; ++k) {
+            sum += (double) re[k] * re[k];
+            if (re[k] > peak) {
+                peak = re[k];
+                offset = k;
+            }
+        }
+        return (float) (peak / std::sqrt(sum / period + 1e-30));
+    }
+
+private:
+    static uint32_t fft_size(uint32_t at_least) {
+        uint32_t n = 1;
+        while (n < at_least) {
+            n <<= 1;
+        }
+        return n;
+    }
+
+    uint32_t period;
+    uint32_t window;
+    Fft fft;
+    std::vector<float> ref_re, ref_im; // reference spectrum
+    std::vector<float> re, im;         // scratch
+};
+
+/// @retval a mask with bit c set where channel c of any of frames differs from ref by more than tolerance. Compares
+/// modulo 2^32, which only goes wrong for differences near full scale. With Channels fixed the loop runs over whole
+/// frames of one lane per channel and the compiler vectorises it; Channels 0 takes the count at run time.
+template <typename Sample, int Channels>
+uint64_t mismatched_channels(const void *capture, const void *ref, uint32_t frames, uint32_t channels,
+                             uint32_t tolerance) {
+    const Sample *x = static_cast<const Sample *>(capture);
+    const Sample *r = static_cast<const Sample *>(ref);
+    const uint32_t ch = Channels ? Channels : channels;
+    uint32_t bad[Channels ? Channels : 64] = {};
+    for (uint32_t f = 0; f < frames; ++f) {
+        for (uint32_t c = 0; c < ch; ++c) {
+            uint32_t d = (uint32_t) x[f * ch + c] - (uint32_t) r[f * ch + c] + tolerance;
+            bad[c] |= d > 2 * tolerance;
+        }
+    }
+    uint64_t mask = 0;
+    for (uint32_t c = 0; c < ch; ++c) {
+        mask |= (uint64_t) (bad[c] != 0) << c;
+    }
+    return mask;
+}
+
+/// Adds a different low level white noise to every channel of a one second reference loop. The sine alone repeats
+/// every cycle, so a window of it could only be located to within one cycle and a block played twice would go
+/// unnoticed; with the noise every window and every shift is unique. Saturates rather than wraps.
+inline void add_reference_noise(char *one_second, uint32_t sample_rate, int bits, int channels, double level_dbfs) {
+    const double full_scale = bits == 16 ? 32767.0 : 2147483647.0;
+    const double amplitude = pow(10.0, level_dbfs / 20.0) * sqrt(3.0) * full_scale; // uniform, so rms is a / sqrt(3)
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    for (uint64_t i = 0; i < (uint64_t) sample_rate * channels; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double noise = amplitude * ((double) (state >> 11) / 9007199254740992.0 * 2.0 - 1.0);
+        if (bits == 16) {
+            int16_t v;
+            memcpy(&v, one_second + i * 2, 2);
+            v = (int16_t) std::min(std::max(lrint(v + noise), -32768l), 32767l);
+            memcpy(one_second + i * 2, &v, 2);
+        }
+        else {
+            int32_t v;
+            memcpy(&v, one_second + i * 4, 4);
+            v = (int32_t) std::min(std::max((double) v + noise, -2147483648.0), 2147483647.0);
+            memcpy(one_second + i * 4, &v, 4);
+        }
+    }
+}
+
+/// What the playout loop sent with one frame, for telling which frame carried a stretch of captured audio.
+struct SentFrame {
+    int64_t frame_count;
+    int64_t write_ns;       // FramePacer::now_ns() just before the audio write
+    uint32_t loop_position; // sample frames into the one second reference loop of the first sample written
+    uint32_t frames;        // sample frames meant to be written
+    uint32_t written;       // and taken by the card
+    uint32_t buffered;      // GetBufferedAudioSampleFrameCount before the write
+};
+
+/// One line of the timeline.
+struct LoopbackEvent {
+    enum Type {
+        locked,          // found the reference in the capture; samples is the alignment
+        inexact,         // found it by correlation, but not sample for sample: gain, resampling or a lossy path
+        channels,        // on locking, these channels did not match and are left out from now on
+        click,           // samples corrupted, the stream carries on where it was
+        dropout,         // samples replaced by silence, the stream carries on where it was
+        gap,             // silence or garbage inserted, the stream resumes from where it stopped
+        repeat,          // the stream jumped back: samples played again
+        skip,            // the stream jumped ahead: samples never played
+        lost,            // no way back into the reference found; searching again
+        capture_overrun, // the analyser fell behind and the capture ring dropped samples
+        video_repeat,    // the same frame number captured twice
+        video_skip,      // frame numbers missing; samples is how many
+        av_jump,         // the A/V offset moved by more than a millisecond
+        type_count
+    };
+
+    Type type;
+    double capture_s;      // seconds of captured audio before the event
+    int64_t frame_count;   // the sender's frame that carried the audio (or video) there, -1 if unknown
+    uint64_t channel_mask; // audio events: the channels that differed
+    int64_t samples;
+    double latency_ms;     // the carrying frame's audio write to the capture of its first sample, -1 if unknown
+    double av_offset_ms;   // audio behind video (> 0) at the last measurement, NaN before the first
+    int64_t sender_buffered; // the card's buffer level the sender saw before writing that frame, -1 if unknown
+
+    static const char *name(Type t) {
+        static const char *names[type_count] = {"locked", "inexact", "channels", "click", "dropout", "gap",
+                                                "repeat", "skip", "lost", "capture_overrun", "video_repeat",
+                                                "video_skip", "av_jump"};
+        return names[t];
+    }
+};
+
+/// Checks what comes back on a loopback input against what the playout loop sent.
+///
+/// The playout loop plays a one second reference loop (the sine from get_sine_signal with add_reference_noise on
+/// top) and reports each frame's loop position through sent(); the input callback hands every captured packet to
+/// captured(). Both only copy into wait free rings. An analysis thread then:
+///  - locates the capture in the reference with ReferenceLocator, and checks the match sample for sample;
+///  - from then on compares every 64 frame block of every channel with the reference at that alignment, with
+///    mismatched_channels() specialised for the sample type and channel count;
+///  - where a block differs, works out what happened by finding where the capture rejoins the reference: at the
+///    same alignment (click or dropout), shifted back by the length of the disturbance (gap, the card ran dry), or
+///    shifted by anything else up to 100 ms (repeat or skip), and moves the alignment accordingly;
+///  - measures end to end latency (audio write to capture) per packet from the sender's write times, and the A/V
+///    offset per frame from where the audio written with frame N lands in the packet that carries video frame N;
+///  - and reports each event with the sender's frame_count, so it can be put next to the sender's own counters.
+/// Needs a bit exact path, as SDI loopback is; tolerance covers 32 bit audio cut to SDI's 24.
+class LoopbackAnalyzer {
+public:
+    static constexpr uint32_t block = 64;    // frames per comparison
+    static constexpr uint32_t window = 16384; // frames per correlation
+
+    /// reference: the one second loop the playout loop plays, interleaved, bits 16 or 32
+    LoopbackAnalyzer(const char *reference, uint32_t sample_rate, int bits, int channels)
+        : sample_rate(sample_rate), bits(bits), channels(channels), frame_bytes(bits / 8 * channels),
+          tolerance(bits == 16 ? 1 : 256), max_shift(sample_rate / 10),
+          audio_ring(sample_rate, frame_bytes), packet_ring(256, sizeof(CapturePacket)),
+          sent_ring(256, sizeof(SentFrame)), zeros((size_t) block * frame_bytes) {
+        // mirrored past the end so a block at any alignment is contiguous
+        loop.resize((size_t) (sample_rate + block) * frame_bytes);
+        memcpy(loop.data(), reference, (size_t) sample_rate * frame_bytes);
+        memcpy(loop.data() + (size_t) sample_rate * frame_bytes, reference, (size_t) block * frame_bytes);
+        std::vector<float> mono(sample_rate);
+        for (uint32_t i = 0; i < sample_rate; ++i) {
+            mono[i] = channel0(loop.data() + (size_t) i * frame_bytes);
+        }
+        locator = new ReferenceLocator(mono.data(), sample_rate, window);
+        compare = pick_compare(bits, channels);
+        all_channels = channels >= 64 ? ~0ull : (1ull << channels) - 1;
+    }
+
+    ~LoopbackAnalyzer() {
+        stop();
+        delete locator;
+    }
+
+    LoopbackAnalyzer(const LoopbackAnalyzer &) = delete;
+    LoopbackAnalyzer &operator=(const LoopbackAnalyzer &) = delete;
+
+    // playout thread
+
+    void sent(const SentFrame &f) {
+        if (sent_ring.write(reinterpret_cast<const char *>(&f), 1) == 0) {
+            sent_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // capture thread
+
+    /// audio: frames of interleaved samples in the reference's format; video_frame: the counter read off the captured
+    /// frame, -1 for none
+    void captured(const void *audio, uint32_t frames, int64_t arrival_ns, int64_t video_frame) {
+        CapturePacket p{frames, 0, arrival_ns, video_frame};
+        if (frames) {
+            uint32_t n = audio_ring.write(static_cast<const char *>(audio), frames);
+            p.dropped = frames - n;
+        }
+        if (packet_ring.write(reinterpret_cast<const char *>(&p), 1) == 0) {
+            // the analyser is far behind; its audio is in the ring with no packet to account for it
+            packet_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // analysis thread
+
+    /// Called with every event from the analysis thread; start() sets one that logs and writes the timeline.
+    std::function<void(const LoopbackEvent &)> on_event;
+
+    /// Runs process() every 10 ms on a thread of its own, logging events and, every report, the latency, A/V offset
+    /// and event counts. timeline_path: a CSV file for every event, or nullptr.
+    void start(std::ostream &log, const char *timeline_path, std::chrono::seconds report) {
+        if (timeline_path) {
+            timeline.open(timeline_path);
+            timeline << "event,capture_s,frame_count,channels,samples,latency_ms,av_offset_ms,sender_buffered\n";
+        }
+        on_event = [this, &log](const LoopbackEvent &e) {
+            if (timeline.is_open()) {
+                timeline << LoopbackEvent::name(e.type) << "," << e.capture_s << "," << e.frame_count << ","
+                         << e.channel_mask << "," << e.samples << "," << e.latency_ms << "," << e.av_offset_ms << ","
+                         << e.sender_buffered << std::endl;
+            }
+            if (e.type == LoopbackEvent::av_jump) {
+                return; // timeline only, they come with every gap and skip
+            }
+            log << "loopback " << LoopbackEvent::name(e.type) << " at " << e.capture_s << " s frame " << e.frame_count;
+            if (e.channel_mask) {
+                log << " channels 0x" << std::hex << e.channel_mask << std::dec;
+            }
+            log << " samples " << e.samples << " latency " << e.latency_ms << " ms";
+            if (e.sender_buffered >= 0) {
+                log << " sender saw " << e.sender_buffered << " buffered";
+            }
+            log << std::endl;
+        };
+        running = true;
+        worker = std::thread([this, &log, report] {
+            auto next_report = std::chrono::steady_clock::now() + report;
+            while (running) {
+                process();
+                if (report.count() > 0 && std::chrono::steady_clock::now() >= next_report) {
+                    next_report += report;
+                    print_summary(log);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+    }
+
+    void stop() {
+        running = false;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    /// Analyses everything captured so far, less the look ahead a disturbance needs to be classified.
+    void process() {
+        drain_sent();
+        CapturePacket p;
+        while (packet_ring.readable()) {
+            SpscAudioRing::Spans s = packet_ring.read_spans(1);
+            memcpy(&p, s.first, sizeof(p));
+            packet_ring.commit_read(1);
+            take_packet(p);
+        }
+        analyse();
+        measure_packets();
+    }
+
+    /// Per report interval, reset by print_summary().
+    struct Summary {
+        long packets = 0;
+        double latency_min = 0, latency_max = 0, latency_sum = 0;
+        long latency_count = 0;
+        double av_min = 0, av_max = 0, av_sum = 0;
+        long av_count = 0;
+    };
+
+    void print_summary(std::ostream &log) {
+        log << "loopback " << (state == locked ? "locked" : "searching");
+        if (summary.latency_count) {
+            log << " latency ms " << summary.latency_min << "/" << summary.latency_sum / summary.latency_count << "/"
+                << summary.latency_max;
+        }
+        if (summary.av_count) {
+            log << " A/V ms " << summary.av_min << "/" << summary.av_sum / summary.av_count << "/" << summary.av_max;
+        }
+        for (int t = LoopbackEvent::click; t < LoopbackEvent::type_count; ++t) {
+            if (counts[t]) {
+                log << " " << LoopbackEvent::name((LoopbackEvent::Type) t) << " " << counts[t];
+            }
+        }
+        long dropped = sent_dropped.load(std::memory_order_relaxed) + packet_dropped.load(std::memory_order_relaxed);
+        if (dropped) {
+            log << " records dropped " << dropped;
+        }
+        log << std::endl;
+        summary = Summary();
+    }
+
+    /// Events so far, by LoopbackEvent::Type.
+    long counts[LoopbackEvent::type_count] = {};
+    Summary summary;
+
+private:
+    struct CapturePacket {
+        uint32_t frames;
+        uint32_t dropped; // of frames, lost to a full ring
+        int64_t arrival_ns;
+        int64_t video_frame;
+    };
+
+    /// A packet still being analysed: where it is in the capture.
+    struct Packet {
+        uint64_t first;
+        uint32_t frames;
+        int64_t arrival_ns;
+        int64_t video_frame;
+    };
+
+    enum State { searching, locked };
+
+    using CompareFn = uint64_t (*)(const void *, const void *, uint32_t, uint32_t, uint32_t);
+
+    static CompareFn pick_compare(int bits, int channels) {
+        if (bits == 16) {
+            return channels == 2 ? &mismatched_channels<int16_t, 2>
+                   : channels == 8 ? &mismatched_channels<int16_t, 8>
+                   : channels == 16 ? &mismatched_channels<int16_t, 16> : &mismatched_channels<int16_t, 0>;
+        }
+        return channels == 2 ? &mismatched_channels<int32_t, 2>
+               : channels == 8 ? &mismatched_channels<int32_t, 8>
+               : channels == 16 ? &mismatched_channels<int32_t, 16> : &mismatched_channels<int32_t, 0>;
+    }
+
+    float channel0(const char *frame) const {
+        if (bits == 16) {
+            int16_t v;
+            memcpy(&v, frame, 2);
+            return v / 32768.0f;
+        }
+        int32_t v;
+        memcpy(&v, frame, 4);
+        return v / 2147483648.0f;
+    }
+
+    void drain_sent() {
+        SentFrame f;
+        while (sent_ring.readable()) {
+            SpscAudioRing::Spans s = sent_ring.read_spans(1);
+            memcpy(&f, s.first, sizeof(f));
+            sent_ring.commit_read(1);
+            history.push_back(f);
+        }
+        // two seconds back is plenty: latency has to be under a second for the loop position to say which frame
+        while (!history.empty() && history.back().write_ns - history.front().write_ns > 2000000000) {
+            history.pop_front();
+        }
+    }
+
+    void take_packet(const CapturePacket &p) {
+        uint32_t kept = p.frames - p.dropped;
+        size_t at = pending.size();
+        pending.resize(at + (size_t) kept * frame_bytes);
+        SpscAudioRing::Spans s = audio_ring.read_spans(kept);
+        memcpy(&pending[at], s.first, (size_t) s.first_frames * frame_bytes);
+        if (s.second_frames) {
+            memcpy(&pending[at + (size_t) s.first_frames * frame_bytes], s.second, (size_t) s.second_frames * frame_bytes);
+        }
+        audio_ring.commit_read(s.frames());
+        packets.push_back(Packet{captured_frames, p.frames, p.arrival_ns, p.video_frame});
+        captured_frames += kept;
+        check_video(p.video_frame);
+        if (p.dropped) {
+            // nothing lines up across the hole; start again after it
+            emit(LoopbackEvent::capture_overrun, captured_frames, p.dropped, 0);
+            captured_frames += p.dropped;
+            pending.clear();
+            pending_first = captured_frames;
+            cursor = captured_frames;
+            packets.clear();
+            state = searching;
+        }
+        summary.packets++;
+    }
+
+    void check_video(int64_t frame) {
+        if (frame < 0) {
+            return;
+        }
+        if (last_video >= 0) {
+            if (frame == last_video) {
+                emit(LoopbackEvent::video_repeat, captured_frames, 1, 0, frame);
+            }
+            else if (frame > last_video + 1) {
+                emit(LoopbackEvent::video_skip, captured_frames, frame - last_video - 1, 0, frame);
+            }
+        }
+        last_video = frame;
+    }
+
+    const char *at(uint64_t i) const { return pending.data() + (size_t) (i - pending_first) * frame_bytes; }
+    uint64_t end() const { return pending_first + pending.size() / frame_bytes; }
+
+    uint32_t loop_position(uint64_t i, int64_t k) const {
+        int64_t p = ((int64_t) (i % sample_rate) + k) % (int64_t) sample_rate;
+        return (uint32_t) (p < 0 ? p + sample_rate : p);
+    }
+
+    /// @retval channels of the block at capture index i that differ from the reference at alignment k
+    uint64_t mismatch(uint64_t i, int64_t k, uint32_t frames = block) const {
+        return compare(at(i), loop.data() + (size_t) loop_position(i, k) * frame_bytes, frames, channels, tolerance) &
+               live;
+    }
+
+    void set_alignment(int64_t k) { alignment = (k % (int64_t) sample_rate + sample_rate) % sample_rate; }
+
+    bool silent(uint64_t i) const { return (compare(at(i), zeros.data(), 1, channels, tolerance) & live) == 0; }
+
+    void analyse() {
+        while (true) {
+            if (state == searching) {
+                if (end() - cursor < window + block) {
+                    break;
+                }
+                search();
+                continue;
+            }
+            if (end() - cursor < block) {
+                break;
+            }
+            if (!mismatch(cursor, alignment)) {
+                cursor += block;
+                continue;
+            }
+            // enough capture after it to find the way back in
+            if (end() - cursor < block + max_shift + block) {
+                break;
+            }
+            classify();
+        }
+        // keep a second behind the cursor at most
+        if (cursor - pending_first > sample_rate) {
+            uint64_t drop = cursor - pending_first - block;
+            pending.erase(pending.begin(), pending.begin() + (size_t) drop * frame_bytes);
+            pending_first += drop;
+        }
+    }
+
+    void search() {
+        std::vector<float> &mono = search_scratch;
+        mono.resize(window);
+        double energy = 0.0;
+        for (uint32_t i = 0; i < window; ++i) {
+            mono[i] = channel0(at(cursor + i));
+            energy += (double) mono[i] * mono[i];
+        }
+        // below -60 dBFS rms there is nothing to find, e.g. before the sender starts
+        if (energy / window < 1e-6) {
+            cursor += window;
+            return;
+        }
+        uint32_t offset = 0;
+        float confidence = locator->locate(mono.data(), offset);
+        int64_t k = (int64_t) offset - (int64_t) (cursor % sample_rate);
+        if (confidence < 20.0f) {
+            cursor += window / 4;
+            return;
+        }
+        // checked at the end of the window, where the capture is least likely to be the silence before the start
+        cursor += window - block;
+        live = all_channels;
+        uint64_t bad = mismatch(cursor, k);
+        if (bad & 1) {
+            if (!reported_inexact) {
+                emit(LoopbackEvent::inexact, cursor, 0, 0, carrier_frame(cursor, k));
+                reported_inexact = true;
+            }
+            cursor -= window - block - window / 4;
+            return;
+        }
+        live = all_channels & ~bad;
+        set_alignment(k);
+        state = locked;
+        reported_inexact = false;
+        emit(LoopbackEvent::locked, cursor, loop_position(cursor, k), 0, carrier_frame(cursor, k));
+        if (bad) {
+            emit(LoopbackEvent::channels, cursor, 0, bad, carrier_frame(cursor, k));
+        }
+    }
+
+    /// The block at cursor differs from the reference: find the first bad frame and where the capture rejoins.
+    void classify() {
+        uint64_t first = cursor;
+        uint64_t bad = 0;
+        while (!(bad = mismatch(first, alignment, 1))) {
+            ++first;
+        }
+        uint64_t resume = first;
+        while (resume < first + max_shift && silent(resume)) {
+            ++resume;
+        }
+        for (uint64_t j = resume; j < first + max_shift; ++j) {
+            uint32_t length = (uint32_t) (j - first);
+            if (!mismatch(j, alignment)) {
+                // the stream never moved: some samples were corrupted or muted in place
+                bool muted = j == resume && length > 0;
+                emit(muted ? LoopbackEvent::dropout : LoopbackEvent::click, first, length, bad,
+                     carrier_frame(first, alignment));
+                cursor = j;
+                return;
+            }
+            if (length > 0 && !mismatch(j, alignment - length)) {
+                // the stream stopped for length samples and carried on from where it was: the card ran dry
+                set_alignment(alignment - length);
+                emit(LoopbackEvent::gap, first, length, bad, carrier_frame(j, alignment));
+                cursor = j;
+                return;
+            }
+            if (j == resume) {
+                for (int64_t d = 1; d <= (int64_t) max_shift; ++d) {
+                    for (int64_t shift : {-d, d}) {
+                        if (!mismatch(j, alignment + shift)) {
+                            set_alignment(alignment + shift);
+                            emit(shift < 0 ? LoopbackEvent::repeat : LoopbackEvent::skip, first, std::abs(shift), bad,
+                                 carrier_frame(j, alignment));
+                            cursor = j;
+                            return;
+                        }
+                    }
+                }
+            }
+        }
+        emit(LoopbackEvent::lost, first, 0, bad, carrier_frame(first, alignment));
+        state = searching;
+        cursor = first;
+    }
+
+    /// @retval host ns at which capture sample i arrived, from the packet that carried it
+    int64_t capture_ns(uint64_t i) const {
+        for (const Packet &p : packets) {
+            if (i < p.first + p.frames) {
+                return p.arrival_ns - (int64_t) ((p.first + p.frames - i) * 1000000000ull / sample_rate);
+            }
+        }
+        return packets.empty() ? 0 : packets.back().arrival_ns;
+    }
+
+    /// @retval the most recent frame written before capture sample i arrived that carried its loop position
+    const SentFrame *carrier(uint64_t i, int64_t k) const {
+        uint32_t position = loop_position(i, k);
+        int64_t arrived = capture_ns(i);
+        for (auto f = history.rbegin(); f != history.rend(); ++f) {
+            if (f->write_ns <= arrived && (position + sample_rate - f->loop_position) % sample_rate < f->frames) {
+                return &*f;
+            }
+        }
+        return nullptr;
+    }
+
+    /// @retval ms from the write of the frame that carried capture sample i to the capture of that frame's first
+    /// sample, i.e. less i's place in the frame
+    double latency_ms(uint64_t i, int64_t k, const SentFrame &f) const {
+        uint32_t into_frame = (loop_position(i, k) + sample_rate - f.loop_position) % sample_rate;
+        return (capture_ns(i) - f.write_ns) / 1e6 - into_frame * 1000.0 / sample_rate;
+    }
+
+    const SentFrame *carrier_frame(uint64_t i, int64_t k) {
+        const SentFrame *f = carrier(i, k);
+        event_latency_ms = f ? latency_ms(i, k, *f) : -1.0;
+        return f;
+    }
+
+    void emit(LoopbackEvent::Type type, uint64_t i, int64_t samples, uint64_t mask, const SentFrame *f) {
+        emit(type, i, samples, mask, f ? f->frame_count : -1, f ? (int64_t) f->buffered : -1);
+    }
+
+    void emit(LoopbackEvent::Type type, uint64_t i, int64_t samples, uint64_t mask, int64_t frame_count = -1,
+              int64_t sender_buffered = -1) {
+        counts[type]++;
+        if (on_event) {
+            LoopbackEvent e{type, (double) i / sample_rate, frame_count, mask, samples,
+                            frame_count >= 0 ? event_latency_ms : -1.0, av_offset_ms, sender_buffered};
+            on_event(e);
+        }
+        event_latency_ms = -1.0;
+    }
+
+    /// Latency and A/V offset for every packet the cursor has passed while locked.
+    void measure_packets() {
+        while (!packets.empty() && packets.front().first + packets.front().frames <= cursor) {
+            Packet p = packets.front();
+            if (state == locked && p.frames) {
+                uint64_t last = p.first + p.frames - 1;
+                const SentFrame *f = carrier(last, alignment);
+                if (f) {
+                    record(summary.latency_min, summary.latency_max, summary.latency_sum, summary.latency_count,
+                           latency_ms(last, alignment, *f));
+                }
+                if (p.video_frame >= 0) {
+                    measure_av(p);
+                }
+            }
+            packets.pop_front();
+        }
+    }
+
+    /// Where the first sample written with frame N is, relative to the start of the packet carrying video frame N.
+    void measure_av(const Packet &p) {
+        for (auto f = history.rbegin(); f != history.rend(); ++f) {
+            if (f->frame_count != p.video_frame) {
+                continue;
+            }
+            int64_t offset = (int64_t) ((f->loop_position + 2 * sample_rate - loop_position(p.first, alignment)) %
+                                        sample_rate);
+            if (offset > sample_rate / 2) {
+                offset -= sample_rate;
+            }
+            double ms = offset * 1000.0 / sample_rate;
+            if (!std::isnan(av_offset_ms) && std::fabs(ms - av_offset_ms) > 1.0) {
+                av_offset_ms = ms;
+                emit(LoopbackEvent::av_jump, p.first, offset, 0, &*f);
+            }
+            av_offset_ms = ms;
+            record(summary.av_min, summary.av_max, summary.av_sum, summary.av_count, ms);
+            return;
+        }
+    }
+
+    static void record(double &min, double &max, double &sum, long &count, double v) {
+        min = count ? std::min(min, v) : v;
+        max = count ? std::max(max, v) : v;
+        sum += v;
+        count++;
+    }
+
+    uint32_t sample_rate;
+    int bits;
+    int channels;
+    uint32_t frame_bytes;
+    uint32_t tolerance;
+    uint32_t max_shift;
+    std::vector<char> loop;
+    ReferenceLocator *locator = nullptr;
+    CompareFn compare = nullptr;
+    uint64_t all_channels = 0;
+    uint64_t live = 0; // channels being compared
+
+    // filled by the other threads; the packet and sent frame rings carry fixed size records, not audio
+    SpscAudioRing audio_ring;
+    SpscAudioRing packet_ring;
+    SpscAudioRing sent_ring;
+    std::atomic<long> sent_dropped{0};
+    std::atomic<long> packet_dropped{0};
+
+    // the analysis thread's
+    std::vector<char> pending; // captured audio from pending_first on
+    uint64_t pending_first = 0;
+    uint64_t captured_frames = 0;
+    uint64_t cursor = 0; // everything before it has been checked
+    std::deque<Packet> packets;
+    std::deque<SentFrame> history;
+    std::vector<char> zeros;
+    std::vector<float> search_scratch;
+    State state = searching;
+    int64_t alignment = 0; // capture sample i is loop position (i + alignment) mod sample_rate
+    bool reported_inexact = false;
+    int64_t last_video = -1;
+    double av_offset_ms = NAN;
+    double event_latency_ms = -1.0;
+
+    std::atomic<bool> running{false};
+    std::thread worker;
+    std::ofstream timeline;
+};
+
+/// Feeds a LoopbackAnalyzer from an IDeckLinkInput: a real input cabled back from the output, or a SimDeckLinkInput.
+class LoopbackCapture : public IDeckLinkInputCallback {
+public:
+    LoopbackCapture(IDeckLinkInput *input, LoopbackAnalyzer *analyzer) : input(input), analyzer(analyzer) {}
+
+    /// Captures in the output's mode and audio format.
+    HRESULT start(BMDDisplayMode mode, BMDPixelFormat format, BMDAudioSampleType sample_type, uint32_t channel_count) {
+        HRESULT result = input->EnableVideoInput(mode, format, bmdVideoInputFlagDefault);
+        if (result == S_OK) {
+            result = input->EnableAudioInput(bmdAudioSampleRate48kHz, sample_type, channel_count);
+        }
+        if (result == S_OK) {
+            input->SetCallback(this);
+            result = input->StartStreams();
+        }
+        return result;
+    }
+
+    void stop() {
+        input->StopStreams();
+        input->SetCallback(nullptr);
+    }
+
+    HRESULT VideoInputFormatChanged(BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode *,
+                                    BMDDetectedVideoInputFormatFlags) override {
+        return S_OK;
+    }
+
+    HRESULT VideoInputFrameArrived(IDeckLinkVideoInputFrame *videoFrame, IDeckLinkAudioInputPacket *audioPacket) override {
+        int64_t now = FramePacer::now_ns();
+        int64_t frame_number = -1;
+        if (videoFrame) {
+            void *bytes = nullptr;
+            uint32_t n = 0;
+            videoFrame->GetBytes(&bytes);
+            if (bytes && VideoFramePool::read_counter(static_cast<const uint8_t *>(bytes), videoFrame->GetWidth(),
+                                                      videoFrame->GetHeight(), videoFrame->GetRowBytes(),
+                                                      videoFrame->GetPixelFormat(), n)) {
+                frame_number = n;
+            }
+        }
+        void *audio = nullptr;
+        uint32_t frames = 0;
+        if (audioPacket) {
+            audioPacket->GetBytes(&audio);
+            frames = (uint32_t) audioPacket->GetSampleFrameCount();
+        }
+        analyzer->captured(audio, frames, now, frame_number);
+        return S_OK;
+    }
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override {
+        if (memcmp(&iid, &IID_IDeckLinkInputCallback, sizeof(REFIID)) == 0) {
+            *ppv = static_cast<IDeckLinkInputCallback *>(this);
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    // lifetime is owned by the caller
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+private:
+    IDeckLinkInput *input;
+    LoopbackAnalyzer *analyzer;
+};
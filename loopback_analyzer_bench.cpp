@@ -0,0 +1,173 @@
+// Feeds LoopbackAnalyzer a synthetic loopback capture with known faults in it: a click on one channel, a dropout,
+// a gap where the card ran dry, a skip and a repeated block, then checks each is found with the right length and
+// sender frame, and reports what the analysis costs per second of audio and per correlation. No card needed.
+//   g++ -std=c++17 -O3 -pthread -I<sdk>/include loopback_analyzer_bench.cpp -o loopback_analyzer_bench
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include "loopback_analyzer.h"
+#include "signal_generator.h"
+
+using namespace std::chrono;
+using std::clog;
+
+const uint32_t sample_rate = 48000;
+const uint32_t frame_samples = 1920; // 25p
+const uint32_t latency = 2400;       // wire samples before the first one sent
+
+/// What the wire carries at each sample: a position in the sender's stream, corrupted or not, or silence.
+struct Wire {
+    int64_t stream;
+    bool corrupt;
+};
+const Wire silence{-1, false};
+
+struct Fault {
+    LoopbackEvent::Type type;
+    uint64_t stream;  // sender stream sample it hits
+    int64_t samples;
+    uint64_t channel_mask; // what the analyser should report
+};
+
+static bool run(int bits, int channels, int seconds) {
+    // the sender's loop: get_sine_signal's sine with the reference noise on top
+    std::vector<char> loop((size_t) sample_rate * channels * bits / 8);
+    SignalGenerator generator(sample_rate, channels, bits);
+    for (int c = 0; c < channels; ++c) {
+        generator.set_sine(c, 1000, -18 + 20 * log10(sqrt(2.0)));
+    }
+    generator.fill(loop.data(), sample_rate);
+    add_reference_noise(loop.data(), sample_rate, bits, channels, -40);
+
+    const uint64_t all = channels >= 64 ? ~0ull : (1ull << channels) - 1;
+    const Fault faults[] = {
+        {LoopbackEvent::click, 5 * sample_rate + 123, 3, 1ull << (channels - 1)},
+        {LoopbackEvent::dropout, 9 * sample_rate + 777, 100, all},
+        {LoopbackEvent::gap, 13 * sample_rate + 1920 * 3, 480, all},
+        {LoopbackEvent::skip, 17 * sample_rate + 1000, 960, all},
+        {LoopbackEvent::repeat, 21 * sample_rate + 50, 1920, all},
+    };
+
+    // the wire, as positions in the sender's stream
+    std::vector<Wire> wire(latency, silence);
+    int64_t s = 0;
+    size_t next_fault = 0;
+    while (wire.size() < (size_t) seconds * sample_rate) {
+        if (next_fault < std::size(faults) && (uint64_t) s == faults[next_fault].stream) {
+            const Fault &f = faults[next_fault++];
+            switch (f.type) {
+            case LoopbackEvent::click:
+            case LoopbackEvent::dropout:
+                for (int64_t i = 0; i < f.samples; ++i, ++s) {
+                    wire.push_back(f.type == LoopbackEvent::click ? Wire{s, true} : silence);
+                }
+                continue;
+            case LoopbackEvent::gap:
+                wire.insert(wire.end(), f.samples, silence);
+                break;
+            case LoopbackEvent::skip:
+                s += f.samples;
+                break;
+            default:
+                s -= f.samples;
+                break;
+            }
+        }
+        wire.push_back(Wire{s++, false});
+    }
+
+    LoopbackAnalyzer analyzer(loop.data(), sample_rate, bits, channels);
+    std::vector<LoopbackEvent> events;
+    analyzer.on_event = [&](const LoopbackEvent &e) { events.push_back(e); };
+
+    const uint32_t frame_bytes = channels * bits / 8;
+    std::vector<char> packet((size_t) frame_samples * frame_bytes);
+    const int64_t ns_per_frame = 1000000000ll * frame_samples / sample_rate;
+    int64_t analysis_ns = 0;
+    for (size_t p = 0; (p + 1) * frame_samples <= wire.size(); ++p) {
+        // the sender writes frame p at its start; capture packet p arrives at its end, one frame of video behind
+        analyzer.sent(SentFrame{(int64_t) p, (int64_t) p * ns_per_frame, (uint32_t) (p * frame_samples % sample_rate),
+                                frame_samples, frame_samples, latency});
+        for (uint32_t i = 0; i < frame_samples; ++i) {
+            const Wire &w = wire[p * frame_samples + i];
+            char *out = &packet[(size_t) i * frame_bytes];
+            if (w.stream < 0) {
+                memset(out, 0, frame_bytes);
+                continue;
+            }
+            memcpy(out, &loop[(size_t) (w.stream % sample_rate) * frame_bytes], frame_bytes);
+            if (w.corrupt) {
+                // a spike on the last channel only
+                char *sample = out + (channels - 1) * bits / 8;
+                if (bits == 16) {
+                    int16_t v = 30000;
+                    memcpy(sample, &v, 2);
+                }
+                else {
+                    int32_t v = 2000000000;
+                    memcpy(sample, &v, 4);
+                }
+            }
+        }
+        analyzer.captured(packet.data(), frame_samples, (int64_t) (p + 1) * ns_per_frame, (int64_t) p - 1);
+        auto t0 = steady_clock::now();
+        analyzer.process();
+        analysis_ns += duration_cast<nanoseconds>(steady_clock::now() - t0).count();
+    }
+
+    // one correlation on its own, as a search after losing lock costs
+    std::vector<float> mono(LoopbackAnalyzer::window);
+    std::vector<float> reference(sample_rate);
+    for (uint32_t i = 0; i < sample_rate; ++i) {
+        int32_t v = 0;
+        memcpy(&v, &loop[(size_t) i * frame_bytes], bits / 8);
+        reference[i] = bits == 16 ? (int16_t) v / 32768.0f : v / 2147483648.0f;
+    }
+    for (uint32_t i = 0; i < mono.size(); ++i) {
+        mono[i] = reference[(i + 12345) % sample_rate];
+    }
+    ReferenceLocator locator(reference.data(), sample_rate, LoopbackAnalyzer::window);
+    uint32_t offset = 0;
+    auto t0 = steady_clock::now();
+    float confidence = locator.locate(mono.data(), offset);
+    double locate_ms = duration<double, std::milli>(steady_clock::now() - t0).count();
+
+    bool ok = offset == 12345 && analyzer.counts[LoopbackEvent::locked] == 1 && !analyzer.counts[LoopbackEvent::lost];
+    for (const LoopbackEvent &e : events) {
+        clog << "  " << LoopbackEvent::name(e.type) << " at " << e.capture_s << " s frame " << e.frame_count
+             << " channels 0x" << std::hex << e.channel_mask << std::dec << " samples " << e.samples << " latency "
+             << e.latency_ms << " ms A/V " << e.av_offset_ms << " ms" << std::endl;
+    }
+    for (const Fault &f : faults) {
+        // expected frame: the one that carried the sample just after the fault
+        int64_t frame = (int64_t) ((f.type == LoopbackEvent::skip ? f.stream + f.samples
+                                    : f.type == LoopbackEvent::repeat ? f.stream - f.samples : f.stream) /
+                                   frame_samples);
+        bool found = false;
+        for (const LoopbackEvent &e : events) {
+            found = found || (e.type == f.type && e.samples == f.samples && e.channel_mask == f.channel_mask &&
+                              e.frame_count == frame);
+        }
+        if (!found) {
+            clog << "  MISSED " << LoopbackEvent::name(f.type) << " of " << f.samples << " in frame " << frame
+                 << std::endl;
+        }
+        ok = ok && found && analyzer.counts[f.type] == 1;
+    }
+    clog << bits << " bit " << channels << " ch: " << analysis_ns / 1e3 / seconds << " us analysis per second of audio, "
+         << locate_ms << " ms per correlation (confidence " << confidence << ")" << (ok ? "" : ", WRONG") << std::endl;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? std::max(atoi(argv[1]), 25) : 30;
+    bool ok = true;
+    ok = run(16, 2, seconds) && ok;
+    ok = run(32, 8, seconds) && ok;
+    ok = run(32, 16, seconds) && ok;
+    return ok ? 0 : 1;
+}
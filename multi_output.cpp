@@ -0,0 +1,477 @@
+// Plays out on every output in the host from one process: a worker thread per output, each pinned to a CPU of
+// its own, all waking on one frame grid that follows a reference card's clock. The bars and the audio loop exist
+// once and every output plays them; per output stats show what each output costs as more are added.
+//   g++ -std=c++17 -O2 -pthread -I<sdk>/include multi_output.cpp sim_decklink.cpp sim_decklink_dispatch.cpp -ldl -o multi_output
+//   ./multi_output -b                       # every DeckLink output in the host
+//   ./multi_output -b -sim 8 -sweep -frames 750   # 1, 2, 4 and 8 simulated outputs, 30 s each
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "audio_batch.h"
+#include "audio_pipeline.h"
+#include "clock_model.h"
+#include "display_mode_cache.h"
+#include "frame_pacer.h"
+#include "frame_telemetry.h"
+#include "input_parser.h"
+#include "playout_setup.h"
+#include "realtime.h"
+#include "shm_metrics.h"
+#include "signal_generator.h"
+#include "sim_decklink.h"
+#include "video_frame_pool.h"
+
+using namespace std::chrono;
+using std::clog;
+
+
+const int bps = 2;
+const int ch_count = 2;
+const int sample_rate = 48000;
+
+/// The frame grid every worker wakes on. The reference worker moves it onto its card's frame edges once a
+/// second; the others pick it up every frame. With the cards genlocked, one card's edges are every card's.
+struct alignas(64) SharedGrid {
+    std::atomic<int64_t> start_ns{0};
+};
+
+/// One output's counters, written by its worker and read by the reporter.
+struct OutputStats {
+    HdrHistogram wake; // ns past the shared deadline, which is also the phase error against the other outputs
+    std::atomic<long> frames{0};
+    std::atomic<long> late{0}; // woke more than half a frame past the deadline
+    std::atomic<long> display_failures{0};
+    std::atomic<long> repeats{0}; // the previous frame shown again, the pool having no slot for this one
+    std::atomic<long> audio_underflows{0};
+    std::atomic<uint64_t> driver_calls{0};
+    std::atomic<int64_t> cpu_ns{0};
+    std::atomic<int64_t> wall_ns{0};
+    ClockModel clock; // the card's clock against the host, fed once a second
+};
+
+/// Drives one output: wait on the shared grid, show the shared frame for this frame number, write this frame's
+/// audio from its own fork of the shared loop.
+class PlayoutWorker {
+public:
+    PlayoutWorker(int index, IDeckLinkOutput *output, BMDTimeValue timeValue, BMDTimeScale timeScale,
+                  SharedFramePool *frames, AudioPath *audio, const AudioBatching &batching, SharedGrid *grid,
+                  bool reference, int cpu, RealtimeProfile *realtime)
+        : index(index), output(output), cpu(cpu), timeValue(timeValue), timeScale(timeScale), frames(frames),
+          audio(audio), writer(output, audio, batching, sample_rate, timeValue, timeScale), grid(grid),
+          reference(reference), realtime(realtime), pacer(timeValue, timeScale) {}
+
+    ~PlayoutWorker() {
+        stop();
+        delete audio;
+    }
+
+    void start(long frame_total) {
+        running = true;
+        thread = std::thread([this, frame_total] { run(frame_total); });
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    bool finished() const { return !running; }
+
+    int index;
+    IDeckLinkOutput *output;
+    OutputStats stats;
+    int cpu;
+    ShmMetrics *metrics = nullptr; // publish to slot index of this every frame, if set
+
+private:
+    void run(long frame_total) {
+        if (realtime) {
+            RealtimeProfile profile = *realtime;
+            profile.cpu = cpu;
+            profile.apply(clog);
+            RealtimeProfile::prefault_stack();
+        }
+        else {
+            RealtimeProfile::pin(cpu, clog);
+        }
+        const long frames_per_second = (long) ((timeScale + timeValue - 1) / timeValue);
+        const int64_t period_ns = 1000000000ll * timeValue / timeScale;
+        int64_t cpu0 = FramePacer::thread_cpu_ns();
+        int64_t wall0 = FramePacer::now_ns();
+        published[ShmMetrics::time_scale] = timeScale;
+        pacer.start();
+        pacer.follow_grid(grid->start_ns.load(std::memory_order_relaxed));
+        for (long frame = 0; running && (frame_total == 0 || frame < frame_total); ++frame) {
+            if (frame % frames_per_second == 0) {
+                read_clock();
+            }
+            if (!reference) {
+                pacer.follow_grid(grid->start_ns.load(std::memory_order_relaxed));
+            }
+            int64_t error = pacer.wait();
+            stats.wake.record(error);
+            if (error > period_ns / 2) {
+                stats.late.fetch_add(1, std::memory_order_relaxed);
+            }
+            // the frame on air stays held until the next one replaces it, so no other output can draw over it
+            IDeckLinkVideoFrame *next = frames->acquire(frame);
+            if (next) {
+                if (shown) {
+                    frames->release(shown_frame);
+                }
+                shown = next;
+                shown_frame = frame;
+            }
+            else {
+                stats.repeats.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (shown && output->DisplayVideoFrameSync(shown) != S_OK) {
+                stats.display_failures.fetch_add(1, std::memory_order_relaxed);
+            }
+            BatchedAudioWriter::Step step = writer.frame();
+            if (step.measured && step.buffered == 0 && frame > 0) {
+                stats.audio_underflows.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (metrics) {
+                published[ShmMetrics::frames] = frame + 1;
+                published[ShmMetrics::audio_underflows] = stats.audio_underflows.load(std::memory_order_relaxed);
+                published[ShmMetrics::display_failures] = stats.display_failures.load(std::memory_order_relaxed);
+                if (step.measured) {
+                    published[ShmMetrics::audio_buffered] = step.buffered;
+                }
+                published[ShmMetrics::wake_latency_ns] = error;
+                metrics->publish(index, published);
+            }
+            stats.frames.store(frame + 1, std::memory_order_relaxed);
+            stats.driver_calls.store(writer.driver_calls() + clock_calls + frame + 1, std::memory_order_relaxed);
+            stats.cpu_ns.store(FramePacer::thread_cpu_ns() - cpu0, std::memory_order_relaxed);
+            stats.wall_ns.store(FramePacer::now_ns() - wall0, std::memory_order_relaxed);
+        }
+        if (shown) {
+            frames->release(shown_frame);
+        }
+        running = false;
+    }
+
+    /// Once a second: one clock reading for the card's clock model, and on the reference output the grid moved
+    /// onto this card's frame edges.
+    void read_clock() {
+        BMDTimeValue hardware_time = 0, timeInFrame = 0, ticksPerFrame = 0;
+        int64_t before = FramePacer::now_ns();
+        output->GetHardwareReferenceClock(timeScale, &hardware_time, &timeInFrame, &ticksPerFrame);
+        clock_calls++;
+        if (published[ShmMetrics::hardware_time]) {
+            published[ShmMetrics::clock_delta] = hardware_time - published[ShmMetrics::hardware_time];
+        }
+        published[ShmMetrics::hardware_time] = hardware_time;
+        published[ShmMetrics::time_in_frame] = timeInFrame;
+        stats.clock.update((before + FramePacer::now_ns()) / 2, hardware_time, timeScale);
+        if (reference) {
+            pacer.align_to_hardware(timeInFrame, ticksPerFrame);
+            grid->start_ns.store(pacer.grid_ns(), std::memory_order_relaxed);
+        }
+    }
+
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    SharedFramePool *frames;
+    AudioPath *audio;
+    BatchedAudioWriter writer;
+    SharedGrid *grid;
+    bool reference;
+    RealtimeProfile *realtime;
+    FramePacer pacer;
+    IDeckLinkVideoFrame *shown = nullptr; // held from the pool until the next frame replaces it
+    uint64_t shown_frame = 0;
+    uint64_t clock_calls = 0;
+    int64_t published[ShmMetrics::metric_count] = {};
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+/// An output and the display modes it lists.
+struct Output {
+    IDeckLinkOutput *output;
+    std::shared_ptr<DisplayModeCache> modes;
+};
+
+/// @retval n CPUs to pin workers to: -cpus if given, else isolated CPUs if there are enough, else spread over all
+/// but CPU 0, wrapping round when there are more outputs than CPUs
+static std::vector<int> pick_cpus(const InputParser &input, size_t n) {
+    std::vector<int> cpus;
+    if (input.cmdOptionExists("-cpus")) {
+        std::stringstream list(input.getCmdOption("-cpus"));
+        std::string item;
+        while (std::getline(list, item, ',')) {
+            cpus.push_back(atoi(item.c_str()));
+        }
+    }
+    else {
+        cpus = RealtimeProfile::isolated_cpus();
+        if (cpus.size() < n) {
+            cpus.clear();
+            int online = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            for (int c = online > 1 ? 1 : 0; c < online; ++c) {
+                cpus.push_back(c);
+            }
+        }
+    }
+    std::vector<int> picked;
+    for (size_t i = 0; i < n; ++i) {
+        picked.push_back(cpus[i % cpus.size()]);
+    }
+    return picked;
+}
+
+/// Per output and all together, over a run.
+struct RunSummary {
+    size_t outputs = 0;
+    double cpu_percent_per_output = 0.0;
+    double cpu_percent_total = 0.0;
+    int64_t wake_p99_ns = 0; // worst output
+    int64_t wake_max_ns = 0;
+    long late = 0;
+    long underflows = 0;
+};
+
+static RunSummary report(const std::vector<std::unique_ptr<PlayoutWorker>> &workers, double fps_value) {
+    RunSummary sum;
+    sum.outputs = workers.size();
+    char line[256];
+    snprintf(line, sizeof(line), "%-3s %4s %8s %6s %27s %6s %6s %6s %9s %8s %12s", "out", "cpu", "frames", "cpu%",
+             "wake us p50/p99/p99.9/max", "late", "drop", "repeat", "underflow", "calls/s", "card ppm");
+    clog << line << std::endl;
+    for (const auto &w : workers) {
+        const OutputStats &s = w->stats;
+        HdrHistogram::Snapshot wake;
+        s.wake.snapshot(wake);
+        long frames = s.frames.load();
+        double cpu = 100.0 * s.cpu_ns.load() / std::max<int64_t>(s.wall_ns.load(), 1);
+        char wakes[64], ppm[32];
+        snprintf(wakes, sizeof(wakes), "%.1f/%.1f/%.1f/%.1f", wake.value_at(0.5) / 1e3, wake.value_at(0.99) / 1e3,
+                 wake.value_at(0.999) / 1e3, wake.max / 1e3);
+        ClockEstimate e = s.clock.estimate();
+        snprintf(ppm, sizeof(ppm), e.samples > 2 ? "%.2f" : "-", e.rate_ppm);
+        snprintf(line, sizeof(line), "%-3d %4d %8ld %6.2f %27s %6ld %6ld %6ld %9ld %8.1f %12s", w->index, w->cpu,
+                 frames, cpu, wakes, s.late.load(), s.display_failures.load(), s.repeats.load(),
+                 s.audio_underflows.load(),
+                 frames ? s.driver_calls.load() * fps_value / frames : 0.0, ppm);
+        clog << line << std::endl;
+        sum.cpu_percent_total += cpu;
+        sum.wake_p99_ns = std::max(sum.wake_p99_ns, wake.value_at(0.99));
+        sum.wake_max_ns = std::max(sum.wake_max_ns, wake.max);
+        sum.late += s.late.load();
+        sum.underflows += s.audio_underflows.load();
+    }
+    sum.cpu_percent_per_output = sum.cpu_percent_total / std::max<size_t>(sum.outputs, 1);
+    return sum;
+}
+
+/// Enables every output, starts a worker on each and runs them for frame_total frames (0 for ever), reporting
+/// every stats_interval.
+static RunSummary run(const std::vector<Output> &outputs, const std::string &spec, long frame_total,
+                      seconds stats_interval, const InputParser &input) {
+    std::vector<const DisplayModeCache::Mode *> modes;
+    for (const Output &o : outputs) {
+        modes.push_back(enable_video_output(o.output, *o.modes, spec, false));
+        // one frame grid and one set of frames for all of them
+        if (modes.back()->width != modes[0]->width || modes.back()->height != modes[0]->height ||
+            modes.back()->timeValue != modes[0]->timeValue || modes.back()->timeScale != modes[0]->timeScale) {
+            clog << "the outputs have different modes for " << spec << ": " << modes[0]->name << " and "
+                 << modes.back()->name << "; give -mode a resolution" << std::endl;
+            exit(1);
+        }
+        o.output->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
+                                    bmdAudioOutputStreamContinuous);
+    }
+    const BMDTimeValue timeValue = modes[0]->timeValue;
+    const BMDTimeScale timeScale = modes[0]->timeScale;
+
+    // the sources, once for every output: bars drawn once per frame number, and one audio loop that each worker
+    // steps through with a fork of its own
+    SharedFramePool frames(outputs[0].output, modes[0]->width, modes[0]->height,
+                           input.cmdOptionExists("-v210") ? bmdFormat10BitYUV : bmdFormat8BitYUV);
+    // -lag <n>: how far behind the output furthest ahead another may fall and still show every frame
+    const uint32_t lag = input.cmdOptionExists("-lag") ? (uint32_t) std::max(0, atoi(input.getCmdOption("-lag").c_str())) : 2;
+    frames.create(lag);
+    std::vector<char> signal((size_t) sample_rate * ch_count * bps);
+    SignalGenerator generator(sample_rate, ch_count, bps * 8);
+    for (int c = 0; c < ch_count; ++c) {
+        generator.set_sine(c, 1000, -18 + 20 * log10(sqrt(2.0)));
+    }
+    generator.fill(signal.data(), sample_rate);
+    std::unique_ptr<AudioPath> audio(make_audio_path(bmdAudioSampleType16bitInteger, ch_count, timeValue, timeScale,
+                                                     signal.data()));
+
+    // -batch <list>: one AudioBatching per output in order, the last one for the rest
+    std::vector<AudioBatching> batching;
+    for (const std::string &item : split(input.cmdOptionExists("-batch") ? input.getCmdOption("-batch") : "1", ',')) {
+        AudioBatching b;
+        if (!b.parse(item)) {
+            clog << "-batch takes a list of <frames per write>[x<read the level every n frames>][a][+<target sample frames>]" << std::endl;
+            exit(1);
+        }
+        batching.push_back(b);
+    }
+    if (batching.empty()) {
+        batching.push_back(AudioBatching());
+    }
+
+    RealtimeProfile *realtime = nullptr;
+    if (input.cmdOptionExists("-realtime")) {
+        realtime = new RealtimeProfile();
+        if (input.cmdOptionExists("-prio")) {
+            realtime->priority = atoi(input.getCmdOption("-prio").c_str());
+        }
+    }
+    int reference = input.cmdOptionExists("-reference") ? atoi(input.getCmdOption("-reference").c_str()) : 0;
+    reference = std::clamp(reference, 0, (int) outputs.size() - 1);
+    std::vector<int> cpus = pick_cpus(input, outputs.size());
+
+    // everyone starts on the same grid, the first deadline a few frames out so every thread is up by then
+    SharedGrid grid;
+    grid.start_ns = FramePacer::now_ns() + 1000000000ll * timeValue / timeScale * 4;
+    std::vector<std::unique_ptr<PlayoutWorker>> workers;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        workers.emplace_back(new PlayoutWorker((int) i, outputs[i].output, timeValue, timeScale, &frames, audio->fork(),
+                                               batching[std::min(i, batching.size() - 1)], &grid,
+                                               (int) i == reference, cpus[i], realtime));
+    }
+    // -metrics [name]: a slot per output in one shared memory segment, for shm_metrics_reader
+    std::unique_ptr<ShmMetrics> metrics;
+    if (input.cmdOptionExists("-metrics")) {
+        const std::string &name = input.getCmdOption("-metrics");
+        metrics.reset(new ShmMetrics());
+        if (!metrics->create(name.empty() || name[0] == '-' ? "/decklink_playout" : name, (uint32_t) outputs.size())) {
+            clog << metrics->error() << std::endl;
+            exit(1);
+        }
+        for (auto &w : workers) {
+            metrics->set_label(w->index, "output " + std::to_string(w->index) + " cpu " + std::to_string(w->cpu));
+            w->metrics = metrics.get();
+        }
+    }
+    for (auto &w : workers) {
+        w->start(frame_total);
+    }
+
+    double fps_value = (double) timeScale / timeValue;
+    auto next_report = steady_clock::now() + stats_interval;
+    while (true) {
+        std::this_thread::sleep_for(milliseconds(100));
+        bool done = std::all_of(workers.begin(), workers.end(), [](const auto &w) { return w->finished(); });
+        if (done) {
+            break;
+        }
+        if (stats_interval.count() > 0 && steady_clock::now() >= next_report) {
+            next_report += stats_interval;
+            report(workers, fps_value);
+        }
+    }
+    RunSummary summary = report(workers, fps_value);
+    if (frames.missed || frames.blocked) {
+        clog << "frame pool: " << frames.missed << " frames asked for after their slot moved on, " << frames.blocked
+             << " not drawn while an output still held the slot; -lag " << lag << " may be too small" << std::endl;
+    }
+    workers.clear();
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        outputs[i].output->DisableAudioOutput();
+        outputs[i].output->DisableVideoOutput();
+    }
+    return summary;
+}
+
+int main(int argc, char **argv) {
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" Choose -a for 24 fps -b for 25 fps; every output in the host, or -sim <n> simulated ones (-skew <ppm> their clocks)"<<std::endl;
+        std::clog <<" -mode <[[w]x][h]<p|i|psf><rate>> any mode the outputs list, e.g. 1080p23.98, 2160p50; each model's modes are kept in /var/tmp/decklink-modes-<model>.bin"<<std::endl;
+        std::clog <<" -cpus <list> to pin the workers to, in output order (default isolated CPUs, else all but CPU 0); -realtime also SCHED_FIFO at -prio <n> and mlockall"<<std::endl;
+        std::clog <<" -reference <i> output whose card clock the shared frame grid follows (default 0)"<<std::endl;
+        std::clog <<" -batch <list> audio batching per output, as audio_issue -batch, the last for the rest (default 1)"<<std::endl;
+        std::clog <<" -frames <n> stop after n frames (default 0, never), -stats <seconds> per output table this often (default 10)"<<std::endl;
+        std::clog <<" -sweep run 1, 2, 4 ... outputs in turn for -frames each (default 500) and compare per output CPU and jitter"<<std::endl;
+        std::clog <<" -lag <n> frames an output may fall behind the others and still show every frame, sizing the shared pool (default 2), -v210 send 10 bit instead of 8 bit video"<<std::endl;
+        std::clog <<" -metrics [name] publish each output's counters to shared memory segment name (default /decklink_playout) for shm_metrics_reader"<<std::endl;
+        exit(0);
+    }
+    const std::string spec = mode_spec(input);
+
+    // each output's modes from its model's cache file, enumerated (and saved) where there is none yet; outputs
+    // without the mode are left out
+    std::vector<Output> outputs;
+    auto add_output = [&](IDeckLinkOutput *output, const std::string &key) {
+        auto modes = std::make_shared<DisplayModeCache>();
+        if (!modes->open(output, key, DisplayModeCache::default_path(key)) ||
+            !find_display_mode(*modes, output, spec, false)) {
+            return false;
+        }
+        outputs.push_back(Output{output, modes});
+        return true;
+    };
+    if (input.cmdOptionExists("-sim")) {
+        int n = std::max(1, atoi(input.getCmdOption("-sim").c_str()));
+        for (int i = 0; i < n; ++i) {
+            auto *sim = new SimDeckLinkOutput();
+            sim->set_clock_skew(atof(input.getCmdOption("-skew").c_str()));
+            add_output(sim, DisplayModeCache::device_key("Simulated DeckLink"));
+        }
+    }
+    else {
+        IDeckLinkIterator *deckLinkIterator = CreateDeckLinkIteratorInstance();
+        IDeckLink *deckLink = nullptr;
+        while (deckLinkIterator && deckLinkIterator->Next(&deckLink) == S_OK) {
+            IDeckLinkOutput *output = nullptr;
+            if (deckLink->QueryInterface(IID_IDeckLinkOutput, (void **) &output) == S_OK &&
+                !add_output(output, DisplayModeCache::device_key(deckLink))) {
+                output->Release();
+            }
+            deckLink->Release();
+        }
+    }
+    if (outputs.empty()) {
+        clog << "no output that does " << spec << std::endl;
+        exit(1);
+    }
+    clog << outputs.size() << " outputs at " << spec << std::endl;
+
+    long frame_total = input.cmdOptionExists("-frames") ? atol(input.getCmdOption("-frames").c_str()) : 0;
+    if (!input.cmdOptionExists("-sweep")) {
+        run(outputs, spec, frame_total, stats_interval(input), input);
+        return 0;
+    }
+
+    // the same run with more and more outputs: per output CPU and jitter should stay flat as the count doubles
+    std::vector<RunSummary> sweep;
+    for (size_t n = 1;; n = std::min(n * 2, outputs.size())) {
+        clog << "--- " << n << " outputs" << std::endl;
+        std::vector<Output> some(outputs.begin(), outputs.begin() + n);
+        sweep.push_back(run(some, spec, frame_total ? frame_total : 500, seconds(0), input));
+        if (n == outputs.size()) {
+            break;
+        }
+    }
+    char line[256];
+    snprintf(line, sizeof(line), "%-7s %14s %10s %15s %15s %6s %10s", "outputs", "cpu%/output", "cpu% all",
+             "worst p99 us", "worst max us", "late", "underflows");
+    clog << line << std::endl;
+    for (const RunSummary &s : sweep) {
+        snprintf(line, sizeof(line), "%-7zu %14.2f %10.2f %15.1f %15.1f %6ld %10ld", s.outputs,
+                 s.cpu_percent_per_output, s.cpu_percent_total, s.wake_p99_ns / 1e3, s.wake_max_ns / 1e3, s.late,
+                 s.underflows);
+        clog << line << std::endl;
+    }
+}
@@ -0,0 +1,179 @@
+// Runs the same frame loop under each PacingStrategy against a fresh simulated output and compares them: wake
+// error and frame interval jitter percentiles, CPU time, driver calls per frame, and when the card's audio buffer
+// first ran dry or overflowed. No card needed.
+//   g++ -std=c++17 -O2 -pthread -I<sdk>/include pacing_bench.cpp sim_decklink.cpp sim_decklink_dispatch.cpp -ldl -o pacing_bench
+//   ./pacing_bench -b -frames 1500                              # one real minute of 25p per strategy
+//   SIM_DECKLINK_SPEED=20 ./pacing_bench -b -frames 90000 -skew 50  # an hour of virtual time per strategy
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "audio_cadence.h"
+#include "display_mode_cache.h"
+#include "frame_telemetry.h"
+#include "input_parser.h"
+#include "pacing_strategy.h"
+#include "sim_decklink.h"
+#include "video_frame_pool.h"
+
+using std::clog;
+
+
+const int bps = 2;
+const int ch_count = 2;
+const int sample_rate = 48000;
+
+/// What one strategy did over the run.
+struct BenchResult {
+    std::string name;
+    HdrHistogram::Snapshot wake;     // ns past due, as wait() reports it
+    HdrHistogram::Snapshot interval; // |wake to wake - one frame period|, ns
+    double cpu_percent = 0.0;        // loop thread, wait() and the loop's own calls
+    double calls_per_frame = 0.0;    // pacing calls plus the loop's show, buffer level and write
+    double first_underflow_s = -1.0; // host seconds from start, -1 if none
+    double first_overflow_s = -1.0;
+    long underflows = 0;
+    long overflows = 0;
+    SimOutputStats card;
+};
+
+static BenchResult run_strategy(const std::string &name, long frame_total, int fps, const InputParser &input) {
+    BenchResult r;
+    r.name = name;
+    auto *sim = new SimDeckLinkOutput(input.cmdOptionExists("-capacity") ? atoi(input.getCmdOption("-capacity").c_str()) : 48000);
+    sim->set_clock_skew(atof(input.getCmdOption("-skew").c_str()));
+    sim->set_clock_jitter(atoll(input.getCmdOption("-jitter").c_str()));
+
+    // a fresh simulated card each run, so its modes are enumerated into memory rather than cached in a file
+    DisplayModeCache modes;
+    modes.rebuild(sim);
+    const DisplayModeCache::Mode *displayMode = modes.find("p" + std::to_string(fps / 1000));
+    if (!displayMode || sim->EnableVideoOutput(displayMode->mode, bmdVideoOutputFlagDefault) != S_OK) {
+        std::clog << "the simulated output has no " << fps / 1000 << "p mode" << std::endl;
+        exit(1);
+    }
+    const BMDTimeValue timeValue = displayMode->timeValue;
+    const BMDTimeScale timeScale = displayMode->timeScale;
+    sim->EnableAudioOutput(bmdAudioSampleRate48kHz, bmdAudioSampleType16bitInteger, ch_count,
+                           bmdAudioOutputStreamContinuous);
+    VideoFramePool frames(sim, displayMode->width, displayMode->height, bmdFormat8BitYUV);
+    frames.create(3);
+
+    AudioCadence cadence(sample_rate, timeValue, timeScale);
+    std::vector<char> silence((size_t) cadence.max_count() * bps * ch_count);
+    PacingStrategy *pacing = make_pacing_strategy(name, sim, timeValue, timeScale);
+    const int64_t period_ns = 1000000000ll * timeValue / timeScale;
+
+    HdrHistogram wake, interval;
+    uint64_t loop_calls = 0;
+    int64_t cpu0 = FramePacer::thread_cpu_ns();
+    int64_t t0 = FramePacer::now_ns();
+    int64_t last = t0;
+    pacing->start();
+    for (long frame = 0; frame < frame_total; ++frame) {
+        wake.record(pacing->wait());
+        int64_t now = FramePacer::now_ns();
+        if (frame > 0) {
+            interval.record(std::abs(now - last - period_ns));
+        }
+        last = now;
+
+        pacing->show(frames.next(frame));
+        uint32_t buffered = 0, count = cadence.next(), written = 0;
+        sim->GetBufferedAudioSampleFrameCount(&buffered);
+        sim->WriteAudioSamplesSync(silence.data(), count, &written);
+        loop_calls += 3;
+        if (frame > 0 && buffered == 0) {
+            r.underflows++;
+            if (r.first_underflow_s < 0) {
+                r.first_underflow_s = (now - t0) * 1e-9;
+            }
+        }
+        if (written < count) {
+            r.overflows++;
+            if (r.first_overflow_s < 0) {
+                r.first_overflow_s = (now - t0) * 1e-9;
+            }
+        }
+    }
+    pacing->stop();
+    int64_t wall = FramePacer::now_ns() - t0;
+    r.cpu_percent = 100.0 * (FramePacer::thread_cpu_ns() - cpu0) / std::max<int64_t>(wall, 1);
+    r.calls_per_frame = (double) (pacing->driver_calls() + loop_calls) / frame_total;
+    wake.snapshot(r.wake);
+    interval.snapshot(r.interval);
+    r.card = sim->stats();
+    delete pacing;
+    // stops the card's thread, so it does not run on through the next strategy
+    sim->DisableAudioOutput();
+    sim->DisableVideoOutput();
+    sim->Release();
+    return r;
+}
+
+
+int main(int argc, char **argv) {
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" Choose -a for 24 fps -b for 25 fps"<<std::endl;
+        std::clog <<" -frames <n> per strategy (default 1500), -pacing <list> of host_spin,sleep,pacer,hw_pacer,hw_poll,callback (default all)"<<std::endl;
+        std::clog <<" -skew <ppm> card clock fast or slow, -jitter <ns> noise on each clock reading, -capacity <n> card audio buffer (default 48000)"<<std::endl;
+        std::clog <<" -csv <file> one row per strategy; set SIM_DECKLINK_SPEED to run in accelerated virtual time"<<std::endl;
+        exit(0);
+    }
+    int fps = input.cmdOptionExists("-b") ? 25000 : 24000;
+    long frame_total = input.cmdOptionExists("-frames") ? atol(input.getCmdOption("-frames").c_str()) : 1500;
+    std::vector<std::string> names = input.cmdOptionExists("-pacing") ? split(input.getCmdOption("-pacing"), ',')
+                                                                      : pacing_strategy_names();
+
+    std::vector<BenchResult> results;
+    for (const std::string &name : names) {
+        PacingStrategy *probe = make_pacing_strategy(name, nullptr, 1000, fps);
+        if (!probe) {
+            clog << "no pacing strategy " << name << std::endl;
+            exit(1);
+        }
+        delete probe;
+        clog << "running " << name << " for " << frame_total << " frames" << std::endl;
+        results.push_back(run_strategy(name, frame_total, fps, input));
+    }
+
+    // strategies run one after another, never side by side, so none steals CPU from another
+    char line[512];
+    snprintf(line, sizeof(line), "%-10s %27s %20s %6s %8s %11s %11s %15s", "strategy", "wake us p50/p99/p99.9/max",
+             "interval us p99/max", "cpu%", "calls/f", "underflow s", "overflow s", "dropped/late");
+    clog << line << std::endl;
+    for (const BenchResult &r : results) {
+        char wake[64], interval[64], under[32], over[32], card[32];
+        snprintf(wake, sizeof(wake), "%.1f/%.1f/%.1f/%.1f", r.wake.value_at(0.5) / 1e3, r.wake.value_at(0.99) / 1e3,
+                 r.wake.value_at(0.999) / 1e3, r.wake.max / 1e3);
+        snprintf(interval, sizeof(interval), "%.1f/%.1f", r.interval.value_at(0.99) / 1e3, r.interval.max / 1e3);
+        snprintf(under, sizeof(under), r.first_underflow_s < 0 ? "never" : "%.2f", r.first_underflow_s);
+        snprintf(over, sizeof(over), r.first_overflow_s < 0 ? "never" : "%.2f", r.first_overflow_s);
+        snprintf(card, sizeof(card), "%ld/%ld", r.card.frames_dropped, r.card.frames_late);
+        snprintf(line, sizeof(line), "%-10s %27s %20s %6.1f %8.1f %11s %11s %15s", r.name.c_str(), wake, interval,
+                 r.cpu_percent, r.calls_per_frame, under, over, card);
+        clog << line << std::endl;
+    }
+
+    if (input.cmdOptionExists("-csv")) {
+        std::ofstream csv(input.getCmdOption("-csv"));
+        csv << "strategy,frames,wake_p50_ns,wake_p99_ns,wake_p999_ns,wake_max_ns,interval_p99_ns,interval_max_ns,"
+               "cpu_percent,calls_per_frame,first_underflow_s,first_overflow_s,underflows,overflows,card_dropped,"
+               "card_late,card_audio_underflows\n";
+        for (const BenchResult &r : results) {
+            csv << r.name << "," << frame_total << "," << r.wake.value_at(0.5) << "," << r.wake.value_at(0.99) << ","
+                << r.wake.value_at(0.999) << "," << r.wake.max << "," << r.interval.value_at(0.99) << ","
+                << r.interval.max << "," << r.cpu_percent << "," << r.calls_per_frame << "," << r.first_underflow_s
+                << "," << r.first_overflow_s << "," << r.underflows << "," << r.overflows << ","
+                << r.card.frames_dropped << "," << r.card.frames_late << "," << r.card.audio_underflows << "\n";
+        }
+    }
+}
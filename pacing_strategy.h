@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "frame_pacer.h"
+
+/// One GetHardwareReferenceClock reading and when the host took it.
+struct ClockReading {
+    int64_t host_ns = 0; // CLOCK_MONOTONIC halfway through the call
+    BMDTimeValue hardware_time = 0;
+    BMDTimeValue timeInFrame = 0;
+    BMDTimeValue ticksPerFrame = 0;
+};
+
+inline ClockReading read_hardware_clock(IDeckLinkOutput *output, BMDTimeScale timeScale) {
+    ClockReading r;
+    int64_t before = FramePacer::now_ns();
+    output->GetHardwareReferenceClock(timeScale, &r.hardware_time, &r.timeInFrame, &r.ticksPerFrame);
+    r.host_ns = (before + FramePacer::now_ns()) / 2;
+    return r;
+}
+
+/// How the frame loop decides when to send the next frame, and how it hands that frame to the card.
+///
+/// The loop is the same for every strategy: wait(), show() the next video frame, write that frame's audio with
+/// WriteAudioSamplesSync. Strategies differ in what they block on and whose clock they follow. wait() keeps
+/// PacerStats for all of them alike, and driver_calls() counts the calls a strategy makes to pace itself, on top of
+/// the loop's own show, buffer level and audio write. Strategies that read the card's clock hand their last reading
+/// on through reading(), so the loop need not read it again.
+class PacingStrategy {
+public:
+    PacingStrategy(IDeckLinkOutput *output, BMDTimeValue timeValue, BMDTimeScale timeScale)
+        : output(output), timeValue(timeValue), timeScale(timeScale),
+          period_ns(1000000000ll * timeValue / timeScale) {}
+
+    virtual ~PacingStrategy() = default;
+
+    virtual const char *name() const = 0;
+
+    /// Call with video and audio output enabled, just before the first wait(). The first frame is due one frame
+    /// period later.
+    void start() {
+        stats = PacerStats();
+        last_wake_ns = FramePacer::now_ns();
+        begin();
+    }
+
+    /// Blocks until the next frame is due.
+    /// @retval ns between when the strategy meant to return and when it did
+    int64_t wait() {
+        int64_t cpu_before = FramePacer::thread_cpu_ns();
+        fresh = false;
+        int64_t error = wait_frame();
+        int64_t now = FramePacer::now_ns();
+        stats.frames++;
+        if (error > period_ns / 2) {
+            stats.late++;
+        }
+        stats.wake_error_ns = error;
+        stats.max_wake_error_ns = std::max(stats.max_wake_error_ns, error);
+        stats.sum_wake_error_ns += error;
+        stats.cpu_ns += FramePacer::thread_cpu_ns() - cpu_before;
+        stats.wall_ns += now - last_wake_ns;
+        last_wake_ns = now;
+        return error;
+    }
+
+    /// Sends a frame to the card, DisplayVideoFrameSync unless the strategy schedules frames instead.
+    virtual HRESULT show(IDeckLinkVideoFrame *frame) { return output->DisplayVideoFrameSync(frame); }
+
+    /// Undoes whatever start() set going on the card.
+    virtual void stop() {}
+
+    void reset_stats() { stats = PacerStats(); }
+
+    /// @retval driver calls made to pace frames since start()
+    uint64_t driver_calls() const { return calls; }
+
+    /// @retval the clock reading the last wait() ended on, or nullptr if it did not read the clock
+    const ClockReading *reading() const { return fresh ? &last_reading : nullptr; }
+
+    PacerStats stats;
+
+protected:
+    virtual void begin() {}
+    /// @retval as wait()
+    virtual int64_t wait_frame() = 0;
+
+    static int64_t ticks_to_ns(int64_t ticks, int64_t scale) {
+        return ticks / scale * 1000000000 + ticks % scale * 1000000000 / scale;
+    }
+
+    const ClockReading &read_clock() {
+        calls++;
+        last_reading = read_hardware_clock(output, timeScale);
+        fresh = true;
+        return last_reading;
+    }
+
+    IDeckLinkOutput *output;
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    int64_t period_ns;
+    uint64_t calls = 0;
+    int64_t last_wake_ns = 0;
+    ClockReading last_reading;
+    bool fresh = false;
+};
+
+/// audio_issue.cpp's original loop: busy wait on the host clock until one frame period after the last wake. Each
+/// wake's lateness is added to the next period, so the frame rate runs slow by the average overshoot.
+class HostSpinPacing : public PacingStrategy {
+public:
+    using PacingStrategy::PacingStrategy;
+    const char *name() const override { return "host_spin"; }
+
+protected:
+    void begin() override { last = FramePacer::now_ns(); }
+
+    int64_t wait_frame() override {
+        int64_t due = last + period_ns;
+        int64_t now;
+        do {
+            now = FramePacer::now_ns();
+        } while (now < due);
+        last = now;
+        return now - due;
+    }
+
+    int64_t last = 0;
+};
+
+/// audio_issue_blk_clock.cpp's and blk_clock_test.cpp's loop: poll GetHardwareReferenceClock until the card's
+/// clock has moved a frame on from the last wake. Follows the card's rate, at one driver call per poll.
+class HardwareClockPollPacing : public PacingStrategy {
+public:
+    using PacingStrategy::PacingStrategy;
+    const char *name() const override { return "hw_poll"; }
+
+protected:
+    void begin() override { t0 = read_clock().hardware_time; }
+
+    int64_t wait_frame() override {
+        const ClockReading *r;
+        do {
+            r = &read_clock();
+        } while (r->hardware_time - t0 < r->ticksPerFrame);
+        int64_t error = ticks_to_ns(r->hardware_time - t0 - r->ticksPerFrame, timeScale);
+        t0 = r->hardware_time;
+        return error;
+    }
+
+    BMDTimeValue t0 = 0;
+};
+
+/// clock_nanosleep to absolute host deadlines and nothing else: the least CPU of any strategy, at the cost of the
+/// scheduler's wake latency on every frame.
+class SleepPacing : public PacingStrategy {
+public:
+    using PacingStrategy::PacingStrategy;
+    const char *name() const override { return "sleep"; }
+
+protected:
+    void begin() override {
+        start_ns = FramePacer::now_ns();
+        frame = 0;
+    }
+
+    int64_t wait_frame() override {
+        int64_t deadline = start_ns + ticks_to_ns(++frame * timeValue, timeScale);
+        timespec ts{(time_t) (deadline / 1000000000), (long) (deadline % 1000000000)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+        }
+        return FramePacer::now_ns() - deadline;
+    }
+
+    int64_t start_ns = 0;
+    int64_t frame = 0;
+};
+
+/// FramePacer: sleep to a calibrated margin before each host deadline, then spin. With follow_card, the deadlines
+/// are moved onto the card's frame edges from one GetHardwareReferenceClock reading at start and once a second,
+/// as audio_issue_blk_clock.cpp -pacer does.
+class FramePacerPacing : public PacingStrategy {
+public:
+    FramePacerPacing(IDeckLinkOutput *output, BMDTimeValue timeValue, BMDTimeScale timeScale, bool follow_card)
+        : PacingStrategy(output, timeValue, timeScale), pacer(timeValue, timeScale), follow_card(follow_card) {}
+
+    const char *name() const override { return follow_card ? "hw_pacer" : "pacer"; }
+
+protected:
+    void begin() override {
+        pacer.start();
+        frame = 0;
+        align();
+    }
+
+    int64_t wait_frame() override {
+        int64_t error = pacer.wait();
+        if (++frame % ((timeScale + timeValue - 1) / timeValue) == 0) {
+            align();
+        }
+        return error;
+    }
+
+    void align() {
+        if (!follow_card) {
+            return;
+        }
+        const ClockReading &r = read_clock();
+        pacer.align_to_hardware(r.timeInFrame, r.ticksPerFrame);
+    }
+
+    FramePacer pacer;
+    bool follow_card;
+    int64_t frame = 0;
+};
+
+/// Scheduled playback driven from the card's frame completion callbacks. show() schedules each frame lead frames
+/// ahead instead of displaying it; after the first lead frames, wait() sleeps until the card reports another frame
+/// completed. There is no clock to read and nothing to spin on, but the card only starts once lead frames are
+/// queued, so video runs that many frames behind the loop. Audio still goes out through WriteAudioSamplesSync as a
+/// continuous stream.
+class CallbackPacing : public PacingStrategy, public IDeckLinkVideoOutputCallback {
+public:
+    CallbackPacing(IDeckLinkOutput *output, BMDTimeValue timeValue, BMDTimeScale timeScale, uint32_t lead = 2)
+        : PacingStrategy(output, timeValue, timeScale), lead(std::max(lead, 1u)) {}
+
+    const char *name() const override { return "callback"; }
+
+    HRESULT show(IDeckLinkVideoFrame *frame) override {
+        HRESULT result = output->ScheduleVideoFrame(frame, scheduled * timeValue, timeValue, timeScale);
+        if (++scheduled == lead) {
+            calls++;
+            output->StartScheduledPlayback(0, timeScale, 1.0);
+        }
+        return result;
+    }
+
+    void stop() override {
+        BMDTimeValue actual = 0;
+        calls++;
+        output->StopScheduledPlayback(0, &actual, timeScale);
+        output->SetScheduledFrameCompletionCallback(nullptr);
+    }
+
+    HRESULT ScheduledFrameCompleted(IDeckLinkVideoFrame *, BMDOutputFrameCompletionResult result) override {
+        if (result == bmdOutputFrameFlushed) {
+            return S_OK;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            completed++;
+            completed_ns = FramePacer::now_ns();
+        }
+        wake.notify_one();
+        return S_OK;
+    }
+
+    HRESULT ScheduledPlaybackHasStopped() override { return S_OK; }
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override {
+        if (memcmp(&iid, &IID_IDeckLinkVideoOutputCallback, sizeof(REFIID)) == 0) {
+            *ppv = static_cast<IDeckLinkVideoOutputCallback *>(this);
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    // lifetime is owned by the caller
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+protected:
+    void begin() override {
+        scheduled = 0;
+        waited = 0;
+        calls++;
+        output->SetScheduledFrameCompletionCallback(this);
+    }
+
+    int64_t wait_frame() override {
+        // the first lead frames fill the queue the card starts from
+        if (++waited <= (int64_t) lead) {
+            return 0;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return completed >= waited - (int64_t) lead; });
+        return FramePacer::now_ns() - completed_ns;
+    }
+
+    uint32_t lead;
+    int64_t scheduled = 0; // frames handed to ScheduleVideoFrame
+    int64_t waited = 0;    // wait() calls
+    std::mutex lock;
+    std::condition_variable wake;
+    int64_t completed = 0;
+    int64_t completed_ns = 0;
+};
+
+/// @retval the names make_pacing_strategy() knows, in order of how much they trust the card's clock
+inline const std::vector<std::string> &pacing_strategy_names() {
+    static const std::vector<std::string> names = {"host_spin", "sleep", "pacer", "hw_pacer", "hw_poll", "callback"};
+    return names;
+}
+
+/// @retval a new strategy by name, or nullptr if there is none by that name
+inline PacingStrategy *make_pacing_strategy(const std::string &name, IDeckLinkOutput *output, BMDTimeValue timeValue,
+                                            BMDTimeScale timeScale) {
+    if (name == "host_spin") {
+        return new HostSpinPacing(output, timeValue, timeScale);
+    }
+    if (name == "sleep") {
+        return new SleepPacing(output, timeValue, timeScale);
+    }
+    if (name == "pacer" || name == "hw_pacer") {
+        return new FramePacerPacing(output, timeValue, timeScale, name == "hw_pacer");
+    }
+    if (name == "hw_poll") {
+        return new HardwareClockPollPacing(output, timeValue, timeScale);
+    }
+    if (name == "callback") {
+        return new CallbackPacing(output, timeValue, timeScale);
+    }
+    return nullptr;
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+#include "DeckLinkAPI.h"
+#include "async_log.h"
+#include "clock_model.h"
+#include "display_mode_cache.h"
+#include "frame_telemetry.h"
+#include "input_parser.h"
+#include "pacing_strategy.h"
+#include "realtime.h"
+#include "signal_generator.h"
+#include "wav_source.h"
+
+// The setup every playout program shares, from the command line: the display mode, the audio source, telemetry,
+// the -realtime switch and what the loop does with the card's clock readings.
+
+/// @retval the display mode asked for, as DisplayModeCache::find() takes it: -mode <spec>, else p25 for -b, else
+/// p24 (-a), each at whatever resolution the device lists first
+inline std::string mode_spec(const InputParser &input) {
+    if (input.cmdOptionExists("-mode")) {
+        return input.getCmdOption("-mode");
+    }
+    return input.cmdOptionExists("-b") ? "p25" : "p24";
+}
+
+/// @retval spec among modes, after re-enumerating output once if a cache from file lacks it, or nullptr
+inline const DisplayModeCache::Mode *find_display_mode(DisplayModeCache &modes, IDeckLinkOutput *output,
+                                                       const std::string &spec, bool verbose) {
+    const DisplayModeCache::Mode *mode = modes.find(spec);
+    if (!mode && modes.from_file()) {
+        // a cache from before the card's modes changed; ask the card
+        modes.rebuild(output, verbose);
+        mode = modes.find(spec);
+    }
+    return mode;
+}
+
+/// Opens the device's mode cache (-modecache <file>, default one per model under /var/tmp) and looks up
+/// mode_spec(input) in it. Exits if the output has no such mode.
+inline const DisplayModeCache::Mode *select_display_mode(const InputParser &input, IDeckLinkOutput *output,
+                                                         const std::string &key, DisplayModeCache &modes, bool verbose) {
+    if (!modes.open(output, key,
+                    input.cmdOptionExists("-modecache") ? input.getCmdOption("-modecache") : DisplayModeCache::default_path(key),
+                    verbose)) {
+        std::clog << "the output lists no display modes" << std::endl;
+        exit(1);
+    }
+    const std::string spec = mode_spec(input);
+    const DisplayModeCache::Mode *mode = find_display_mode(modes, output, spec, verbose);
+    if (!mode) {
+        std::clog << "no display mode " << spec << " on " << key << std::endl;
+        exit(1);
+    }
+    std::clog << "Selected " << mode->name << " " << mode->timeValue << "/" << mode->timeScale << " from "
+              << (modes.from_file() ? "" : "a fresh ") << "mode cache " << modes.file() << std::endl;
+    return mode;
+}
+
+/// EnableVideoOutput in spec, re-enumerating once if the card refuses a mode the cache had from file. Exits if the
+/// card still refuses it.
+/// @retval the mode enabled; earlier Mode pointers into modes are stale if it re-enumerated
+inline const DisplayModeCache::Mode *enable_video_output(IDeckLinkOutput *output, DisplayModeCache &modes,
+                                                         const std::string &spec, bool verbose) {
+    const DisplayModeCache::Mode *mode = modes.find(spec);
+    if (mode && output->EnableVideoOutput(mode->mode, bmdVideoOutputFlagDefault) == S_OK) {
+        return mode;
+    }
+    if (modes.from_file()) {
+        // the cached mode is stale; enumerate once and try what the card lists now
+        modes.rebuild(output, verbose);
+        mode = modes.find(spec);
+        if (mode && output->EnableVideoOutput(mode->mode, bmdVideoOutputFlagDefault) == S_OK) {
+            return mode;
+        }
+    }
+    std::clog << "could not enable video output in " << spec << std::endl;
+    exit(1);
+}
+
+/// @retval 1 sec of sine wave, volume is the rms level in dBFS; free with delete[]
+inline char *sine_signal(int sample_rate, int bps, int channels, double frequency, double volume) {
+    auto *data = new char[(size_t) sample_rate * channels * bps];
+    SignalGenerator generator(sample_rate, channels, bps * 8);
+    for (int channel = 0; channel < channels; ++channel) {
+        generator.set_sine(channel, frequency, volume + 20 * log10(sqrt(2.0)));
+    }
+    generator.fill(data, sample_rate);
+    return data;
+}
+
+/// -wav <file> or -raw <file>: programme audio looped straight out of a mapping of the file instead of the sine.
+/// Exits if the file can not be opened or the card can not play it.
+/// @retval the opened file, or nullptr without either option
+inline MappedAudioSource *open_audio_file(const InputParser &input, int sample_rate, int channels, int bits) {
+    if (!input.cmdOptionExists("-wav") && !input.cmdOptionExists("-raw")) {
+        return nullptr;
+    }
+    auto *file = new MappedAudioSource();
+    bool opened = input.cmdOptionExists("-wav") ? file->open_wav(input.getCmdOption("-wav").c_str())
+                                                : file->open_raw(input.getCmdOption("-raw").c_str(), sample_rate, channels, bits);
+    if (!opened) {
+        std::clog << file->error() << std::endl;
+        exit(1);
+    }
+    if ((int) file->sample_rate() != sample_rate || (file->channels() != 2 && file->channels() != 8 && file->channels() != 16)) {
+        std::clog << "the card needs 48 kHz audio in 2, 8 or 16 channels, the file has " << file->sample_rate()
+                  << " Hz and " << file->channels() << std::endl;
+        exit(1);
+    }
+    std::clog << "playing " << file->frames() / sample_rate << " s of " << file->channels() << " channel "
+              << file->bits() << " bit audio" << std::endl;
+    return file;
+}
+
+/// @retval -stats <seconds>, how often the telemetry reporter prints (default 10, 0 for never)
+inline std::chrono::seconds stats_interval(const InputParser &input) {
+    return std::chrono::seconds(input.cmdOptionExists("-stats") ? atoi(input.getCmdOption("-stats").c_str()) : 10);
+}
+
+/// Per frame timings go to lock free histograms; a reporter thread prints them every -stats seconds, so the loop
+/// never touches stderr, and dumps the trace to -trace <file> on SIGUSR1.
+inline void start_telemetry(FrameTelemetry &telemetry, const InputParser &input) {
+    telemetry.start_reporter(stats_interval(input),
+                             input.cmdOptionExists("-trace") ? input.getCmdOption("-trace").c_str() : nullptr);
+}
+
+/// -realtime [-cpu <n>] [-prio <n>] [-baseline <seconds>]: runs the first -baseline seconds (default 10) in the
+/// default profile, then switches the loop's thread over and, as many frames later again, logs the wake latency of
+/// both so the difference is measured rather than assumed.
+class RealtimeSwitch {
+public:
+    /// fps in millihertz; prefault makes the buffers the loop touches resident once memory is locked
+    RealtimeSwitch(const InputParser &input, int fps, std::function<void()> prefault) : prefault(std::move(prefault)) {
+        if (!input.cmdOptionExists("-realtime")) {
+            return;
+        }
+        realtime = new RealtimeProfile();
+        if (input.cmdOptionExists("-cpu")) {
+            realtime->cpu = atoi(input.getCmdOption("-cpu").c_str());
+        }
+        if (input.cmdOptionExists("-prio")) {
+            realtime->priority = atoi(input.getCmdOption("-prio").c_str());
+        }
+        wake.reset(new HdrHistogram::Snapshot[3]);
+        switch_frame = (long) (input.cmdOptionExists("-baseline") ? atoi(input.getCmdOption("-baseline").c_str()) : 10) *
+                       fps / 1000;
+        if (switch_frame == 0) {
+            apply();
+        }
+    }
+
+    ~RealtimeSwitch() { delete realtime; }
+
+    RealtimeSwitch(const RealtimeSwitch &) = delete;
+    RealtimeSwitch &operator=(const RealtimeSwitch &) = delete;
+
+    /// From the loop after each frame, with the number of frames done so far.
+    void frame(long frame_count, FrameTelemetry &telemetry, AsyncLog &events) {
+        if (switch_frame <= 0) {
+            return;
+        }
+        if (frame_count == switch_frame) {
+            telemetry.snapshot(FrameTelemetry::wake_latency_ns, wake[0]);
+            apply();
+        }
+        else if (frame_count == switch_frame + 1) {
+            telemetry.snapshot(FrameTelemetry::wake_latency_ns, wake[1]);
+        }
+        else if (frame_count == 2 * switch_frame + 1) {
+            static const LogEvent realtime_wake{"wake latency ns before and after -realtime",
+                                                {"p99 default", "p99 realtime", "max default", "max realtime"}};
+            telemetry.snapshot(FrameTelemetry::wake_latency_ns, wake[2]);
+            wake[2].subtract(wake[1]);
+            events.log(realtime_wake, frame_count, wake[0].value_at(0.99), wake[2].value_at(0.99),
+                       wake[0].value_at(1.0), wake[2].value_at(1.0));
+        }
+    }
+
+private:
+    void apply() {
+        realtime->apply(std::clog);
+        RealtimeProfile::prefault_stack();
+        if (prefault) {
+            prefault();
+        }
+        realtime->verify(std::clog);
+    }
+
+    std::function<void()> prefault;
+    RealtimeProfile *realtime = nullptr;
+    long switch_frame = 0;
+    std::unique_ptr<HdrHistogram::Snapshot[]> wake; // before the switch, just after it, and at the end of the comparison
+};
+
+/// Every reading of the card's clock the loop makes, its own or its pacing strategy's, goes through one of these:
+/// each feeds the ClockModel, and readings a frame apart also give the clock_delta and time_in_frame telemetry. A
+/// strategy that reads the clock only once a second (hw_pacer) feeds the model without skewing clock_delta.
+class FrameClock {
+public:
+    FrameClock(IDeckLinkOutput *output, BMDTimeValue timeValue, BMDTimeScale timeScale, FrameTelemetry &telemetry)
+        : output(output), timeValue(timeValue), timeScale(timeScale), telemetry(telemetry) {}
+
+    FrameClock(const FrameClock &) = delete;
+    FrameClock &operator=(const FrameClock &) = delete;
+
+    /// Reads the clock for frame now.
+    const ClockReading &read(long frame) {
+        observe(read_hardware_clock(output, timeScale), frame);
+        return last;
+    }
+
+    /// Takes a reading made for frame elsewhere, e.g. PacingStrategy::reading().
+    void observe(const ClockReading &r, long frame) {
+        model.update(r.host_ns, r.hardware_time, timeScale);
+        if (readings && frame == read_frame + 1) {
+            delta = r.hardware_time - last.hardware_time;
+            telemetry.record(FrameTelemetry::clock_delta, delta);
+            telemetry.record(FrameTelemetry::time_in_frame, r.timeInFrame);
+            if (delta != timeValue) {
+                telemetry.count(FrameTelemetry::off_nominal_frames);
+                off_nominal++;
+            }
+        }
+        if (readings && r.ticksPerFrame != last.ticksPerFrame) {
+            telemetry.count(FrameTelemetry::ticks_changed);
+        }
+        last = r;
+        read_frame = frame;
+        readings++;
+    }
+
+    /// @retval the frame the last reading was for
+    long last_frame() const { return read_frame; }
+
+    /// fed from every reading; estimate() can be read from any thread
+    ClockModel model;
+    ClockReading last;
+    int64_t delta = 0;        // hardware clock advance between the last two readings a frame apart
+    uint64_t off_nominal = 0; // such advances that were not one frame
+    uint64_t readings = 0;
+
+private:
+    IDeckLinkOutput *output;
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    FrameTelemetry &telemetry;
+    long read_frame = -2; // none yet
+};
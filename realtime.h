@@ -0,0 +1,169 @@
+#pragma once
+
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Real time execution profile for the playout thread: memory locked with mlockall, the thread pinned to one CPU
+/// and scheduled SCHED_FIFO, so page faults, migrations and ordinary tasks cannot land between a wake and the
+/// write that follows it. Needs CAP_SYS_NICE and CAP_IPC_LOCK, or matching RLIMIT_RTPRIO and RLIMIT_MEMLOCK.
+/// Pick a CPU kept free with isolcpus= or a cpuset; a SCHED_FIFO thread that spins shares its CPU with nothing
+/// else, and with kernel.sched_rt_runtime_us left at its default it is throttled for 50 ms every second.
+class RealtimeProfile {
+public:
+    int cpu = -1;      // -1 for the last isolated CPU, or the last CPU if none are isolated
+    int priority = 80; // SCHED_FIFO, 1..99
+
+    /// Locks all current and future memory as it is touched, then pins the calling thread and makes it SCHED_FIFO. Each step is
+    /// reported to out.
+    /// @retval false if any step failed; the others stay applied
+    bool apply(std::ostream &out) {
+        bool ok = true;
+        // on fault, so a large file mapping is not read in whole; what the loop uses is prefaulted explicitly
+        int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+        flags |= MCL_ONFAULT;
+#endif
+        if (mlockall(flags) != 0) {
+            out << "realtime: mlockall failed: " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        if (cpu < 0) {
+            std::vector<int> isolated = isolated_cpus();
+            cpu = isolated.empty() ? (int) sysconf(_SC_NPROCESSORS_ONLN) - 1 : isolated.back();
+        }
+        ok = pin(cpu, out) && ok;
+        sched_param param{};
+        param.sched_priority = std::clamp(priority, sched_get_priority_min(SCHED_FIFO),
+                                          sched_get_priority_max(SCHED_FIFO));
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error) {
+            out << "realtime: SCHED_FIFO " << param.sched_priority << " failed: " << strerror(error) << std::endl;
+            ok = false;
+        }
+        return ok;
+    }
+
+    /// Reads the settings back from the kernel and reports them, with warnings for a CPU that is not isolated and
+    /// real time throttling still on.
+    /// @retval false if the calling thread is not running as apply() asked
+    bool verify(std::ostream &out) const {
+        bool ok = true;
+        int policy = 0;
+        sched_param param{};
+        pthread_getschedparam(pthread_self(), &policy, &param);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        bool pinned = CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set);
+        ok = ok && policy == SCHED_FIFO && param.sched_priority == std::clamp(priority, 1, 99) && pinned;
+
+        std::string locked = proc_status("VmLck:");
+        ok = ok && atol(locked.c_str()) > 0;
+        out << "realtime: policy " << (policy == SCHED_FIFO ? "SCHED_FIFO" : "not SCHED_FIFO") << " priority "
+            << param.sched_priority << ", " << (pinned ? "pinned to" : "NOT pinned to") << " cpu " << cpu
+            << " (running on " << sched_getcpu() << "), locked " << locked << std::endl;
+
+        std::vector<int> isolated = isolated_cpus();
+        if (std::find(isolated.begin(), isolated.end(), cpu) == isolated.end()) {
+            out << "realtime: warning: cpu " << cpu << " is not in isolcpus, other tasks may still run there" << std::endl;
+        }
+        std::ifstream runtime("/proc/sys/kernel/sched_rt_runtime_us");
+        long runtime_us = -1;
+        if (runtime >> runtime_us && runtime_us >= 0) {
+            out << "realtime: warning: sched_rt_runtime_us is " << runtime_us
+                << ", a thread that never sleeps will be throttled" << std::endl;
+        }
+        return ok;
+    }
+
+    /// Pins the calling thread to one CPU, and nothing else; apply() does this along with the rest.
+    /// @retval false if the kernel refused, which is reported to out
+    static bool pin(int cpu, std::ostream &out) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error) {
+            out << "realtime: pinning to cpu " << cpu << " failed: " << strerror(error) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /// Makes every page of a buffer resident and writable now rather than on first use. Safe on a buffer another
+    /// thread is writing: where the kernel can, pages are populated without touching their contents.
+    static void prefault(const void *p, size_t bytes) {
+        if (!p || !bytes) {
+            return;
+        }
+        const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        uintptr_t begin = (uintptr_t) p & ~(page - 1);
+        uintptr_t end = ((uintptr_t) p + bytes + page - 1) & ~(page - 1);
+#ifdef MADV_POPULATE_WRITE
+        if (madvise((void *) begin, end - begin, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+#endif
+        // older kernels: a read fault per page, then mlockall has made them writable
+        for (uintptr_t a = begin; a < end; a += page) {
+            (void) *(volatile const char *) a;
+        }
+    }
+
+    /// Faults in bytes of the calling thread's stack below the current frame, so deep calls later do not fault.
+    static void __attribute__((noinline)) prefault_stack(size_t bytes = 256 * 1024) {
+        volatile char *stack = (volatile char *) alloca(bytes);
+        for (size_t i = 0; i < bytes; i += 4096) {
+            stack[i] = 0;
+        }
+    }
+
+    /// @retval the CPUs in /sys/devices/system/cpu/isolated, e.g. "2-3,6"
+    static std::vector<int> isolated_cpus() {
+        std::vector<int> cpus;
+        std::ifstream in("/sys/devices/system/cpu/isolated");
+        std::string list, item;
+        std::getline(in, list);
+        std::stringstream items(list);
+        while (std::getline(items, item, ',')) {
+            if (item.empty()) {
+                continue;
+            }
+            size_t dash = item.find('-');
+            int first = atoi(item.c_str());
+            int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+            for (int c = first; c <= last; ++c) {
+                cpus.push_back(c);
+            }
+        }
+        return cpus;
+    }
+
+private:
+    /// @retval the rest of the /proc/self/status line starting with key, e.g. "  1024 kB"
+    static std::string proc_status(const char *key) {
+        std::ifstream in("/proc/self/status");
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, strlen(key), key) == 0) {
+                size_t start = line.find_first_not_of(" \t", strlen(key));
+                return start == std::string::npos ? "" : line.substr(start);
+            }
+        }
+        return "";
+    }
+};
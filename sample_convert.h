@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_AVX2 1
+#define SAMPLE_CONVERT_AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SAMPLE_CONVERT_NEON 1
+#endif
+
+/// Layout of one channel's samples going into SampleConverter.
+enum class PlanarFormat {
+    float32, // native float, full scale +-1.0
+    int24,   // packed 3 byte little endian, as in 24 bit WAV and most capture APIs
+    int32    // native int32, full scale at INT32_MIN..INT32_MAX
+};
+
+/// Converts planar audio, one array per channel, to the interleaved 16 or 32 bit integers WriteAudioSamples* takes,
+/// for up to 16 channels. Sits between whatever produces audio and the write, on the playout thread.
+///
+/// Works in blocks of block_frames: each channel is first scaled into a small aligned int32 scratch block (float and
+/// narrowing conversions clipped to full scale, rounded to nearest, and with TPDF dither of +-1 LSB when going down
+/// to 16 bits), then the scratch is interleaved into the output by 8x8 transposes for 8 and 16 channels or by
+/// unpacking for stereo. Both steps have AVX2 (x86, picked at run time) and NEON (aarch64) kernels; other channel
+/// counts, tails shorter than a vector and other CPUs take the scalar path, which produces the same samples bar the
+/// dither noise.
+class SampleConverter {
+public:
+    static constexpr int max_channels = 16;
+    static constexpr uint32_t block_frames = 64;
+
+    enum class Kernel { scalar, avx2, neon };
+
+    /// bits: 16 or 32 bit integer output; dither applies to 16 bit output only; simd false forces the scalar kernel
+    SampleConverter(PlanarFormat format, int channels, int bits, bool dither = true, bool simd = true)
+        : format(format), channels(std::clamp(channels, 1, max_channels)), bits(bits), dither(dither && bits == 16) {
+        for (int c = 0; c < max_channels; ++c) {
+            for (int k = 0; k < 8; ++k) {
+                rng[c][k] = 0x9e3779b9u * (uint32_t) (c * 8 + k + 1);
+            }
+        }
+#if defined(SAMPLE_CONVERT_AVX2)
+        if (simd && __builtin_cpu_supports("avx2")) {
+            kernel = Kernel::avx2;
+        }
+#elif defined(SAMPLE_CONVERT_NEON)
+        if (simd) {
+            kernel = Kernel::neon;
+        }
+#endif
+    }
+
+    /// Converts frames sample frames, starting first samples into each of planes[0..channels), to interleaved
+    /// integers at out, which must have room for frames * channels * bits / 8 bytes.
+    void convert(const void *const *planes, uint32_t first, uint32_t frames, void *out) {
+        char *dst = static_cast<char *>(out);
+        const size_t frame_bytes = (size_t) channels * bits / 8;
+        for (uint32_t at = 0; at < frames; at += block_frames) {
+            uint32_t n = std::min(block_frames, frames - at);
+            for (int c = 0; c < channels; ++c) {
+                scale(planes[c], first + at, n, c);
+            }
+            interleave(n, dst);
+            dst += n * frame_bytes;
+        }
+    }
+
+    Kernel active_kernel() const { return kernel; }
+
+    const char *kernel_name() const {
+        return kernel == Kernel::avx2 ? "avx2" : kernel == Kernel::neon ? "neon" : "scalar";
+    }
+
+    /// @retval bytes per sample of a planar format
+    static int sample_bytes(PlanarFormat f) { return f == PlanarFormat::int24 ? 3 : 4; }
+
+private:
+    // 16 bit output is scaled from float, or from int24/int32 held left justified in an int32
+    static constexpr float float_to_16 = 32767.0f;
+    static constexpr float int_to_16 = 1.0f / 65536.0f;
+    static constexpr float float_to_32 = 2147483520.0f; // largest float below 2^31
+    static constexpr float dither_scale = 0.5f / 2147483648.0f;
+
+    static int32_t load24(const uint8_t *p) {
+        return (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24);
+    }
+
+    /// @retval triangular noise in (-1, 1), the sum of two uniform draws of +-0.5
+    static float tpdf(uint32_t &s) {
+        float sum = 0.0f;
+        for (int k = 0; k < 2; ++k) {
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            sum += (int32_t) s * dither_scale;
+        }
+        return sum;
+    }
+
+    void scale(const void *plane, uint32_t at, uint32_t n, int c) {
+        switch (kernel) {
+#if defined(SAMPLE_CONVERT_AVX2)
+        case Kernel::avx2: scale_avx2(plane, at, n, c); break;
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+        case Kernel::neon: scale_neon(plane, at, n, c); break;
+#endif
+        default: scale_scalar(plane, at, n, block[c], rng[c][0]); break;
+        }
+    }
+
+    void interleave(uint32_t n, char *out) {
+        switch (kernel) {
+#if defined(SAMPLE_CONVERT_AVX2)
+        case Kernel::avx2: interleave_avx2(n, out); break;
+#endif
+#if defined(SAMPLE_CONVERT_NEON)
+        case Kernel::neon: interleave_neon(n, out); break;
+#endif
+        default: interleave_scalar(0, n, out); break;
+        }
+    }
+
+    /// Scales n samples of a plane from sample at into dst.
+    void scale_scalar(const void *plane, uint32_t at, uint32_t n, int32_t *dst, uint32_t &s) {
+        if (format == PlanarFormat::float32) {
+            const float *in = static_cast<const float *>(plane) + at;
+            for (uint32_t i = 0; i < n; ++i) {
+                if (bits == 16) {
+                    float v = in[i] * float_to_16 + (dither ? tpdf(s) : 0.0f);
+                    dst[i] = (int32_t) lrintf(std::min(std::max(v, -32768.0f), 32767.0f));
+                }
+                else {
+                    dst[i] = (int32_t) lrintf(std::min(std::max(in[i] * float_to_32, -float_to_32), float_to_32));
+                }
+            }
+            return;
+        }
+        if (format == PlanarFormat::int24) {
+            const uint8_t *in = static_cast<const uint8_t *>(plane) + 3 * (size_t) at;
+            for (uint32_t i = 0; i < n; ++i) {
+                dst[i] = load24(in + 3 * i);
+            }
+            scale_ints(dst, n, dst, s);
+        }
+        else {
+            scale_ints(static_cast<const int32_t *>(plane) + at, n, dst, s);
+        }
+    }
+
+    /// Scales n left justified int32 samples into dst, which may be in.
+    void scale_ints(const int32_t *in, uint32_t n, int32_t *dst, uint32_t &s) {
+        for (uint32_t i = 0; i < n; ++i) {
+            if (bits == 16) {
+                float v = in[i] * int_to_16 + (dither ? tpdf(s) : 0.0f);
+                dst[i] = (int32_t) lrintf(std::min(std::max(v, -32768.0f), 32767.0f));
+            }
+            else {
+                dst[i] = in[i];
+            }
+        }
+    }
+
+    /// Interleaves frames [from, n) of the scratch block.
+    void interleave_scalar(uint32_t from, uint32_t n, char *out) {
+        for (int c = 0; c < channels; ++c) {
+            const int32_t *in = block[c];
+            if (bits == 16) {
+                int16_t *o = reinterpret_cast<int16_t *>(out);
+                for (uint32_t i = from; i < n; ++i) {
+                    o[(size_t) i * channels + c] = (int16_t) in[i];
+                }
+            }
+            else {
+                int32_t *o = reinterpret_cast<int32_t *>(out);
+                for (uint32_t i = from; i < n; ++i) {
+                    o[(size_t) i * channels + c] = in[i];
+                }
+            }
+        }
+    }
+
+#if defined(SAMPLE_CONVERT_AVX2)
+    static SAMPLE_CONVERT_AVX2_TARGET inline __m256 tpdf_avx2(__m256i &s) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < 2; ++k) {
+            s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+            s = _mm256_xor_si256(s, _mm256_srli_epi32(s, 17));
+            s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 5));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_cvtepi32_ps(s), _mm256_set1_ps(dither_scale)));
+        }
+        return sum;
+    }
+
+    /// Eight packed 3 byte samples to eight left justified int32, reading exactly 24 bytes.
+    static SAMPLE_CONVERT_AVX2_TARGET inline __m256i load24_avx2(const uint8_t *p) {
+        __m128i lo = _mm_loadu_si128((const __m128i *) p);       // samples 0..3 at bytes 0..11
+        __m128i hi = _mm_loadu_si128((const __m128i *) (p + 8)); // samples 4..7 at bytes 4..15
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                                 -1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15);
+        return _mm256_shuffle_epi8(v, shuffle);
+    }
+
+    SAMPLE_CONVERT_AVX2_TARGET void scale_avx2(const void *plane, uint32_t at, uint32_t n, int c) {
+        int32_t *dst = block[c];
+        __m256i s = _mm256_load_si256((const __m256i *) rng[c]);
+        const __m256 lo16 = _mm256_set1_ps(-32768.0f), hi16 = _mm256_set1_ps(32767.0f);
+        uint32_t i = 0;
+        if (format == PlanarFormat::float32) {
+            const float *in = static_cast<const float *>(plane) + at;
+            const __m256 scale = _mm256_set1_ps(bits == 16 ? float_to_16 : float_to_32);
+            const __m256 lo = bits == 16 ? lo16 : _mm256_set1_ps(-float_to_32);
+            const __m256 hi = bits == 16 ? hi16 : _mm256_set1_ps(float_to_32);
+            for (; i + 8 <= n; i += 8) {
+                __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+                if (dither) {
+                    v = _mm256_add_ps(v, tpdf_avx2(s));
+                }
+                v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+                _mm256_store_si256((__m256i *) (dst + i), _mm256_cvtps_epi32(v));
+            }
+        }
+        else {
+            const uint8_t *in24 = static_cast<const uint8_t *>(plane) + 3 * (size_t) at;
+            const int32_t *in32 = static_cast<const int32_t *>(plane) + at;
+            const __m256 scale = _mm256_set1_ps(int_to_16);
+            for (; i + 8 <= n; i += 8) {
+                __m256i x = format == PlanarFormat::int24 ? load24_avx2(in24 + 3 * i)
+                                                          : _mm256_loadu_si256((const __m256i *) (in32 + i));
+                if (bits == 16) {
+                    __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale);
+                    if (dither) {
+                        v = _mm256_add_ps(v, tpdf_avx2(s));
+                    }
+                    x = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(v, lo16), hi16));
+                }
+                _mm256_store_si256((__m256i *) (dst + i), x);
+            }
+        }
+        _mm256_store_si256((__m256i *) rng[c], s);
+        if (i < n) {
+            scale_scalar(plane, at + i, n - i, dst + i, rng[c][0]);
+        }
+    }
+
+    /// Rows of eight channels by eight frames become eight frames of eight channels.
+    static SAMPLE_CONVERT_AVX2_TARGET inline void transpose8_avx2(__m256i r[8]) {
+        __m256i t[8], u[8];
+        for (int k = 0; k < 8; k += 4) {
+            t[k + 0] = _mm256_unpacklo_epi32(r[k + 0], r[k + 1]);
+            t[k + 1] = _mm256_unpackhi_epi32(r[k + 0], r[k + 1]);
+            t[k + 2] = _mm256_unpacklo_epi32(r[k + 2], r[k + 3]);
+            t[k + 3] = _mm256_unpackhi_epi32(r[k + 2], r[k + 3]);
+            u[k + 0] = _mm256_unpacklo_epi64(t[k + 0], t[k + 2]);
+            u[k + 1] = _mm256_unpackhi_epi64(t[k + 0], t[k + 2]);
+            u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+            u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+        }
+        for (int k = 0; k < 4; ++k) {
+            r[k] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x20);
+            r[k + 4] = _mm256_permute2x128_si256(u[k], u[k + 4], 0x31);
+        }
+    }
+
+    SAMPLE_CONVERT_AVX2_TARGET void interleave_avx2(uint32_t n, char *out) {
+        int16_t *o16 = reinterpret_cast<int16_t *>(out);
+        int32_t *o32 = reinterpret_cast<int32_t *>(out);
+        uint32_t f = 0;
+        if (channels == 2) {
+            for (; f + 8 <= n; f += 8) {
+                __m256i a = _mm256_load_si256((const __m256i *) (block[0] + f));
+                __m256i b = _mm256_load_si256((const __m256i *) (block[1] + f));
+                if (bits == 16) {
+                    // values are already in int16 range: left in the low half of each int32, right in the high
+                    __m256i v = _mm256_or_si256(_mm256_and_si256(a, _mm256_set1_epi32(0xffff)), _mm256_slli_epi32(b, 16));
+                    _mm256_storeu_si256((__m256i *) (o16 + 2 * f), v);
+                }
+                else {
+                    __m256i lo = _mm256_unpacklo_epi32(a, b);
+                    __m256i hi = _mm256_unpackhi_epi32(a, b);
+                    _mm256_storeu_si256((__m256i *) (o32 + 2 * f), _mm256_permute2x128_si256(lo, hi, 0x20));
+                    _mm256_storeu_si256((__m256i *) (o32 + 2 * f + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+                }
+            }
+        }
+        else if (channels % 8 == 0) {
+            for (; f + 8 <= n; f += 8) {
+                for (int g = 0; g < channels; g += 8) {
+                    __m256i r[8];
+                    for (int k = 0; k < 8; ++k) {
+                        r[k] = _mm256_load_si256((const __m256i *) (block[g + k] + f));
+                    }
+                    transpose8_avx2(r);
+                    if (bits == 16) {
+                        for (int j = 0; j < 8; j += 2) {
+                            // packs works per 128 bit lane, the permute puts frame j before frame j + 1
+                            __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(r[j], r[j + 1]), 0xd8);
+                            _mm_storeu_si128((__m128i *) (o16 + (size_t) (f + j) * channels + g), _mm256_castsi256_si128(p));
+                            _mm_storeu_si128((__m128i *) (o16 + (size_t) (f + j + 1) * channels + g), _mm256_extracti128_si256(p, 1));
+                        }
+                    }
+                    else {
+                        for (int j = 0; j < 8; ++j) {
+                            _mm256_storeu_si256((__m256i *) (o32 + (size_t) (f + j) * channels + g), r[j]);
+                        }
+                    }
+                }
+            }
+        }
+        interleave_scalar(f, n, out);
+    }
+#endif
+
+#if defined(SAMPLE_CONVERT_NEON)
+    static inline float32x4_t tpdf_neon(uint32x4_t &s) {
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        for (int k = 0; k < 2; ++k) {
+            s = veorq_u32(s, vshlq_n_u32(s, 13));
+            s = veorq_u32(s, vshrq_n_u32(s, 17));
+            s = veorq_u32(s, vshlq_n_u32(s, 5));
+            sum = vaddq_f32(sum, vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(s)), dither_scale));
+        }
+        return sum;
+    }
+
+    void scale_neon(const void *plane, uint32_t at, uint32_t n, int c) {
+        int32_t *dst = block[c];
+        uint32x4_t s = vld1q_u32(rng[c]);
+        const float32x4_t lo16 = vdupq_n_f32(-32768.0f), hi16 = vdupq_n_f32(32767.0f);
+        uint32_t i = 0;
+        if (format == PlanarFormat::float32) {
+            const float *in = static_cast<const float *>(plane) + at;
+            const float scale = bits == 16 ? float_to_16 : float_to_32;
+            const float32x4_t lo = bits == 16 ? lo16 : vdupq_n_f32(-float_to_32);
+            const float32x4_t hi = bits == 16 ? hi16 : vdupq_n_f32(float_to_32);
+            for (; i + 4 <= n; i += 4) {
+                float32x4_t v = vmulq_n_f32(vld1q_f32(in + i), scale);
+                if (dither) {
+                    v = vaddq_f32(v, tpdf_neon(s));
+                }
+                vst1q_s32(dst + i, vcvtnq_s32_f32(vminq_f32(vmaxq_f32(v, lo), hi)));
+            }
+        }
+        else {
+            const int32_t *in = static_cast<const int32_t *>(plane) + at;
+            if (format == PlanarFormat::int24) {
+                // no cheap 3 byte gather here, unpack into the scratch block and scale in place
+                const uint8_t *in24 = static_cast<const uint8_t *>(plane) + 3 * (size_t) at;
+                for (uint32_t k = 0; k < n; ++k) {
+                    dst[k] = load24(in24 + 3 * k);
+                }
+                in = dst;
+            }
+            for (; i + 4 <= n; i += 4) {
+                int32x4_t x = vld1q_s32(in + i);
+                if (bits == 16) {
+                    float32x4_t v = vmulq_n_f32(vcvtq_f32_s32(x), int_to_16);
+                    if (dither) {
+                        v = vaddq_f32(v, tpdf_neon(s));
+                    }
+                    x = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(v, lo16), hi16));
+                }
+                vst1q_s32(dst + i, x);
+            }
+            vst1q_u32(rng[c], s);
+            scale_ints(in + i, n - i, dst + i, rng[c][0]);
+            return;
+        }
+        vst1q_u32(rng[c], s);
+        if (i < n) {
+            scale_scalar(plane, at + i, n - i, dst + i, rng[c][0]);
+        }
+    }
+
+    void interleave_neon(uint32_t n, char *out) {
+        int16_t *o16 = reinterpret_cast<int16_t *>(out);
+        int32_t *o32 = reinterpret_cast<int32_t *>(out);
+        uint32_t f = 0;
+        if (channels == 2) {
+            for (; f + 4 <= n; f += 4) {
+                int32x4_t a = vld1q_s32(block[0] + f);
+                int32x4_t b = vld1q_s32(block[1] + f);
+                if (bits == 16) {
+                    int16x4x2_t v = {{vmovn_s32(a), vmovn_s32(b)}};
+                    vst2_s16(o16 + 2 * f, v);
+                }
+                else {
+                    int32x4x2_t v = {{a, b}};
+                    vst2q_s32(o32 + 2 * f, v);
+                }
+            }
+        }
+        else if (channels % 4 == 0) {
+            for (; f + 4 <= n; f += 4) {
+                for (int g = 0; g < channels; g += 4) {
+                    int32x4x2_t t0 = vtrnq_s32(vld1q_s32(block[g] + f), vld1q_s32(block[g + 1] + f));
+                    int32x4x2_t t1 = vtrnq_s32(vld1q_s32(block[g + 2] + f), vld1q_s32(block[g + 3] + f));
+                    int32x4_t frame[4] = {
+                        vcombine_s32(vget_low_s32(t0.val[0]), vget_low_s32(t1.val[0])),
+                        vcombine_s32(vget_low_s32(t0.val[1]), vget_low_s32(t1.val[1])),
+                        vcombine_s32(vget_high_s32(t0.val[0]), vget_high_s32(t1.val[0])),
+                        vcombine_s32(vget_high_s32(t0.val[1]), vget_high_s32(t1.val[1])),
+                    };
+                    for (int j = 0; j < 4; ++j) {
+                        if (bits == 16) {
+                            vst1_s16(o16 + (size_t) (f + j) * channels + g, vmovn_s32(frame[j]));
+                        }
+                        else {
+                            vst1q_s32(o32 + (size_t) (f + j) * channels + g, frame[j]);
+                        }
+                    }
+                }
+            }
+        }
+        interleave_scalar(f, n, out);
+    }
+#endif
+
+    PlanarFormat format;
+    int channels;
+    int bits;
+    bool dither;
+    Kernel kernel = Kernel::scalar;
+    alignas(32) uint32_t rng[max_channels][8];
+    alignas(32) int32_t block[max_channels][block_frames];
+};
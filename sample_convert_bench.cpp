@@ -0,0 +1,81 @@
+// What SampleConverter costs per video frame of audio, per input format, output width and channel count, for the
+// SIMD kernel this CPU gets and for the scalar one. Also checks the two agree sample for sample with dither off.
+// No card needed.
+//   g++ -std=c++17 -O3 sample_convert_bench.cpp -o sample_convert_bench
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "sample_convert.h"
+
+using namespace std::chrono;
+using std::clog;
+
+int main(int argc, char **argv) {
+    const uint32_t sample_rate = 48000;
+    const uint32_t chunk = 1920; // one 25p frame
+    const uint32_t seconds = argc > 1 ? atoi(argv[1]) : 60;
+    const int channel_counts[] = {2, 8, 16};
+    const PlanarFormat formats[] = {PlanarFormat::float32, PlanarFormat::int24, PlanarFormat::int32};
+    const char *format_names[] = {"float", "int24", "int32"};
+
+    // one second per channel, a little over full scale now and then so clipping is exercised
+    std::vector<std::vector<char>> planes[3];
+    for (int f = 0; f < 3; ++f) {
+        for (int c = 0; c < SampleConverter::max_channels; ++c) {
+            std::vector<char> plane((size_t) sample_rate * SampleConverter::sample_bytes(formats[f]) + 16);
+            for (uint32_t i = 0; i < sample_rate; ++i) {
+                double x = 1.05 * sin(2 * M_PI * (997.0 + 10 * c) * i / sample_rate);
+                if (formats[f] == PlanarFormat::float32) {
+                    float v = (float) x;
+                    memcpy(&plane[4 * i], &v, 4);
+                }
+                else if (formats[f] == PlanarFormat::int24) {
+                    int32_t v = (int32_t) lrint(std::min(std::max(x, -1.0), 1.0) * 8388607.0);
+                    memcpy(&plane[3 * i], &v, 3);
+                }
+                else {
+                    int32_t v = (int32_t) lrint(std::min(std::max(x, -1.0), 1.0) * 2147483647.0);
+                    memcpy(&plane[4 * i], &v, 4);
+                }
+            }
+            planes[f].push_back(std::move(plane));
+        }
+    }
+
+    const uint64_t blocks = (uint64_t) seconds * sample_rate / chunk;
+    bool agree = true;
+    for (int f = 0; f < 3; ++f) {
+        const void *p[SampleConverter::max_channels];
+        for (int c = 0; c < SampleConverter::max_channels; ++c) {
+            p[c] = planes[f][c].data();
+        }
+        for (int bits : {16, 32}) {
+            for (int channels : channel_counts) {
+                std::vector<char> out((size_t) chunk * channels * bits / 8), check(out.size());
+                double us[2];
+                for (int simd = 1; simd >= 0; --simd) {
+                    SampleConverter converter(formats[f], channels, bits, true, simd);
+                    auto t0 = steady_clock::now();
+                    for (uint64_t b = 0; b < blocks; ++b) {
+                        converter.convert(p, (uint32_t) (b * chunk % (sample_rate - chunk)), chunk, out.data());
+                    }
+                    us[simd] = duration<double>(steady_clock::now() - t0).count() * 1e6 / blocks;
+                }
+                // 1917 frames: whole blocks, a partial block and a tail shorter than any vector
+                SampleConverter simd(formats[f], channels, bits, false, true);
+                SampleConverter scalar(formats[f], channels, bits, false, false);
+                simd.convert(p, 101, chunk - 3, out.data());
+                scalar.convert(p, 101, chunk - 3, check.data());
+                bool same = memcmp(out.data(), check.data(), (size_t) (chunk - 3) * channels * bits / 8) == 0;
+                agree = agree && same;
+                clog << format_names[f] << " -> " << bits << " bit, " << channels << " ch: " << simd.kernel_name()
+                     << " " << us[1] << " us, scalar " << us[0] << " us per " << chunk << " frame block"
+                     << (same ? "" : ", OUTPUT DIFFERS") << std::endl;
+            }
+        }
+    }
+    return agree ? 0 : 1;
+}
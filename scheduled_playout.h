@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "display_mode_cache.h"
+#include "video_frame_pool.h"
+
+/// Hardware timed playout: frames and audio are queued ahead with ScheduleVideoFrame/ScheduleAudioSamples
+/// and topped up from the completion callbacks, so the card owns the timing and the caller just sleeps.
+class ScheduledPlayout : public IDeckLinkVideoOutputCallback, public IDeckLinkAudioOutputCallback {
+public:
+    /// audio must hold audio_frames sample frames of audio_frame_bytes each and loop seamlessly
+    ScheduledPlayout(IDeckLinkOutput *output, const DisplayModeCache::Mode &mode, uint32_t preroll_frames,
+                     const char *audio, uint32_t audio_frames, uint32_t audio_frame_bytes, uint32_t sample_rate,
+                     BMDPixelFormat format = bmdFormat8BitYUV)
+        : output(output), timeValue(mode.timeValue), timeScale(mode.timeScale), preroll_frames(preroll_frames),
+          frames(output, mode.width, mode.height, format), audio(audio), audio_frames(audio_frames),
+          audio_frame_bytes(audio_frame_bytes), sample_rate(sample_rate) {
+        audio_target = sample_rate * timeValue * preroll_frames / timeScale;
+    }
+
+    /// Queues the video preroll and starts audio preroll; playback is started from the first audio callback
+    /// once the audio preroll is written, as the SDK samples do.
+    HRESULT start() {
+        output->SetScheduledFrameCompletionCallback(this);
+        output->SetAudioCallback(this);
+
+        // one pool frame per preroll slot: frame n completes just before frame n + preroll_frames reuses it
+        HRESULT result = frames.create(preroll_frames);
+        if (result != S_OK) {
+            return result;
+        }
+        for (uint32_t i = 0; i < preroll_frames; ++i) {
+            result = schedule_next();
+            if (result != S_OK) {
+                return result;
+            }
+        }
+
+        return output->BeginAudioPreroll();
+    }
+
+    /// Stops playback at the next frame and waits for the card to confirm.
+    void stop() {
+        stopping = true;
+        BMDTimeValue actual = 0;
+        if (output->StopScheduledPlayback(0, &actual, timeScale) != S_OK) {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopped; });
+    }
+
+    /// Sleeps until completed frames reaches count or timeout passes.
+    /// @retval true if count was reached
+    bool wait_for(long count, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> guard(lock);
+        return wake.wait_for(guard, timeout, [this, count] { return completed.load() >= count || stopped; });
+    }
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override {
+        if (memcmp(&iid, &IID_IDeckLinkVideoOutputCallback, sizeof(REFIID)) == 0) {
+            *ppv = static_cast<IDeckLinkVideoOutputCallback *>(this);
+            return S_OK;
+        }
+        if (memcmp(&iid, &IID_IDeckLinkAudioOutputCallback, sizeof(REFIID)) == 0) {
+            *ppv = static_cast<IDeckLinkAudioOutputCallback *>(this);
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    // lifetime is owned by the caller
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+    HRESULT ScheduledFrameCompleted(IDeckLinkVideoFrame * /* completedFrame */, BMDOutputFrameCompletionResult result) override {
+        {
+            // under the lock, so wait_for() cannot check completed between this and the notify and miss the wake
+            std::lock_guard<std::mutex> guard(lock);
+            switch (result) {
+            case bmdOutputFrameCompleted:
+                completed++;
+                break;
+            case bmdOutputFrameDisplayedLate:
+                completed++;
+                late++;
+                break;
+            case bmdOutputFrameDropped:
+                dropped++;
+                break;
+            default:
+                flushed++;
+                return S_OK;
+            }
+        }
+        if (!stopping) {
+            schedule_next();
+        }
+        wake.notify_all();
+        return S_OK;
+    }
+
+    HRESULT ScheduledPlaybackHasStopped() override {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        wake.notify_all();
+        return S_OK;
+    }
+
+    HRESULT RenderAudioSamples(bool preroll) override {
+        uint32_t buffered = 0;
+        output->GetBufferedAudioSampleFrameCount(&buffered);
+        if (buffered == 0 && !preroll && audio_written != 0) {
+            audio_underflows++;
+        }
+        while (buffered < audio_target && !stopping) {
+            uint32_t count = std::min(audio_target - buffered, audio_frames - audio_pos);
+            uint32_t written = 0;
+            output->ScheduleAudioSamples((void *) (audio + (size_t) audio_pos * audio_frame_bytes), count,
+                                         audio_written, sample_rate, &written);
+            if (written == 0) {
+                break;
+            }
+            buffered += written;
+            audio_written += written;
+            audio_pos += written;
+            if (audio_pos == audio_frames) {
+                audio_pos = 0;
+            }
+        }
+        if (preroll && !started.exchange(true)) {
+            output->StartScheduledPlayback(0, timeScale, 1.0);
+        }
+        return S_OK;
+    }
+
+    std::atomic<long> completed{0};
+    std::atomic<long> late{0};
+    std::atomic<long> dropped{0};
+    std::atomic<long> flushed{0};
+    std::atomic<long> audio_underflows{0};
+
+private:
+    HRESULT schedule_next() {
+        HRESULT result = output->ScheduleVideoFrame(frames.next(frames_scheduled), frames_scheduled * timeValue,
+                                                    timeValue, timeScale);
+        frames_scheduled++;
+        return result;
+    }
+
+    IDeckLinkOutput *output;
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    uint32_t preroll_frames;
+    VideoFramePool frames;
+    int64_t frames_scheduled = 0;
+
+    const char *audio;
+    uint32_t audio_frames;
+    uint32_t audio_frame_bytes;
+    uint32_t sample_rate;
+    uint32_t audio_target;
+    uint32_t audio_pos = 0;
+    BMDTimeValue audio_written = 0;
+
+    std::atomic<bool> started{false};
+    std::atomic<bool> stopping{false};
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopped = false;
+};
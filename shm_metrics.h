@@ -0,0 +1,228 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/// Live playout counters and gauges in a POSIX shared memory segment, for monitoring to poll from another process
+/// (shm_metrics_reader) as often as it likes without the playout thread noticing.
+///
+/// The segment is a header and one slot per output, each slot on its own cache lines so outputs on different
+/// cores never share one. A slot has one writer, its output's playout thread, and is guarded by a seqlock:
+/// publish() makes the sequence odd, stores the values and makes it even again, all plain stores, with no
+/// system call, lock or I/O. A reader copies the values and keeps the copy only if the sequence was even and
+/// unchanged across it, and tries again otherwise. The writer never waits for a reader.
+///
+/// The creating process unlinks the segment when it is destroyed. A segment left behind by a process that died
+/// still reads, with its header's pid gone and updated_ns no longer moving.
+class ShmMetrics {
+public:
+    enum Metric {
+        frames,             // video frames shown
+        audio_underflows,   // frames that found the audio buffer empty
+        audio_overflows,    // frames whose audio the card did not take all of
+        display_failures,   // DisplayVideoFrameSync calls that failed
+        off_nominal_frames, // hardware clock advances that differed from the nominal frame duration
+        audio_buffered,     // buffered audio sample frames before the last write
+        audio_target,       // the level the audio PLL holds, sample frames; 0 without one
+        wake_latency_ns,    // how far past its deadline the loop last woke
+        hardware_time,      // last GetHardwareReferenceClock reading, in time_scale units
+        clock_delta,        // its advance since the reading before
+        time_in_frame,      // timeInFrame from the same reading
+        time_scale,         // the mode's timeScale, for the three above
+        updated_ns,         // the writer's CLOCK_MONOTONIC at the last publish()
+        metric_count
+    };
+
+    static const char *metric_name(int m) {
+        static const char *names[metric_count] = {"frames", "audio_underflows", "audio_overflows", "display_failures",
+                                                  "off_nominal_frames", "audio_buffered", "audio_target",
+                                                  "wake_latency_ns", "hardware_time", "clock_delta", "time_in_frame",
+                                                  "time_scale", "updated_ns"};
+        return names[m];
+    }
+
+    /// @retval true for the ones that only count up, false for gauges
+    static bool is_counter(int m) { return m <= off_nominal_frames; }
+
+    struct Header {
+        char magic[8];     // "PLAYMETR", written last
+        uint32_t version;  // 1
+        uint32_t slots;
+        uint32_t metrics;  // metric_count
+        int32_t pid;       // of the writer
+        int64_t created_ns; // CLOCK_REALTIME
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence; // odd while being written
+        char label[56];                 // which output, set before playout starts
+        alignas(64) std::atomic<int64_t> values[metric_count];
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free,
+                  "shared between processes, so the atomics have to be address free");
+
+    ShmMetrics() = default;
+
+    ~ShmMetrics() { close(); }
+
+    ShmMetrics(const ShmMetrics &) = delete;
+    ShmMetrics &operator=(const ShmMetrics &) = delete;
+
+    /// Creates (or replaces) the segment name, e.g. "/decklink_playout", with room for slots outputs.
+    /// @retval false, with error() saying why, if it can not be created
+    bool create(const std::string &name, uint32_t slots) {
+        close();
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0) {
+            return fail("can not create " + name + ": " + strerror(errno));
+        }
+        bytes = segment_bytes(slots);
+        if (ftruncate(fd, (off_t) bytes) != 0) {
+            ::close(fd);
+            shm_unlink(name.c_str());
+            return fail("can not size " + name + ": " + strerror(errno));
+        }
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return fail("can not map " + name + ": " + strerror(errno));
+        }
+        base = (char *) p;
+        owner = true;
+        this->name = name;
+        // fresh pages are zero: every sequence even, every value 0
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        header()->version = 1;
+        header()->slots = slots;
+        header()->metrics = metric_count;
+        header()->pid = (int32_t) getpid();
+        header()->created_ns = ts.tv_sec * 1000000000ll + ts.tv_nsec;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header()->magic, "PLAYMETR", 8);
+        return true;
+    }
+
+    /// Maps an existing segment read only.
+    /// @retval false, with error() saying why, if it does not exist or is not one of these
+    bool open(const std::string &name) {
+        close();
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return fail("can not open " + name + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+            ::close(fd);
+            return fail(name + " is not a playout metrics segment");
+        }
+        bytes = (size_t) st.st_size;
+        void *p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return fail("can not map " + name + ": " + strerror(errno));
+        }
+        base = (char *) p;
+        this->name = name;
+        if (memcmp(header()->magic, "PLAYMETR", 8) != 0 || header()->version != 1 ||
+            header()->metrics != metric_count || segment_bytes(header()->slots) > bytes) {
+            close();
+            return fail(name + " is not a version 1 playout metrics segment");
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    void close() {
+        if (base) {
+            munmap(base, bytes);
+            if (owner) {
+                shm_unlink(name.c_str());
+            }
+        }
+        base = nullptr;
+        owner = false;
+    }
+
+    /// Names a slot, before its writer starts publishing.
+    void set_label(uint32_t slot, const std::string &label) {
+        Slot &s = this->slot(slot);
+        strncpy(s.label, label.c_str(), sizeof(s.label) - 1);
+    }
+
+    /// Writer side, only from the slot's one writer thread: publishes values[metric_count] at once. Stamps
+    /// updated_ns itself.
+    void publish(uint32_t slot, const int64_t *values) {
+        Slot &s = this->slot(slot);
+        uint64_t seq = s.sequence.load(std::memory_order_relaxed);
+        s.sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int m = 0; m < updated_ns; ++m) {
+            s.values[m].store(values[m], std::memory_order_relaxed);
+        }
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        s.values[updated_ns].store(ts.tv_sec * 1000000000ll + ts.tv_nsec, std::memory_order_relaxed);
+        s.sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    /// Reader side, any thread or process: copies one consistent set of a slot's values into values[metric_count].
+    /// @retval false if the writer was mid publish on every one of tries attempts
+    bool read(uint32_t slot, int64_t *values, int tries = 1000) const {
+        const Slot &s = this->slot(slot);
+        for (int i = 0; i < tries; ++i) {
+            uint64_t before = s.sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                continue;
+            }
+            for (int m = 0; m < metric_count; ++m) {
+                values[m] = s.values[m].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.sequence.load(std::memory_order_relaxed) == before) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t slots() const { return base ? header()->slots : 0; }
+    std::string label(uint32_t slot) const {
+        const Slot &s = this->slot(slot);
+        return std::string(s.label, strnlen(s.label, sizeof(s.label)));
+    }
+    int32_t pid() const { return header()->pid; }
+    /// @retval whether the process that created the segment is still running
+    bool writer_alive() const { return kill(header()->pid, 0) == 0 || errno == EPERM; }
+    const std::string &error() const { return error_text; }
+
+private:
+    static size_t segment_bytes(uint32_t slots) { return sizeof(Slot) + (size_t) slots * sizeof(Slot); }
+
+    // the header gets a whole slot's worth of room so the slots after it stay cache line aligned
+    Header *header() const { return (Header *) base; }
+    Slot &slot(uint32_t i) const { return ((Slot *) base)[i + 1]; }
+
+    bool fail(const std::string &why) {
+        error_text = why;
+        return false;
+    }
+
+    char *base = nullptr;
+    size_t bytes = 0;
+    bool owner = false;
+    std::string name;
+    std::string error_text;
+};
@@ -0,0 +1,161 @@
+// Reads the live counters a playout process publishes with -metrics <name> (ShmMetrics) and prints them as
+// Prometheus text or JSON, once or every -interval. Reading is a copy out of shared memory, so it can poll as
+// often as monitoring likes without the playout threads doing any more work. No card needed.
+//   g++ -std=c++17 -O2 shm_metrics_reader.cpp -o shm_metrics_reader   (-lrt on older glibc)
+//   ./shm_metrics_reader -name /decklink_playout
+//   ./shm_metrics_reader -json -interval 100
+//   ./shm_metrics_reader -interval 1000 -out /var/lib/node_exporter/textfile/playout.prom
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "input_parser.h"
+#include "shm_metrics.h"
+
+using std::clog;
+
+
+static int64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/// @retval s with backslashes and double quotes escaped, for a Prometheus label value or a JSON string
+static std::string escaped(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+/// One scrape: every slot's values, read consistently slot by slot.
+struct Scrape {
+    std::vector<std::vector<int64_t>> values;
+    std::vector<bool> consistent; // false if the writer kept the slot busy for every try
+    int64_t now_ns;
+};
+
+static Scrape scrape(const ShmMetrics &metrics) {
+    Scrape s;
+    s.values.assign(metrics.slots(), std::vector<int64_t>(ShmMetrics::metric_count));
+    for (uint32_t i = 0; i < metrics.slots(); ++i) {
+        s.consistent.push_back(metrics.read(i, s.values[i].data()));
+    }
+    s.now_ns = monotonic_ns();
+    return s;
+}
+
+static std::string prometheus(const ShmMetrics &metrics, const Scrape &s) {
+    std::ostringstream out;
+    out << "# TYPE decklink_playout_up gauge\n";
+    out << "decklink_playout_up{pid=\"" << metrics.pid() << "\"} " << (metrics.writer_alive() ? 1 : 0) << "\n";
+    for (int m = 0; m < ShmMetrics::metric_count; ++m) {
+        if (m == ShmMetrics::updated_ns) {
+            continue;
+        }
+        bool counter = ShmMetrics::is_counter(m);
+        std::string name = std::string("decklink_") + ShmMetrics::metric_name(m) + (counter ? "_total" : "");
+        out << "# TYPE " << name << (counter ? " counter\n" : " gauge\n");
+        for (uint32_t i = 0; i < metrics.slots(); ++i) {
+            if (s.consistent[i]) {
+                out << name << "{output=\"" << i << "\",label=\"" << escaped(metrics.label(i)) << "\"} "
+                    << s.values[i][m] << "\n";
+            }
+        }
+    }
+    // how long since each output last published; it stops moving if the loop stalls or the process dies
+    out << "# TYPE decklink_publish_age_seconds gauge\n";
+    for (uint32_t i = 0; i < metrics.slots(); ++i) {
+        if (s.consistent[i] && s.values[i][ShmMetrics::updated_ns]) {
+            out << "decklink_publish_age_seconds{output=\"" << i << "\",label=\"" << escaped(metrics.label(i))
+                << "\"} " << (s.now_ns - s.values[i][ShmMetrics::updated_ns]) / 1e9 << "\n";
+        }
+    }
+    return out.str();
+}
+
+static std::string json(const ShmMetrics &metrics, const Scrape &s) {
+    std::ostringstream out;
+    out << "{\"pid\":" << metrics.pid() << ",\"up\":" << (metrics.writer_alive() ? "true" : "false")
+        << ",\"outputs\":[";
+    for (uint32_t i = 0; i < metrics.slots(); ++i) {
+        out << (i ? "," : "") << "{\"output\":" << i << ",\"label\":\"" << escaped(metrics.label(i))
+            << "\",\"consistent\":" << (s.consistent[i] ? "true" : "false");
+        for (int m = 0; m < ShmMetrics::metric_count; ++m) {
+            out << ",\"" << ShmMetrics::metric_name(m) << "\":" << s.values[i][m];
+        }
+        int64_t updated = s.values[i][ShmMetrics::updated_ns];
+        out << ",\"publish_age_ns\":" << (updated ? s.now_ns - updated : -1) << "}";
+    }
+    out << "]}\n";
+    return out.str();
+}
+
+/// Writes text beside path and renames it over, so a collector never reads half a scrape.
+static bool write_file(const std::string &path, const std::string &text) {
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+int main(int argc, char **argv) {
+    InputParser input(argc, argv);
+    if(input.cmdOptionExists("-h")){
+        std::clog <<" -name <segment> what the playout process was given with -metrics (default /decklink_playout)"<<std::endl;
+        std::clog <<" -json print JSON instead of Prometheus text"<<std::endl;
+        std::clog <<" -interval <ms> keep printing this often instead of once, reopening the segment if the playout restarts"<<std::endl;
+        std::clog <<" -out <file> write each scrape to file (replaced whole) instead of stdout, e.g. for a node_exporter textfile collector"<<std::endl;
+        exit(0);
+    }
+    const std::string name = input.cmdOptionExists("-name") ? input.getCmdOption("-name") : "/decklink_playout";
+    const bool as_json = input.cmdOptionExists("-json");
+    const long interval_ms = input.cmdOptionExists("-interval") ? atol(input.getCmdOption("-interval").c_str()) : 0;
+    const std::string out_path = input.getCmdOption("-out");
+
+    ShmMetrics metrics;
+    auto next = std::chrono::steady_clock::now();
+    while (true) {
+        // a restarted playout process makes a new segment under the same name; follow it once the old one's
+        // writer is gone
+        if (!metrics.slots() || !metrics.writer_alive()) {
+            if (!metrics.open(name) && interval_ms <= 0) {
+                clog << metrics.error() << std::endl;
+                exit(1);
+            }
+        }
+        if (metrics.slots()) {
+            Scrape s = scrape(metrics);
+            std::string text = as_json ? json(metrics, s) : prometheus(metrics, s);
+            if (out_path.empty()) {
+                fwrite(text.data(), 1, text.size(), stdout);
+                fflush(stdout);
+            }
+            else if (!write_file(out_path, text)) {
+                clog << "can not write " << out_path << std::endl;
+            }
+        }
+        if (interval_ms <= 0) {
+            break;
+        }
+        next += std::chrono::milliseconds(interval_ms);
+        std::this_thread::sleep_until(next);
+    }
+}
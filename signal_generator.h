@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/// Multi-channel test signal generator producing interleaved 16 or 32 bit integer audio in blocks of any length.
+///
+/// All state (oscillator phase, sweep position, noise filters, ident timing) carries across fill() calls, so
+/// consecutive blocks join without a click whatever the frequency. Tones come from recursive oscillators: eight
+/// phasors per tone, each eight samples apart, rotated together by one complex multiply per group of eight
+/// samples. The inner loops are plain fixed width float loops the compiler turns into SIMD, so there are no
+/// sin() calls per sample, only sixteen per tone per block to re-seed the phasors from a double phase.
+class SignalGenerator {
+public:
+    static constexpr int max_channels = 16;
+    static constexpr int max_tones = 4;
+    static constexpr uint32_t block_frames = 256;
+
+    /// bits: 16 or 32 bit integer output
+    SignalGenerator(uint32_t sample_rate, int channels, int bits)
+        : sample_rate(sample_rate), channels(std::min(channels, max_channels)), bits(bits) {
+        for (int c = 0; c < max_channels; ++c) {
+            channel[c].noise_state = 0x9e3779b9u * (c + 1);
+        }
+    }
+
+    void set_silence(int c) { reset(c, Kind::silence, 0.0); }
+
+    /// level_db is the peak level relative to full scale
+    void set_sine(int c, double frequency, double level_db) {
+        double f[1] = {frequency};
+        set_multitone(c, f, 1, level_db);
+    }
+
+    /// Sum of up to max_tones sines, each at level_db.
+    void set_multitone(int c, const double *frequencies, int count, double level_db) {
+        Channel &ch = reset(c, Kind::tones, level_db);
+        ch.tone_count = std::min(count, max_tones);
+        for (int t = 0; t < ch.tone_count; ++t) {
+            ch.tone[t].set(frequencies[t], sample_rate, 0.0);
+        }
+    }
+
+    /// Logarithmic sweep from f0 to f1 over seconds, then starting again from f0.
+    void set_sweep(int c, double f0, double f1, double seconds, double level_db) {
+        Channel &ch = reset(c, Kind::sweep, level_db);
+        ch.tone_count = 1;
+        ch.f0 = f0;
+        ch.f1 = f1;
+        ch.period = (uint64_t) (seconds * sample_rate);
+        ch.tone[0].set(f0, sample_rate, 0.0);
+    }
+
+    void set_white_noise(int c, double level_db) { reset(c, Kind::white, level_db); }
+
+    void set_pink_noise(int c, double level_db) { reset(c, Kind::pink, level_db); }
+
+    /// 1 kHz tone broken into c + 1 short beeps every 4 seconds, so each channel can be identified by ear or by
+    /// counting bursts on a capture.
+    void set_ident(int c, double level_db) {
+        Channel &ch = reset(c, Kind::ident, level_db);
+        ch.tone_count = 1;
+        ch.tone[0].set(1000.0, sample_rate, 0.0);
+    }
+
+    /// Writes frames of interleaved audio to dst, continuing from where the last call stopped.
+    void fill(void *dst, uint32_t frames) {
+        char *out = static_cast<char *>(dst);
+        const size_t frame_bytes = channels * bits / 8;
+        while (frames) {
+            if (pos == block_frames) {
+                render();
+            }
+            uint32_t n = std::min(frames, block_frames - pos);
+            if (bits == 16) {
+                interleave<int16_t>(reinterpret_cast<int16_t *>(out), n, 32767.0f);
+            }
+            else {
+                interleave<int32_t>(reinterpret_cast<int32_t *>(out), n, 2147483520.0f);
+            }
+            out += n * frame_bytes;
+            pos += n;
+            frames -= n;
+        }
+    }
+
+private:
+    enum class Kind { silence, tones, sweep, white, pink, ident };
+
+    /// Eight phasors one sample apart, each stepped by eight samples per group.
+    ///
+    /// A float step is never exactly the frequency asked for, so the phasors alone drift in phase without bound
+    /// (997 Hz was 0.3 rad off sin() after an hour). The exact phase is kept in double cycles instead and the
+    /// phasors are seeded from it again after every block, so errors only build up over block_frames samples.
+    struct Oscillator {
+        alignas(32) float re[8];
+        alignas(32) float im[8];
+        float step_re = 1.0f;
+        float step_im = 0.0f;
+        double frequency = 0.0;
+        double cycles = 0.0;    // phase of re[0], im[0] in [0, 1)
+        double increment = 0.0; // cycles per sample
+
+        void set(double f, uint32_t rate, double phase) {
+            frequency = f;
+            increment = f / rate;
+            cycles = phase / (2.0 * M_PI);
+            cycles -= floor(cycles);
+            double w = 2.0 * M_PI * increment;
+            step_re = (float) cos(8.0 * w);
+            step_im = (float) sin(8.0 * w);
+            seed();
+        }
+
+        /// Changes frequency keeping the current phase.
+        void retune(double f, uint32_t rate) { set(f, rate, 2.0 * M_PI * cycles); }
+
+        void seed() {
+            for (int k = 0; k < 8; ++k) {
+                double x = 2.0 * M_PI * (cycles + increment * k);
+                re[k] = (float) cos(x);
+                im[k] = (float) sin(x);
+            }
+        }
+
+        void render_add(float *out, uint32_t n, float amp) {
+            for (uint32_t g = 0; g < n; g += 8) {
+                for (int k = 0; k < 8; ++k) {
+                    out[g + k] += amp * im[k];
+                }
+                for (int k = 0; k < 8; ++k) {
+                    float r = re[k] * step_re - im[k] * step_im;
+                    float i = re[k] * step_im + im[k] * step_re;
+                    re[k] = r;
+                    im[k] = i;
+                }
+            }
+            // n is a whole number of groups, so this is where the phasors now are; the exact phase also puts the
+            // magnitude back to 1
+            cycles += increment * n;
+            cycles -= floor(cycles);
+            seed();
+        }
+    };
+
+    struct Channel {
+        Kind kind = Kind::silence;
+        float amp = 0.0f;
+        Oscillator tone[max_tones];
+        int tone_count = 0;
+        double f0 = 0.0;
+        double f1 = 0.0;
+        uint64_t period = 0;
+        float pink[3] = {0, 0, 0};
+        uint32_t noise_state = 1;
+    };
+
+    Channel &reset(int c, Kind kind, double level_db) {
+        uint32_t seed = channel[c].noise_state;
+        channel[c] = Channel();
+        channel[c].kind = kind;
+        channel[c].amp = (float) pow(10.0, level_db / 20.0);
+        channel[c].noise_state = seed;
+        return channel[c];
+    }
+
+    static float uniform(uint32_t &s) {
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        return (int32_t) s * (1.0f / 2147483648.0f);
+    }
+
+    void render() {
+        for (int c = 0; c < channels; ++c) {
+            Channel &ch = channel[c];
+            float *out = block[c];
+            memset(out, 0, sizeof(block[c]));
+            switch (ch.kind) {
+            case Kind::silence:
+                break;
+            case Kind::tones:
+                for (int t = 0; t < ch.tone_count; ++t) {
+                    ch.tone[t].render_add(out, block_frames, ch.amp);
+                }
+                break;
+            case Kind::sweep: {
+                // frequency is stepped once per block, phase stays continuous
+                double x = (double) (rendered % ch.period) / ch.period;
+                ch.tone[0].retune(ch.f0 * pow(ch.f1 / ch.f0, x), sample_rate);
+                ch.tone[0].render_add(out, block_frames, ch.amp);
+                break;
+            }
+            case Kind::white:
+                for (uint32_t i = 0; i < block_frames; ++i) {
+                    out[i] = ch.amp * uniform(ch.noise_state);
+                }
+                break;
+            case Kind::pink:
+                // Paul Kellet's economy filter, about 1 dB from -3 dB/octave across the audio band
+                for (uint32_t i = 0; i < block_frames; ++i) {
+                    float w = uniform(ch.noise_state);
+                    ch.pink[0] = 0.99765f * ch.pink[0] + w * 0.0990460f;
+                    ch.pink[1] = 0.96300f * ch.pink[1] + w * 0.2965164f;
+                    ch.pink[2] = 0.57000f * ch.pink[2] + w * 1.0526913f;
+                    out[i] = ch.amp * 0.25f * (ch.pink[0] + ch.pink[1] + ch.pink[2] + w * 0.1848f);
+                }
+                break;
+            case Kind::ident: {
+                ch.tone[0].render_add(out, block_frames, ch.amp);
+                const uint64_t beep = sample_rate / 10;
+                const uint64_t cycle = sample_rate * 4ull;
+                for (uint32_t i = 0; i < block_frames; ++i) {
+                    uint64_t t = (rendered + i) % cycle;
+                    bool on = t / beep % 2 == 0 && t / (2 * beep) <= (uint64_t) c;
+                    out[i] = on ? out[i] : 0.0f;
+                }
+                break;
+            }
+            }
+        }
+        rendered += block_frames;
+        pos = 0;
+    }
+
+    template <typename T>
+    void interleave(T *out, uint32_t n, float full_scale) {
+        for (int c = 0; c < channels; ++c) {
+            const float *in = block[c] + pos;
+            for (uint32_t i = 0; i < n; ++i) {
+                float v = std::min(std::max(in[i] * full_scale, -full_scale), full_scale);
+                out[(size_t) i * channels + c] = (T) lrintf(v);
+            }
+        }
+    }
+
+    uint32_t sample_rate;
+    int channels;
+    int bits;
+    Channel channel[max_channels];
+    alignas(32) float block[max_channels][block_frames];
+    uint32_t pos = block_frames;
+    uint64_t rendered = 0;
+};
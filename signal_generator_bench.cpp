@@ -0,0 +1,83 @@
+// How much faster than real time SignalGenerator fills blocks, per signal type, and how far its sines stay from sin()
+// over an hour (exits 1 if any is worse than -100 dBFS). No card needed.
+//   g++ -std=c++17 -O3 -march=native signal_generator_bench.cpp -o signal_generator_bench
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "signal_generator.h"
+
+using namespace std::chrono;
+using std::clog;
+
+int main(int argc, char **argv) {
+    const uint32_t sample_rate = 48000;
+    const int channels = argc > 1 ? atoi(argv[1]) : 16;
+    const int bits = argc > 2 ? atoi(argv[2]) : 32;
+    const uint32_t chunk = 1920; // one 25p frame
+    const uint32_t seconds = 600;
+    std::vector<char> out((size_t) chunk * channels * bits / 8);
+
+    const char *names[] = {"sine", "multitone", "sweep", "white", "pink", "ident"};
+    for (int type = 0; type < 6; ++type) {
+        SignalGenerator generator(sample_rate, channels, bits);
+        for (int c = 0; c < channels; ++c) {
+            double tones[] = {997.0 + c, 3001.0, 7919.0, 12007.0};
+            switch (type) {
+            case 0: generator.set_sine(c, 997.0 + c, -18); break;
+            case 1: generator.set_multitone(c, tones, 4, -24); break;
+            case 2: generator.set_sweep(c, 20, 20000, 10, -18); break;
+            case 3: generator.set_white_noise(c, -18); break;
+            case 4: generator.set_pink_noise(c, -18); break;
+            default: generator.set_ident(c, -18); break;
+            }
+        }
+        auto t0 = steady_clock::now();
+        for (uint64_t done = 0; done < (uint64_t) seconds * sample_rate; done += chunk) {
+            generator.fill(out.data(), chunk);
+        }
+        double elapsed = duration<double>(steady_clock::now() - t0).count();
+        clog << names[type] << ": " << channels << " ch " << bits << " bit, " << seconds / elapsed << "x real time, "
+             << elapsed * 1e6 / (seconds * sample_rate / chunk) << " us per " << chunk << " frame block" << std::endl;
+    }
+
+    // accuracy of the recursive oscillator against sin() over an hour, at 1 kHz and at frequencies whose period is
+    // not a whole number of samples, where any error in the step accumulates as phase drift instead of cancelling
+    const uint32_t hour = 3600;
+    const int frequencies[] = {1000, 997, 440};
+    int failed = 0;
+    std::vector<int32_t> s(sample_rate);
+    for (int frequency : frequencies) {
+        SignalGenerator generator(sample_rate, 1, 32);
+        generator.set_sine(0, frequency, 0);
+        double first_error = 0, first_rms = 0, worst_error = 0, worst_drift = 0;
+        for (uint32_t sec = 0; sec < hour; ++sec) {
+            generator.fill(s.data(), sample_rate);
+            if (sec % 60 != 0 && sec != hour - 1) {
+                continue;
+            }
+            // whole Hz at 48 kHz: the exact phase is an integer count of 1/sample_rate cycles
+            double error = 0, sum = 0;
+            for (uint32_t i = 0; i < sample_rate; ++i) {
+                uint64_t n = (uint64_t) sec * sample_rate + i;
+                double expect = sin(2 * M_PI * (double) ((uint64_t) frequency * n % sample_rate) / sample_rate);
+                error = std::max(error, fabs(s[i] / 2147483520.0 - expect));
+                sum += (double) s[i] * s[i];
+            }
+            double rms = 10 * log10(sum / sample_rate) - 20 * log10(2147483520.0);
+            if (sec == 0) {
+                first_error = error;
+                first_rms = rms;
+            }
+            worst_error = std::max(worst_error, error);
+            worst_drift = std::max(worst_drift, fabs(rms - first_rms));
+        }
+        bool ok = 20 * log10(worst_error) < -100 && worst_drift < 0.001;
+        failed += !ok;
+        clog << frequency << " Hz sine error vs sin() " << 20 * log10(first_error) << " dBFS in the first second, worst "
+             << 20 * log10(worst_error) << " dBFS over " << hour << " s, rms level drift " << worst_drift << " dB"
+             << (ok ? "" : " FAIL") << std::endl;
+    }
+    return failed ? 1 : 0;
+}
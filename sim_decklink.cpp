@@ -0,0 +1,1025 @@
+#include "sim_decklink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+static bool same_iid(const REFIID &a, const REFIID &b) {
+    return memcmp(&a, &b, sizeof(REFIID)) == 0;
+}
+
+/// @retval ticks in scale, without overflowing for multi-day runs
+static int64_t ns_to_ticks(int64_t ns, int64_t scale) {
+    return ns / 1000000000 * scale + ns % 1000000000 * scale / 1000000000;
+}
+
+/// @retval ns for ticks in scale, without overflowing for multi-day runs
+static int64_t ticks_to_ns(int64_t ticks, int64_t scale) {
+    return ticks / scale * 1000000000 + ticks % scale * 1000000000 / scale;
+}
+
+SimDisplayMode::SimDisplayMode(BMDDisplayMode mode, const char *name, long width, long height,
+                               BMDTimeValue timeValue, BMDTimeScale timeScale, BMDFieldDominance dominance)
+    : mode(mode), name(name), width(width), height(height), timeValue(timeValue), timeScale(timeScale),
+      dominance(dominance) {
+}
+
+HRESULT SimDisplayMode::QueryInterface(REFIID iid, LPVOID *ppv) {
+    if (same_iid(iid, IID_IDeckLinkDisplayMode)) {
+        *ppv = static_cast<IDeckLinkDisplayMode *>(this);
+        return S_OK;
+    }
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+HRESULT SimDisplayMode::GetName(const char **out) {
+    *out = name;
+    return S_OK;
+}
+
+HRESULT SimDisplayMode::GetFrameRate(BMDTimeValue *frameDuration, BMDTimeScale *scale) {
+    *frameDuration = timeValue;
+    *scale = timeScale;
+    return S_OK;
+}
+
+const std::vector<SimDisplayMode *> &sim_display_modes() {
+    static const std::vector<SimDisplayMode *> modes = {
+        new SimDisplayMode(bmdModeHD1080p2398, "1080p23.98", 1920, 1080, 1001, 24000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p24, "1080p24", 1920, 1080, 1000, 24000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p25, "1080p25", 1920, 1080, 1000, 25000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p2997, "1080p29.97", 1920, 1080, 1001, 30000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p30, "1080p30", 1920, 1080, 1000, 30000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080i50, "1080i50", 1920, 1080, 1000, 25000, bmdUpperFieldFirst),
+        new SimDisplayMode(bmdModeHD1080i5994, "1080i59.94", 1920, 1080, 1001, 30000, bmdUpperFieldFirst),
+        new SimDisplayMode(bmdModeHD1080p50, "1080p50", 1920, 1080, 1000, 50000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p5994, "1080p59.94", 1920, 1080, 1001, 60000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdModeHD1080p6000, "1080p60", 1920, 1080, 1000, 60000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdMode4K2160p25, "2160p25", 3840, 2160, 1000, 25000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdMode4K2160p50, "2160p50", 3840, 2160, 1000, 50000, bmdProgressiveFrame),
+        new SimDisplayMode(bmdMode4K2160p60, "2160p60", 3840, 2160, 1000, 60000, bmdProgressiveFrame),
+    };
+    return modes;
+}
+
+class SimDisplayModeIterator : public IDeckLinkDisplayModeIterator {
+public:
+    HRESULT QueryInterface(REFIID, LPVOID *ppv) override {
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef() override { return ++refs; }
+    ULONG Release() override {
+        ULONG r = --refs;
+        if (r == 0) {
+            delete this;
+        }
+        return r;
+    }
+    HRESULT Next(IDeckLinkDisplayMode **out) override {
+        const auto &modes = sim_display_modes();
+        if (index >= modes.size()) {
+            *out = nullptr;
+            return S_FALSE;
+        }
+        *out = modes[index++];
+        return S_OK;
+    }
+
+private:
+    std::atomic<ULONG> refs{1};
+    size_t index = 0;
+};
+
+SimVideoFrame::SimVideoFrame(long width, long height, long rowBytes, BMDPixelFormat pixelFormat, BMDFrameFlags flags)
+    : width(width), height(height), rowBytes(rowBytes), pixelFormat(pixelFormat), flags(flags),
+      bytes(rowBytes * height) {
+}
+
+HRESULT SimVideoFrame::QueryInterface(REFIID iid, LPVOID *ppv) {
+    if (same_iid(iid, IID_IDeckLinkVideoFrame) || same_iid(iid, IID_IDeckLinkMutableVideoFrame)) {
+        AddRef();
+        *ppv = static_cast<IDeckLinkMutableVideoFrame *>(this);
+        return S_OK;
+    }
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG SimVideoFrame::AddRef() {
+    return ++refs;
+}
+
+ULONG SimVideoFrame::Release() {
+    ULONG r = --refs;
+    if (r == 0) {
+        delete this;
+    }
+    return r;
+}
+
+HRESULT SimVideoFrame::GetBytes(void **buffer) {
+    *buffer = bytes.data();
+    return S_OK;
+}
+
+HRESULT SimVideoFrame::SetFlags(BMDFrameFlags newFlags) {
+    flags = newFlags;
+    return S_OK;
+}
+
+SimDeckLinkOutput::SimDeckLinkOutput(uint32_t audio_capacity) : audio_capacity(audio_capacity) {
+    epoch_ns = now_ns();
+}
+
+SimDeckLinkOutput::~SimDeckLinkOutput() {
+    DisableVideoOutput();
+    delete loop_buffer;
+}
+
+int64_t SimDeckLinkOutput::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t SimDeckLinkOutput::card_ns() {
+    int64_t elapsed = now_ns() - epoch_ns;
+    return elapsed + llround(elapsed * skew_ppm.load() * 1e-6);
+}
+
+int64_t SimDeckLinkOutput::host_ns(int64_t card) {
+    return llround(card / (1.0 + skew_ppm.load() * 1e-6));
+}
+
+void SimDeckLinkOutput::set_clock_jitter(int64_t ns) {
+    jitter_ns = std::max<int64_t>(ns, 0);
+}
+
+void SimDeckLinkOutput::set_clock_skew(double ppm) {
+    std::lock_guard<std::mutex> guard(lock);
+    // keep the card's current time continuous across the change
+    int64_t elapsed = now_ns() - epoch_ns;
+    int64_t card = card_ns();
+    skew_ppm = ppm;
+    epoch_ns += elapsed - host_ns(card);
+}
+
+HRESULT SimDeckLinkOutput::QueryInterface(REFIID iid, LPVOID *ppv) {
+    if (same_iid(iid, IID_IDeckLinkOutput)) {
+        AddRef();
+        *ppv = static_cast<IDeckLinkOutput *>(this);
+        return S_OK;
+    }
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG SimDeckLinkOutput::AddRef() {
+    return ++refs;
+}
+
+ULONG SimDeckLinkOutput::Release() {
+    ULONG r = --refs;
+    if (r == 0) {
+        delete this;
+    }
+    return r;
+}
+
+HRESULT SimDeckLinkOutput::DoesSupportVideoMode(BMDVideoConnection, BMDDisplayMode requestedMode, BMDPixelFormat,
+                                                BMDVideoOutputConversionMode, BMDSupportedVideoModeFlags,
+                                                BMDDisplayMode *actualMode, bool *supported) {
+    IDeckLinkDisplayMode *m = nullptr;
+    *supported = GetDisplayMode(requestedMode, &m) == S_OK;
+    if (actualMode) {
+        if (*supported) {
+            *actualMode = requestedMode;
+        } else {
+            *actualMode = bmdModeUnknown;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::GetDisplayMode(BMDDisplayMode displayMode, IDeckLinkDisplayMode **resultDisplayMode) {
+    for (SimDisplayMode *m : sim_display_modes()) {
+        if (m->mode == displayMode) {
+            *resultDisplayMode = m;
+            return S_OK;
+        }
+    }
+    *resultDisplayMode = nullptr;
+    return E_INVALIDARG;
+}
+
+HRESULT SimDeckLinkOutput::GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator) {
+    *iterator = new SimDisplayModeIterator();
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::EnableVideoOutput(BMDDisplayMode displayMode, BMDVideoOutputFlags) {
+    IDeckLinkDisplayMode *m = nullptr;
+    if (GetDisplayMode(displayMode, &m) != S_OK) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (running) {
+        return E_ACCESSDENIED;
+    }
+    mode = static_cast<SimDisplayMode *>(m);
+    frame_index = ns_to_ticks(card_ns(), mode->timeScale) / mode->timeValue;
+    running = true;
+    worker = std::thread(&SimDeckLinkOutput::run, this);
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::DisableVideoOutput() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running) {
+            return S_OK;
+        }
+        running = false;
+    }
+    wake.notify_all();
+    worker.join();
+    std::lock_guard<std::mutex> guard(lock);
+    for (Scheduled &s : scheduled) {
+        s.frame->Release();
+    }
+    scheduled.clear();
+    playback_running = false;
+    put_on_air(nullptr);
+    if (sync_frame) {
+        sync_frame->Release();
+        sync_frame = nullptr;
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::CreateVideoFrame(int32_t width, int32_t height, int32_t rowBytes, BMDPixelFormat pixelFormat,
+                                            BMDFrameFlags flags, IDeckLinkMutableVideoFrame **outFrame) {
+    if (width <= 0 || height <= 0 || rowBytes <= 0) {
+        return E_INVALIDARG;
+    }
+    *outFrame = new SimVideoFrame(width, height, rowBytes, pixelFormat, flags);
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::DisplayVideoFrameSync(IDeckLinkVideoFrame *theFrame) {
+    if (theFrame == nullptr) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running || playback_running) {
+        return E_ACCESSDENIED;
+    }
+    if (sync_frame_pending) {
+        // the previous frame never made it out before this one replaced it
+        counters.frames_dropped++;
+    }
+    sync_frame_pending = true;
+    theFrame->AddRef();
+    if (sync_frame) {
+        sync_frame->Release();
+    }
+    sync_frame = theFrame;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame, BMDTimeValue displayTime,
+                                              BMDTimeValue, BMDTimeScale scale) {
+    if (theFrame == nullptr || scale <= 0) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running) {
+        return E_ACCESSDENIED;
+    }
+    BMDTimeValue t = displayTime * mode->timeScale / scale;
+    auto pos = scheduled.end();
+    while (pos != scheduled.begin() && std::prev(pos)->displayTime > t) {
+        --pos;
+    }
+    theFrame->AddRef();
+    scheduled.insert(pos, Scheduled{theFrame, t});
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *theCallback) {
+    std::lock_guard<std::mutex> guard(lock);
+    video_callback = theCallback;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount) {
+    std::lock_guard<std::mutex> guard(lock);
+    *bufferedFrameCount = scheduled.size();
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::EnableAudioOutput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType,
+                                             uint32_t channelCount, BMDAudioOutputStreamType streamType) {
+    std::lock_guard<std::mutex> guard(lock);
+    drain_audio();
+    audio_enabled = true;
+    audio_sample_rate = sampleRate;
+    audio_stream_type = streamType;
+    audio_type = sampleType;
+    audio_channels = channelCount;
+    audio_buffered = 0;
+    audio_started = false;
+    if (loopback) {
+        delete loop_buffer;
+        loop_buffer = new SpscAudioRing(audio_capacity, audio_type / 8 * audio_channels);
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::DisableAudioOutput() {
+    std::lock_guard<std::mutex> guard(lock);
+    drain_audio();
+    audio_enabled = false;
+    audio_buffered = 0;
+    if (loop_buffer) {
+        loop_buffer->commit_read(loop_buffer->readable());
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::WriteAudioSamplesSync(void *buffer, uint32_t sampleFrameCount, uint32_t *sampleFramesWritten) {
+    if (buffer == nullptr) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (!audio_enabled) {
+        return E_ACCESSDENIED;
+    }
+    drain_audio();
+    audio_started = true;
+    uint32_t n = std::min(sampleFrameCount, audio_capacity - audio_buffered);
+    if (n < sampleFrameCount) {
+        counters.audio_overflows++;
+    }
+    audio_buffered += n;
+    if (loop_buffer) {
+        loop_buffer->write(static_cast<const char *>(buffer), n);
+    }
+    if (sampleFramesWritten) {
+        *sampleFramesWritten = n;
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::BeginAudioPreroll() {
+    IDeckLinkAudioOutputCallback *callback;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        audio_preroll = true;
+        callback = audio_callback;
+    }
+    if (callback) {
+        callback->RenderAudioSamples(true);
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::EndAudioPreroll() {
+    std::lock_guard<std::mutex> guard(lock);
+    audio_preroll = false;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::ScheduleAudioSamples(void *buffer, uint32_t sampleFrameCount, BMDTimeValue, BMDTimeScale,
+                                                uint32_t *sampleFramesWritten) {
+    // stream time is not modelled; samples are queued back to back
+    return WriteAudioSamplesSync(buffer, sampleFrameCount, sampleFramesWritten);
+}
+
+HRESULT SimDeckLinkOutput::GetBufferedAudioSampleFrameCount(uint32_t *bufferedSampleFrameCount) {
+    std::lock_guard<std::mutex> guard(lock);
+    drain_audio();
+    *bufferedSampleFrameCount = audio_buffered;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::FlushBufferedAudioSamples() {
+    std::lock_guard<std::mutex> guard(lock);
+    drain_audio();
+    audio_buffered = 0;
+    if (loop_buffer) {
+        loop_buffer->commit_read(loop_buffer->readable());
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::SetAudioCallback(IDeckLinkAudioOutputCallback *theCallback) {
+    std::lock_guard<std::mutex> guard(lock);
+    audio_callback = theCallback;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::StartScheduledPlayback(BMDTimeValue playbackStartTime, BMDTimeScale scale, double) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!running || playback_running || scale <= 0) {
+        return E_ACCESSDENIED;
+    }
+    drain_audio();
+    playback_running = true;
+    audio_preroll = false;
+    stop_pending = false;
+    playback_start_time = playbackStartTime * mode->timeScale / scale;
+    playback_start_index = frame_index + 1;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime, BMDTimeValue *actualStopTime,
+                                                 BMDTimeScale scale) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!playback_running) {
+        return E_ACCESSDENIED;
+    }
+    BMDTimeValue current = playback_start_time + (frame_index - playback_start_index) * mode->timeValue;
+    stop_time = stopPlaybackAtTime == 0 ? current : stopPlaybackAtTime * mode->timeScale / scale;
+    stop_pending = true;
+    if (actualStopTime) {
+        *actualStopTime = stop_time * scale / mode->timeScale;
+    }
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::IsScheduledPlaybackRunning(bool *active) {
+    std::lock_guard<std::mutex> guard(lock);
+    *active = playback_running;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::GetScheduledStreamTime(BMDTimeScale desiredTimeScale, BMDTimeValue *streamTime,
+                                                  double *playbackSpeed) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!playback_running) {
+        *streamTime = 0;
+        *playbackSpeed = 0.0;
+        return S_OK;
+    }
+    BMDTimeValue t = playback_start_time + (frame_index - playback_start_index) * mode->timeValue;
+    *streamTime = t * desiredTimeScale / mode->timeScale;
+    *playbackSpeed = 1.0;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::GetReferenceStatus(BMDReferenceStatus *referenceStatus) {
+    *referenceStatus = 0;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkOutput::GetHardwareReferenceClock(BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime,
+                                                     BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame) {
+    if (desiredTimeScale <= 0) {
+        return E_INVALIDARG;
+    }
+    int64_t card = card_ns();
+    int64_t jitter = jitter_ns.load(std::memory_order_relaxed);
+    if (jitter > 0) {
+        thread_local uint64_t state = 0x9e3779b97f4a7c15ull ^ (uint64_t) (uintptr_t) &state;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        card = std::max<int64_t>(card + (int64_t) (state % (2 * jitter + 1)) - jitter, 0);
+    }
+    BMDTimeValue t = ns_to_ticks(card, desiredTimeScale);
+    BMDTimeValue per_frame = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (mode) {
+            per_frame = mode->timeValue * desiredTimeScale / mode->timeScale;
+        }
+    }
+    *hardwareTime = t;
+    *ticksPerFrame = per_frame;
+    *timeInFrame = per_frame ? t % per_frame : 0;
+    return S_OK;
+}
+
+SimOutputStats SimDeckLinkOutput::stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+}
+
+void SimDeckLinkOutput::set_loopback(SimDeckLinkInput *input) {
+    std::lock_guard<std::mutex> guard(lock);
+    drain_audio(); // so the loopback starts with what is played from now on
+    loopback = input;
+    delete loop_buffer;
+    loop_buffer = nullptr;
+    loop_audio.clear();
+    if (input) {
+        // what is buffered already was never copied, so it goes out to the loopback as silence
+        loop_buffer = new SpscAudioRing(audio_capacity, audio_type / 8 * audio_channels);
+        std::vector<char> silence((size_t) audio_buffered * loop_buffer->bytes_per_frame());
+        loop_buffer->write(silence.data(), audio_buffered);
+    }
+}
+
+void SimDeckLinkOutput::put_on_air(IDeckLinkVideoFrame *frame) {
+    if (frame) {
+        frame->AddRef();
+    }
+    if (on_air) {
+        on_air->Release();
+    }
+    on_air = frame;
+}
+
+void SimDeckLinkOutput::run() {
+    std::vector<Completion> completions;
+    std::unique_lock<std::mutex> guard(lock);
+    while (running) {
+        int64_t next_ns = epoch_ns + host_ns(ticks_to_ns((frame_index + 1) * mode->timeValue, mode->timeScale));
+        auto deadline = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next_ns));
+        wake.wait_until(guard, deadline, [this] { return !running; });
+        if (!running) {
+            break;
+        }
+        frame_index++;
+        // the loopback gets the frame that was on the wire for the period that just ended, before tick() replaces it
+        IDeckLinkVideoFrame *captured = on_air;
+        if (captured) {
+            captured->AddRef();
+        }
+        bool was_running = playback_running;
+        tick(completions);
+        bool stopped = was_running && !playback_running;
+        bool preroll = audio_preroll;
+        bool render = audio_enabled && (playback_running || preroll);
+        IDeckLinkVideoOutputCallback *vcb = video_callback;
+        IDeckLinkAudioOutputCallback *acb = audio_callback;
+        SimDeckLinkInput *input = loopback;
+        BMDAudioSampleType type = audio_type;
+        uint32_t channels = audio_channels;
+        loop_capture.swap(loop_audio);
+        loop_audio.clear();
+        guard.unlock();
+
+        if (input) {
+            input->deliver(captured, loop_capture.data(), (uint32_t) (loop_capture.size() / (type / 8 * channels)),
+                           type, channels);
+        }
+        if (captured) {
+            captured->Release();
+        }
+
+        for (Completion &c : completions) {
+            if (vcb) {
+                vcb->ScheduledFrameCompleted(c.frame, c.result);
+            }
+            c.frame->Release();
+        }
+        completions.clear();
+        if (stopped && vcb) {
+            vcb->ScheduledPlaybackHasStopped();
+        }
+        if (render && acb) {
+            acb->RenderAudioSamples(preroll);
+        }
+        guard.lock();
+    }
+}
+
+void SimDeckLinkOutput::tick(std::vector<Completion> &completions) {
+    counters.frames_ticked++;
+
+    if (playback_running) {
+        BMDTimeValue now = playback_start_time + (frame_index - playback_start_index) * mode->timeValue;
+        IDeckLinkVideoFrame *shown = nullptr;
+        IDeckLinkVideoFrame *late = nullptr;
+        while (!scheduled.empty() && scheduled.front().displayTime <= now) {
+            Scheduled s = scheduled.front();
+            scheduled.pop_front();
+            if (s.displayTime == now) {
+                shown = s.frame;
+                continue;
+            }
+            if (late) {
+                counters.frames_dropped++;
+                completions.push_back(Completion{late, bmdOutputFrameDropped});
+            }
+            late = s.frame;
+        }
+        if (shown) {
+            if (late) {
+                counters.frames_dropped++;
+                completions.push_back(Completion{late, bmdOutputFrameDropped});
+            }
+            counters.frames_displayed++;
+            put_on_air(shown);
+            completions.push_back(Completion{shown, bmdOutputFrameCompleted});
+        } else if (late) {
+            counters.frames_late++;
+            put_on_air(late);
+            completions.push_back(Completion{late, bmdOutputFrameDisplayedLate});
+        } else {
+            counters.video_underruns++;
+        }
+        if (stop_pending && now >= stop_time) {
+            for (Scheduled &s : scheduled) {
+                completions.push_back(Completion{s.frame, bmdOutputFrameFlushed});
+            }
+            scheduled.clear();
+            playback_running = false;
+            stop_pending = false;
+        }
+    } else if (sync_frame_pending) {
+        counters.frames_displayed++;
+        put_on_air(sync_frame);
+        sync_frame_pending = false;
+    }
+
+    drain_audio();
+}
+
+void SimDeckLinkOutput::drain_audio() {
+    int64_t now = ns_to_ticks(card_ns(), audio_sample_rate);
+    bool draining = audio_enabled && (audio_stream_type == bmdAudioOutputStreamContinuous ? audio_started
+                                                                                          : playback_running);
+    int64_t due = now - audio_clock;
+    audio_clock = now;
+    if (due <= 0) {
+        return;
+    }
+    uint32_t played = 0;
+    if (draining) {
+        played = (uint32_t) std::min<int64_t>(audio_buffered, due);
+        audio_buffered -= played;
+        counters.audio_samples_played += played;
+        if (played == due) {
+            audio_starved = false;
+        }
+        else if (!audio_starved) {
+            counters.audio_underflows++;
+            audio_starved = true;
+        }
+    }
+    if (loopback) {
+        loop_audio_played(played, (uint32_t) (due - played));
+    }
+}
+
+void SimDeckLinkOutput::loop_audio_played(uint32_t played, uint32_t silent) {
+    uint32_t frame_bytes = audio_type / 8 * audio_channels;
+    size_t at = loop_audio.size();
+    loop_audio.resize(at + (size_t) (played + silent) * frame_bytes);
+    SpscAudioRing::Spans s = loop_buffer->read_spans(played);
+    memcpy(&loop_audio[at], s.first, (size_t) s.first_frames * frame_bytes);
+    if (s.second_frames) {
+        memcpy(&loop_audio[at + (size_t) s.first_frames * frame_bytes], s.second, (size_t) s.second_frames * frame_bytes);
+    }
+    loop_buffer->commit_read(s.frames());
+    // resize() has zeroed the rest
+}
+
+/// A captured frame: a copy of the frame that was on air, since the output goes on drawing into its own.
+class SimVideoInputFrame : public IDeckLinkVideoInputFrame {
+public:
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override {
+        if (same_iid(iid, IID_IDeckLinkVideoFrame)) {
+            *ppv = static_cast<IDeckLinkVideoFrame *>(this);
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    // owned by the SimDeckLinkInput
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+    long GetWidth() override { return width; }
+    long GetHeight() override { return height; }
+    long GetRowBytes() override { return rowBytes; }
+    BMDPixelFormat GetPixelFormat() override { return pixelFormat; }
+    BMDFrameFlags GetFlags() override { return 0; }
+    HRESULT GetBytes(void **buffer) override {
+        *buffer = bytes.data();
+        return S_OK;
+    }
+    HRESULT GetTimecode(BMDTimecodeFormat, IDeckLinkTimecode **) override { return S_FALSE; }
+    HRESULT GetAncillaryData(IDeckLinkVideoFrameAncillary **) override { return S_FALSE; }
+
+    HRESULT GetStreamTime(BMDTimeValue *frameTime, BMDTimeValue *frameDuration, BMDTimeScale timeScale) override {
+        *frameTime = index * timeValue * timeScale / modeScale;
+        *frameDuration = timeValue * timeScale / modeScale;
+        return S_OK;
+    }
+    HRESULT GetHardwareReferenceTimestamp(BMDTimeScale timeScale, BMDTimeValue *frameTime,
+                                          BMDTimeValue *frameDuration) override {
+        return GetStreamTime(frameTime, frameDuration, timeScale);
+    }
+
+    void copy(IDeckLinkVideoFrame *from, int64_t frame_index, BMDTimeValue mode_value, BMDTimeScale mode_scale) {
+        width = from->GetWidth();
+        height = from->GetHeight();
+        rowBytes = from->GetRowBytes();
+        pixelFormat = from->GetPixelFormat();
+        void *src = nullptr;
+        from->GetBytes(&src);
+        bytes.resize((size_t) rowBytes * height);
+        memcpy(bytes.data(), src, bytes.size());
+        index = frame_index;
+        timeValue = mode_value;
+        modeScale = mode_scale;
+    }
+
+private:
+    long width = 0;
+    long height = 0;
+    long rowBytes = 0;
+    BMDPixelFormat pixelFormat = bmdFormat8BitYUV;
+    std::vector<uint8_t> bytes;
+    int64_t index = 0;
+    BMDTimeValue timeValue = 1000;
+    BMDTimeScale modeScale = 25000;
+};
+
+class SimAudioInputPacket : public IDeckLinkAudioInputPacket {
+public:
+    HRESULT QueryInterface(REFIID, LPVOID *ppv) override {
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+    long GetSampleFrameCount() override { return frames; }
+    HRESULT GetBytes(void **buffer) override {
+        *buffer = data;
+        return S_OK;
+    }
+    HRESULT GetPacketTime(BMDTimeValue *packetTime, BMDTimeScale timeScale) override {
+        *packetTime = (BMDTimeValue) (first_sample * timeScale / 48000);
+        return S_OK;
+    }
+
+    void *data = nullptr;
+    long frames = 0;
+    uint64_t first_sample = 0; // since StartStreams
+};
+
+SimDeckLinkInput::SimDeckLinkInput(SimDeckLinkOutput *output)
+    : output(output), video_frame(new SimVideoInputFrame()), audio_packet(new SimAudioInputPacket()) {
+    output->AddRef();
+}
+
+SimDeckLinkInput::~SimDeckLinkInput() {
+    StopStreams();
+    delete video_frame;
+    delete audio_packet;
+    output->Release();
+}
+
+HRESULT SimDeckLinkInput::QueryInterface(REFIID iid, LPVOID *ppv) {
+    if (same_iid(iid, IID_IDeckLinkInput)) {
+        AddRef();
+        *ppv = static_cast<IDeckLinkInput *>(this);
+        return S_OK;
+    }
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG SimDeckLinkInput::AddRef() {
+    return ++refs;
+}
+
+ULONG SimDeckLinkInput::Release() {
+    ULONG r = --refs;
+    if (r == 0) {
+        delete this;
+    }
+    return r;
+}
+
+HRESULT SimDeckLinkInput::DoesSupportVideoMode(BMDVideoConnection connection, BMDDisplayMode requestedMode,
+                                               BMDPixelFormat requestedPixelFormat, BMDVideoInputConversionMode,
+                                               BMDSupportedVideoModeFlags flags, BMDDisplayMode *actualMode,
+                                               bool *supported) {
+    return output->DoesSupportVideoMode(connection, requestedMode, requestedPixelFormat, 0, flags, actualMode, supported);
+}
+
+HRESULT SimDeckLinkInput::GetDisplayMode(BMDDisplayMode displayMode, IDeckLinkDisplayMode **resultDisplayMode) {
+    return output->GetDisplayMode(displayMode, resultDisplayMode);
+}
+
+HRESULT SimDeckLinkInput::GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator) {
+    return output->GetDisplayModeIterator(iterator);
+}
+
+HRESULT SimDeckLinkInput::EnableVideoInput(BMDDisplayMode displayMode, BMDPixelFormat, BMDVideoInputFlags) {
+    IDeckLinkDisplayMode *m = nullptr;
+    if (GetDisplayMode(displayMode, &m) != S_OK) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    video_enabled = true;
+    // whatever the output sends is what comes back; the mode only sets the stream time base
+    mode = static_cast<SimDisplayMode *>(m);
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::DisableVideoInput() {
+    std::lock_guard<std::mutex> guard(lock);
+    video_enabled = false;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::GetAvailableVideoFrameCount(uint32_t *availableFrameCount) {
+    *availableFrameCount = 0; // frames are only ever handed to the callback
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::EnableAudioInput(BMDAudioSampleRate, BMDAudioSampleType sampleType, uint32_t channelCount) {
+    if ((sampleType != bmdAudioSampleType16bitInteger && sampleType != bmdAudioSampleType32bitInteger) ||
+        channelCount == 0 || channelCount > 64) {
+        return E_INVALIDARG;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    audio_enabled = true;
+    audio_type = sampleType;
+    audio_channels = channelCount;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::DisableAudioInput() {
+    std::lock_guard<std::mutex> guard(lock);
+    audio_enabled = false;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::GetAvailableAudioSampleFrameCount(uint32_t *availableSampleFrameCount) {
+    *availableSampleFrameCount = 0;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::StartStreams() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frames_captured = 0;
+        samples_captured = 0;
+    }
+    output->set_loopback(this);
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::StopStreams() {
+    output->set_loopback(nullptr);
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::SetCallback(IDeckLinkInputCallback *theCallback) {
+    std::lock_guard<std::mutex> guard(lock);
+    callback = theCallback;
+    return S_OK;
+}
+
+HRESULT SimDeckLinkInput::GetHardwareReferenceClock(BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime,
+                                                    BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame) {
+    return output->GetHardwareReferenceClock(desiredTimeScale, hardwareTime, timeInFrame, ticksPerFrame);
+}
+
+void SimDeckLinkInput::deliver(IDeckLinkVideoFrame *video, const char *played, uint32_t played_frames,
+                               BMDAudioSampleType played_type, uint32_t played_channels) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!callback) {
+        return;
+    }
+    SimVideoInputFrame *frame = nullptr;
+    if (video_enabled && video && mode) {
+        video_frame->copy(video, frames_captured, mode->timeValue, mode->timeScale);
+        frame = video_frame;
+    }
+    SimAudioInputPacket *packet = nullptr;
+    if (audio_enabled) {
+        // channel by channel, as the card would de-embed them: missing ones are silent, widths are shifted
+        uint32_t in_bytes = played_type / 8, out_bytes = audio_type / 8;
+        audio.assign((size_t) played_frames * audio_channels * out_bytes, 0);
+        uint32_t channels = std::min(played_channels, audio_channels);
+        for (uint32_t f = 0; f < played_frames; ++f) {
+            const char *in = played + (size_t) f * played_channels * in_bytes;
+            char *out = &audio[(size_t) f * audio_channels * out_bytes];
+            for (uint32_t c = 0; c < channels; ++c) {
+                int32_t v = 0;
+                if (in_bytes == 2) {
+                    int16_t x;
+                    memcpy(&x, in + c * 2, 2);
+                    v = (int32_t) x * 65536;
+                }
+                else {
+                    memcpy(&v, in + c * 4, 4);
+                }
+                if (out_bytes == 2) {
+                    int16_t x = (int16_t) (v >> 16);
+                    memcpy(out + c * 2, &x, 2);
+                }
+                else {
+                    memcpy(out + c * 4, &v, 4);
+                }
+            }
+        }
+        audio_packet->data = audio.data();
+        audio_packet->frames = played_frames;
+        audio_packet->first_sample = samples_captured;
+        packet = audio_packet;
+    }
+    frames_captured++;
+    samples_captured += played_frames;
+    callback->VideoInputFrameArrived(frame, packet);
+}
+
+SimDeckLink::SimDeckLink(SimDeckLinkOutput *output) : output(output) {
+}
+
+SimDeckLink::~SimDeckLink() {
+    if (input) {
+        input->Release();
+    }
+    output->Release();
+}
+
+HRESULT SimDeckLink::QueryInterface(REFIID iid, LPVOID *ppv) {
+    if (same_iid(iid, IID_IDeckLinkOutput)) {
+        return output->QueryInterface(iid, ppv);
+    }
+    if (same_iid(iid, IID_IDeckLinkInput)) {
+        if (!input) {
+            input = new SimDeckLinkInput(output);
+        }
+        return input->QueryInterface(iid, ppv);
+    }
+    if (same_iid(iid, IID_IDeckLink)) {
+        AddRef();
+        *ppv = static_cast<IDeckLink *>(this);
+        return S_OK;
+    }
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG SimDeckLink::AddRef() {
+    return ++refs;
+}
+
+ULONG SimDeckLink::Release() {
+    ULONG r = --refs;
+    if (r == 0) {
+        delete this;
+    }
+    return r;
+}
+
+HRESULT SimDeckLink::GetModelName(const char **modelName) {
+    *modelName = "Simulated DeckLink";
+    return S_OK;
+}
+
+HRESULT SimDeckLink::GetDisplayName(const char **displayName) {
+    *displayName = "Simulated DeckLink (1)";
+    return S_OK;
+}
+
+SimDeckLinkIterator::SimDeckLinkIterator(SimDeckLink *device) : device(device) {
+    device->AddRef();
+}
+
+SimDeckLinkIterator::~SimDeckLinkIterator() {
+    device->Release();
+}
+
+HRESULT SimDeckLinkIterator::QueryInterface(REFIID, LPVOID *ppv) {
+    *ppv = nullptr;
+    return E_NOINTERFACE;
+}
+
+ULONG SimDeckLinkIterator::AddRef() {
+    return ++refs;
+}
+
+ULONG SimDeckLinkIterator::Release() {
+    ULONG r = --refs;
+    if (r == 0) {
+        delete this;
+    }
+    return r;
+}
+
+HRESULT SimDeckLinkIterator::Next(IDeckLink **deckLinkInstance) {
+    if (done) {
+        *deckLinkInstance = nullptr;
+        return S_FALSE;
+    }
+    done = true;
+    device->AddRef();
+    *deckLinkInstance = device;
+    return S_OK;
+}
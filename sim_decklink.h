@@ -0,0 +1,316 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+#include "spsc_ring.h"
+
+class SimDeckLinkInput;
+class SimVideoInputFrame;
+class SimAudioInputPacket;
+
+/// Local stand-in for a DeckLink output so playout code can be run without a card.
+/// The frame clock is driven by a worker thread at the display mode's rate.
+
+class SimDisplayMode : public IDeckLinkDisplayMode {
+public:
+    SimDisplayMode(BMDDisplayMode mode, const char *name, long width, long height,
+                   BMDTimeValue timeValue, BMDTimeScale timeScale, BMDFieldDominance dominance);
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override { return 1; }
+    ULONG Release() override { return 1; }
+
+    HRESULT GetName(const char **name) override;
+    BMDDisplayMode GetDisplayMode() override { return mode; }
+    long GetWidth() override { return width; }
+    long GetHeight() override { return height; }
+    HRESULT GetFrameRate(BMDTimeValue *frameDuration, BMDTimeScale *scale) override;
+    BMDFieldDominance GetFieldDominance() override { return dominance; }
+    BMDDisplayModeFlags GetFlags() override { return 0; }
+
+    BMDDisplayMode mode;
+    const char *name;
+    long width;
+    long height;
+    BMDTimeValue timeValue;
+    BMDTimeScale timeScale;
+    BMDFieldDominance dominance;
+};
+
+/// @retval table of the modes every simulated device reports, owned statically
+const std::vector<SimDisplayMode *> &sim_display_modes();
+
+class SimVideoFrame : public IDeckLinkMutableVideoFrame {
+public:
+    SimVideoFrame(long width, long height, long rowBytes, BMDPixelFormat pixelFormat, BMDFrameFlags flags);
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override;
+    ULONG Release() override;
+
+    long GetWidth() override { return width; }
+    long GetHeight() override { return height; }
+    long GetRowBytes() override { return rowBytes; }
+    BMDPixelFormat GetPixelFormat() override { return pixelFormat; }
+    BMDFrameFlags GetFlags() override { return flags; }
+    HRESULT GetBytes(void **buffer) override;
+    HRESULT GetTimecode(BMDTimecodeFormat, IDeckLinkTimecode **) override { return S_FALSE; }
+    HRESULT GetAncillaryData(IDeckLinkVideoFrameAncillary **) override { return S_FALSE; }
+
+    HRESULT SetFlags(BMDFrameFlags newFlags) override;
+    HRESULT SetTimecode(BMDTimecodeFormat, IDeckLinkTimecode *) override { return E_NOTIMPL; }
+    HRESULT SetTimecodeFromComponents(BMDTimecodeFormat, uint8_t, uint8_t, uint8_t, uint8_t, BMDTimecodeFlags) override { return E_NOTIMPL; }
+    HRESULT SetAncillaryData(IDeckLinkVideoFrameAncillary *) override { return E_NOTIMPL; }
+    HRESULT SetTimecodeUserBits(BMDTimecodeFormat, BMDTimecodeUserBits) override { return E_NOTIMPL; }
+
+private:
+    std::atomic<ULONG> refs{1};
+    long width;
+    long height;
+    long rowBytes;
+    BMDPixelFormat pixelFormat;
+    BMDFrameFlags flags;
+    std::vector<uint8_t> bytes;
+};
+
+/// Counters the simulated card keeps about what actually went out on the wire.
+struct SimOutputStats {
+    long frames_ticked = 0;
+    long frames_displayed = 0;
+    long frames_late = 0;
+    long frames_dropped = 0;
+    long video_underruns = 0;
+    long audio_underflows = 0;
+    long audio_overflows = 0;
+    uint64_t audio_samples_played = 0;
+};
+
+class SimDeckLinkOutput : public IDeckLinkOutput {
+public:
+    explicit SimDeckLinkOutput(uint32_t audio_capacity = 48000);
+    ~SimDeckLinkOutput() override;
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override;
+    ULONG Release() override;
+
+    HRESULT DoesSupportVideoMode(BMDVideoConnection, BMDDisplayMode, BMDPixelFormat, BMDVideoOutputConversionMode,
+                                 BMDSupportedVideoModeFlags, BMDDisplayMode *, bool *) override;
+    HRESULT GetDisplayMode(BMDDisplayMode displayMode, IDeckLinkDisplayMode **resultDisplayMode) override;
+    HRESULT GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator) override;
+    HRESULT SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *) override { return E_NOTIMPL; }
+
+    HRESULT EnableVideoOutput(BMDDisplayMode displayMode, BMDVideoOutputFlags flags) override;
+    HRESULT DisableVideoOutput() override;
+    HRESULT SetVideoOutputFrameMemoryAllocator(IDeckLinkMemoryAllocator *) override { return E_NOTIMPL; }
+    HRESULT CreateVideoFrame(int32_t width, int32_t height, int32_t rowBytes, BMDPixelFormat pixelFormat,
+                             BMDFrameFlags flags, IDeckLinkMutableVideoFrame **outFrame) override;
+    HRESULT CreateAncillaryData(BMDPixelFormat, IDeckLinkVideoFrameAncillary **) override { return E_NOTIMPL; }
+    HRESULT DisplayVideoFrameSync(IDeckLinkVideoFrame *theFrame) override;
+    HRESULT ScheduleVideoFrame(IDeckLinkVideoFrame *theFrame, BMDTimeValue displayTime, BMDTimeValue displayDuration,
+                               BMDTimeScale scale) override;
+    HRESULT SetScheduledFrameCompletionCallback(IDeckLinkVideoOutputCallback *theCallback) override;
+    HRESULT GetBufferedVideoFrameCount(uint32_t *bufferedFrameCount) override;
+
+    HRESULT EnableAudioOutput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType, uint32_t channelCount,
+                              BMDAudioOutputStreamType streamType) override;
+    HRESULT DisableAudioOutput() override;
+    HRESULT WriteAudioSamplesSync(void *buffer, uint32_t sampleFrameCount, uint32_t *sampleFramesWritten) override;
+    HRESULT BeginAudioPreroll() override;
+    HRESULT EndAudioPreroll() override;
+    HRESULT ScheduleAudioSamples(void *buffer, uint32_t sampleFrameCount, BMDTimeValue streamTime, BMDTimeScale scale,
+                                 uint32_t *sampleFramesWritten) override;
+    HRESULT GetBufferedAudioSampleFrameCount(uint32_t *bufferedSampleFrameCount) override;
+    HRESULT FlushBufferedAudioSamples() override;
+    HRESULT SetAudioCallback(IDeckLinkAudioOutputCallback *theCallback) override;
+
+    HRESULT StartScheduledPlayback(BMDTimeValue playbackStartTime, BMDTimeScale scale, double playbackSpeed) override;
+    HRESULT StopScheduledPlayback(BMDTimeValue stopPlaybackAtTime, BMDTimeValue *actualStopTime, BMDTimeScale scale) override;
+    HRESULT IsScheduledPlaybackRunning(bool *active) override;
+    HRESULT GetScheduledStreamTime(BMDTimeScale desiredTimeScale, BMDTimeValue *streamTime, double *playbackSpeed) override;
+    HRESULT GetReferenceStatus(BMDReferenceStatus *referenceStatus) override;
+
+    HRESULT GetHardwareReferenceClock(BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime,
+                                      BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame) override;
+    HRESULT GetFrameCompletionReferenceTimestamp(IDeckLinkVideoFrame *, BMDTimeScale, BMDTimeValue *) override { return E_NOTIMPL; }
+
+    SimOutputStats stats();
+
+    /// Runs the card's clock fast (ppm > 0) or slow against the host's steady clock.
+    void set_clock_skew(double ppm);
+
+    /// Adds uniform noise of up to +-ns to every GetHardwareReferenceClock reading, as bus latency would.
+    void set_clock_jitter(int64_t ns);
+
+    /// Feeds input, or nobody for nullptr, what goes out on the wire: at every frame tick, the video frame that was
+    /// on air for the frame period just ended and the audio played during it, silence where the buffer ran dry.
+    void set_loopback(SimDeckLinkInput *input);
+
+private:
+    struct Scheduled {
+        IDeckLinkVideoFrame *frame;
+        BMDTimeValue displayTime; // in mode time scale
+    };
+    struct Completion {
+        IDeckLinkVideoFrame *frame;
+        BMDOutputFrameCompletionResult result;
+    };
+
+    void run();
+    void tick(std::vector<Completion> &completions);
+    int64_t now_ns();
+    /// @retval ns elapsed on the card's clock since epoch_ns
+    int64_t card_ns();
+    /// @retval host ns since epoch_ns at which the card's clock reads card
+    int64_t host_ns(int64_t card);
+    /// Plays out the audio due on the card's clock since the last call; lock must be held.
+    void drain_audio();
+    /// Appends played sample frames from the loopback copy of the buffer, then silent ones; lock must be held.
+    void loop_audio_played(uint32_t played, uint32_t silent);
+    /// The frame now on the wire; lock must be held.
+    void put_on_air(IDeckLinkVideoFrame *frame);
+
+    std::atomic<ULONG> refs{1};
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread worker;
+    bool running = false;
+
+    SimDisplayMode *mode = nullptr;
+    int64_t epoch_ns = 0;
+    std::atomic<double> skew_ppm{0.0};
+    std::atomic<int64_t> jitter_ns{0};
+    int64_t frame_index = 0;
+
+    std::deque<Scheduled> scheduled;
+    IDeckLinkVideoOutputCallback *video_callback = nullptr;
+    IDeckLinkAudioOutputCallback *audio_callback = nullptr;
+    bool playback_running = false;
+    bool stop_pending = false;
+    BMDTimeValue stop_time = 0;
+    int64_t playback_start_index = 0;
+    BMDTimeValue playback_start_time = 0;
+    bool sync_frame_pending = false;
+    IDeckLinkVideoFrame *sync_frame = nullptr; // the last DisplayVideoFrameSync frame, held until it goes out
+    IDeckLinkVideoFrame *on_air = nullptr;
+
+    bool audio_enabled = false;
+    bool audio_preroll = false;
+    BMDAudioOutputStreamType audio_stream_type = bmdAudioOutputStreamContinuous;
+    uint32_t audio_sample_rate = 48000;
+    uint32_t audio_capacity;
+    uint32_t audio_buffered = 0;
+    bool audio_started = false;
+    BMDAudioSampleType audio_type = bmdAudioSampleType16bitInteger;
+    uint32_t audio_channels = 2;
+    bool audio_starved = false;
+    int64_t audio_clock = 0; // card time in samples when the buffer was last drained
+
+    // loopback: a copy of the buffered samples, and what was played since the last tick
+    SimDeckLinkInput *loopback = nullptr;
+    SpscAudioRing *loop_buffer = nullptr;
+    std::vector<char> loop_audio;
+    std::vector<char> loop_capture; // the worker's, swapped with loop_audio at each tick
+
+    SimOutputStats counters;
+};
+
+/// Loopback input: captures what a SimDeckLinkOutput puts on the wire, as a cable from its output back into an input
+/// would. After StartStreams, VideoInputFrameArrived is called from the output's frame thread once a frame with the
+/// frame that was on air and the audio played under it, in the format EnableAudioInput asked for: extra channels are
+/// silent, and 16 and 32 bit are converted by shifting. Video is nullptr while nothing has been displayed yet.
+class SimDeckLinkInput : public IDeckLinkInput {
+public:
+    explicit SimDeckLinkInput(SimDeckLinkOutput *output);
+    ~SimDeckLinkInput() override;
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override;
+    ULONG Release() override;
+
+    HRESULT DoesSupportVideoMode(BMDVideoConnection connection, BMDDisplayMode requestedMode,
+                                 BMDPixelFormat requestedPixelFormat, BMDVideoInputConversionMode,
+                                 BMDSupportedVideoModeFlags flags, BMDDisplayMode *actualMode, bool *supported) override;
+    HRESULT GetDisplayMode(BMDDisplayMode displayMode, IDeckLinkDisplayMode **resultDisplayMode) override;
+    HRESULT GetDisplayModeIterator(IDeckLinkDisplayModeIterator **iterator) override;
+    HRESULT SetScreenPreviewCallback(IDeckLinkScreenPreviewCallback *) override { return E_NOTIMPL; }
+
+    HRESULT EnableVideoInput(BMDDisplayMode displayMode, BMDPixelFormat pixelFormat, BMDVideoInputFlags flags) override;
+    HRESULT DisableVideoInput() override;
+    HRESULT GetAvailableVideoFrameCount(uint32_t *availableFrameCount) override;
+    HRESULT SetVideoInputFrameMemoryAllocator(IDeckLinkMemoryAllocator *) override { return E_NOTIMPL; }
+    HRESULT EnableAudioInput(BMDAudioSampleRate sampleRate, BMDAudioSampleType sampleType, uint32_t channelCount) override;
+    HRESULT DisableAudioInput() override;
+    HRESULT GetAvailableAudioSampleFrameCount(uint32_t *availableSampleFrameCount) override;
+    HRESULT StartStreams() override;
+    HRESULT StopStreams() override;
+    HRESULT PauseStreams() override { return S_OK; }
+    HRESULT FlushStreams() override { return S_OK; }
+    HRESULT SetCallback(IDeckLinkInputCallback *theCallback) override;
+    HRESULT GetHardwareReferenceClock(BMDTimeScale desiredTimeScale, BMDTimeValue *hardwareTime,
+                                      BMDTimeValue *timeInFrame, BMDTimeValue *ticksPerFrame) override;
+
+    /// From the output's frame thread: one frame period of what it sent, audio as the output was enabled.
+    void deliver(IDeckLinkVideoFrame *video, const char *played, uint32_t played_frames, BMDAudioSampleType played_type,
+                 uint32_t played_channels);
+
+private:
+    std::atomic<ULONG> refs{1};
+    SimDeckLinkOutput *output;
+    std::mutex lock;
+    IDeckLinkInputCallback *callback = nullptr;
+    SimDisplayMode *mode = nullptr;
+    SimVideoInputFrame *video_frame; // both reused for every frame
+    SimAudioInputPacket *audio_packet;
+    bool video_enabled = false;
+    bool audio_enabled = false;
+    BMDAudioSampleType audio_type = bmdAudioSampleType16bitInteger;
+    uint32_t audio_channels = 2;
+    std::vector<char> audio; // converted
+    int64_t frames_captured = 0;
+    uint64_t samples_captured = 0;
+};
+
+/// The single device a SimDeckLinkIterator hands out; QueryInterface(IID_IDeckLinkOutput) gives its output and
+/// QueryInterface(IID_IDeckLinkInput) a SimDeckLinkInput looped back from it.
+class SimDeckLink : public IDeckLink {
+public:
+    explicit SimDeckLink(SimDeckLinkOutput *output);
+    ~SimDeckLink() override;
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override;
+    ULONG Release() override;
+
+    HRESULT GetModelName(const char **modelName) override;
+    HRESULT GetDisplayName(const char **displayName) override;
+
+private:
+    std::atomic<ULONG> refs{1};
+    SimDeckLinkOutput *output;
+    SimDeckLinkInput *input = nullptr;
+};
+
+class SimDeckLinkIterator : public IDeckLinkIterator {
+public:
+    explicit SimDeckLinkIterator(SimDeckLink *device);
+    ~SimDeckLinkIterator() override;
+
+    HRESULT QueryInterface(REFIID iid, LPVOID *ppv) override;
+    ULONG AddRef() override;
+    ULONG Release() override;
+
+    HRESULT Next(IDeckLink **deckLinkInstance) override;
+
+private:
+    std::atomic<ULONG> refs{1};
+    SimDeckLink *device;
+    bool done = false;
+};
@@ -0,0 +1,167 @@
+// Stand-in for the SDK's DeckLinkAPIDispatch.cpp: link this and sim_decklink.cpp instead of it (plus -ldl) and the
+// unmodified programs find one simulated card. Configured from the environment:
+//   SIM_DECKLINK_SPEED=<x>          run the process's clocks x times faster than real time (default 1)
+//   SIM_DECKLINK_SKEW_PPM=<ppm>     card clock fast (> 0) or slow against the host
+//   SIM_DECKLINK_JITTER_NS=<ns>     uniform noise on each GetHardwareReferenceClock reading
+//   SIM_DECKLINK_AUDIO_CAPACITY=<n> card audio buffer in sample frames (default 48000)
+//   SIM_DECKLINK_STOP_AFTER=<s>     after s seconds of simulated time print what the card saw and exit, with
+//                                   status 2 if audio underflowed or any frame was dropped or late
+//
+// The speed up works by interposing clock_gettime, clock_nanosleep, nanosleep and pthread_cond_clockwait, which is
+// what std::chrono clocks, sleep_for, steady_clock condition variable waits and FramePacer all go through: the
+// REALTIME, MONOTONIC and BOOTTIME clocks read x times faster and sleeps are x times shorter. Spin loops, pacers and
+// the simulated card then all agree on one virtual timeline. Thread CPU time clocks are left alone.
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <thread>
+
+#include "DeckLinkAPI.h"
+#include "sim_decklink.h"
+
+namespace {
+
+struct VirtualClock {
+    int (*real_gettime)(clockid_t, timespec *);
+    int (*real_clock_nanosleep)(clockid_t, int, const timespec *, timespec *);
+    int (*real_nanosleep)(const timespec *, timespec *);
+    int (*real_cond_clockwait)(pthread_cond_t *, pthread_mutex_t *, clockid_t, const timespec *);
+    long double speed = 1.0;
+    int64_t base[8] = {}; // real time, per clock, at which virtual and real time agreed
+
+    VirtualClock() {
+        real_gettime = (decltype(real_gettime)) dlsym(RTLD_NEXT, "clock_gettime");
+        real_clock_nanosleep = (decltype(real_clock_nanosleep)) dlsym(RTLD_NEXT, "clock_nanosleep");
+        real_nanosleep = (decltype(real_nanosleep)) dlsym(RTLD_NEXT, "nanosleep");
+        real_cond_clockwait = (decltype(real_cond_clockwait)) dlsym(RTLD_NEXT, "pthread_cond_clockwait");
+        if (const char *s = getenv("SIM_DECKLINK_SPEED")) {
+            speed = std::max(atof(s), 0.001);
+        }
+        for (clockid_t id = 0; id < 8; ++id) {
+            timespec ts;
+            if (scaled(id) && real_gettime(id, &ts) == 0) {
+                base[id] = to_ns(ts);
+            }
+        }
+    }
+
+    static bool scaled(clockid_t id) {
+        return id == CLOCK_REALTIME || id == CLOCK_MONOTONIC || id == CLOCK_MONOTONIC_RAW ||
+               id == CLOCK_REALTIME_COARSE || id == CLOCK_MONOTONIC_COARSE || id == CLOCK_BOOTTIME;
+    }
+
+    bool active(clockid_t id) const { return speed != 1.0 && scaled(id); }
+
+    static int64_t to_ns(const timespec &ts) { return ts.tv_sec * 1000000000ll + ts.tv_nsec; }
+
+    static timespec to_timespec(int64_t ns) {
+        return timespec{(time_t) (ns / 1000000000), (long) (ns % 1000000000)};
+    }
+
+    int64_t to_virtual(clockid_t id, int64_t real) const { return base[id] + (int64_t) ((real - base[id]) * speed); }
+
+    /// rounds up, so a sleep to a virtual deadline never wakes before it
+    int64_t to_real(clockid_t id, int64_t virt) const {
+        return base[id] + (int64_t) ceill((virt - base[id]) / speed);
+    }
+
+    int64_t scale_down(int64_t ns) const { return (int64_t) ceill(ns / speed); }
+};
+
+VirtualClock &virtual_clock() {
+    static VirtualClock clock;
+    return clock;
+}
+
+long env_long(const char *name, long fallback) {
+    const char *s = getenv(name);
+    return s ? atol(s) : fallback;
+}
+
+} // namespace
+
+extern "C" int clock_gettime(clockid_t id, timespec *ts) noexcept {
+    VirtualClock &vc = virtual_clock();
+    int result = vc.real_gettime(id, ts);
+    if (result == 0 && vc.active(id)) {
+        *ts = VirtualClock::to_timespec(vc.to_virtual(id, VirtualClock::to_ns(*ts)));
+    }
+    return result;
+}
+
+extern "C" int clock_nanosleep(clockid_t id, int flags, const timespec *request, timespec *remain) {
+    VirtualClock &vc = virtual_clock();
+    if (!vc.active(id)) {
+        return vc.real_clock_nanosleep(id, flags, request, remain);
+    }
+    int64_t ns = VirtualClock::to_ns(*request);
+    timespec real = VirtualClock::to_timespec(flags & TIMER_ABSTIME ? vc.to_real(id, ns) : vc.scale_down(ns));
+    int result = vc.real_clock_nanosleep(id, flags, &real, remain);
+    if (remain && !(flags & TIMER_ABSTIME) && result == EINTR) {
+        *remain = VirtualClock::to_timespec((int64_t) (VirtualClock::to_ns(*remain) * vc.speed));
+    }
+    return result;
+}
+
+extern "C" int nanosleep(const timespec *request, timespec *remain) {
+    VirtualClock &vc = virtual_clock();
+    if (vc.speed == 1.0) {
+        return vc.real_nanosleep(request, remain);
+    }
+    timespec real = VirtualClock::to_timespec(vc.scale_down(VirtualClock::to_ns(*request)));
+    int result = vc.real_nanosleep(&real, remain);
+    if (remain && result != 0) {
+        *remain = VirtualClock::to_timespec((int64_t) (VirtualClock::to_ns(*remain) * vc.speed));
+    }
+    return result;
+}
+
+extern "C" int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t id,
+                                      const timespec *abstime) {
+    VirtualClock &vc = virtual_clock();
+    if (!vc.active(id)) {
+        return vc.real_cond_clockwait(cond, mutex, id, abstime);
+    }
+    timespec real = VirtualClock::to_timespec(vc.to_real(id, VirtualClock::to_ns(*abstime)));
+    return vc.real_cond_clockwait(cond, mutex, id, &real);
+}
+
+extern "C" IDeckLinkIterator *CreateDeckLinkIteratorInstance(void) {
+    auto *output = new SimDeckLinkOutput((uint32_t) env_long("SIM_DECKLINK_AUDIO_CAPACITY", 48000));
+    if (const char *s = getenv("SIM_DECKLINK_SKEW_PPM")) {
+        output->set_clock_skew(atof(s));
+    }
+    output->set_clock_jitter(env_long("SIM_DECKLINK_JITTER_NS", 0));
+
+    long stop_after = env_long("SIM_DECKLINK_STOP_AFTER", 0);
+    if (stop_after > 0) {
+        output->AddRef();
+        std::thread([output, stop_after] {
+            std::this_thread::sleep_for(std::chrono::seconds(stop_after)); // simulated seconds
+            SimOutputStats s = output->stats();
+            std::clog << "sim stopped after " << stop_after << " s: frames displayed " << s.frames_displayed
+                      << " late " << s.frames_late << " dropped " << s.frames_dropped << " video underruns "
+                      << s.video_underruns << " audio underflows " << s.audio_underflows << " audio overflows "
+                      << s.audio_overflows << " audio samples played " << s.audio_samples_played << std::endl;
+            // the program's own threads are still running, so leave without running destructors under them
+            _exit(s.audio_underflows || s.frames_dropped || s.frames_late ? 2 : 0);
+        }).detach();
+    }
+
+    auto *device = new SimDeckLink(output);
+    auto *iterator = new SimDeckLinkIterator(device);
+    device->Release();
+    return iterator;
+}
+
+extern "C" IDeckLinkAPIInformation *CreateDeckLinkAPIInformationInstance(void) {
+    return nullptr;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+/// Wait free single producer / single consumer ring of audio sample frames.
+///
+/// The producer thread generates or decodes ahead and the playout thread only copies out of it; neither side
+/// locks or allocates after construction. Reads and writes hand out the region as at most two contiguous spans
+/// (before and after the wrap) so they can go straight to WriteAudioSamples* or memcpy. The two indices live on
+/// their own cache lines, and each side keeps a cached copy of the other's index so it only touches the shared
+/// line when the cached value says it has run out.
+class SpscAudioRing {
+public:
+    struct Spans {
+        char *first = nullptr;
+        uint32_t first_frames = 0;
+        char *second = nullptr;
+        uint32_t second_frames = 0;
+
+        uint32_t frames() const { return first_frames + second_frames; }
+    };
+
+    /// capacity is rounded up to a power of two sample frames
+    SpscAudioRing(uint32_t capacity_frames, uint32_t frame_bytes) : frame_bytes(frame_bytes) {
+        capacity = 1;
+        while (capacity < capacity_frames) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        size_t bytes = ((size_t) capacity * frame_bytes + cache_line - 1) / cache_line * cache_line;
+        data = static_cast<char *>(aligned_alloc(cache_line, bytes));
+        memset(data, 0, bytes);
+    }
+
+    ~SpscAudioRing() { free(data); }
+
+    SpscAudioRing(const SpscAudioRing &) = delete;
+    SpscAudioRing &operator=(const SpscAudioRing &) = delete;
+
+    uint32_t capacity_frames() const { return capacity; }
+    uint32_t bytes_per_frame() const { return frame_bytes; }
+    /// @retval the storage behind the spans, e.g. to prefault or lock it
+    char *buffer() const { return data; }
+
+    // producer side
+
+    /// @retval room for up to max_frames, as one or two spans
+    Spans write_spans(uint32_t max_frames) {
+        uint64_t head = producer.index.load(std::memory_order_relaxed);
+        if (capacity - (head - producer.cached) < max_frames) {
+            producer.cached = consumer.index.load(std::memory_order_acquire);
+        }
+        uint32_t space = capacity - (uint32_t) (head - producer.cached);
+        return spans(head, max_frames < space ? max_frames : space);
+    }
+
+    /// Publishes frames written into the spans from write_spans().
+    void commit_write(uint32_t frames) {
+        producer.index.store(producer.index.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+
+    /// @retval frames copied in from src, fewer than frames if the ring is full
+    uint32_t write(const char *src, uint32_t frames) {
+        Spans s = write_spans(frames);
+        memcpy(s.first, src, (size_t) s.first_frames * frame_bytes);
+        if (s.second_frames) {
+            memcpy(s.second, src + (size_t) s.first_frames * frame_bytes, (size_t) s.second_frames * frame_bytes);
+        }
+        commit_write(s.frames());
+        return s.frames();
+    }
+
+    // consumer side
+
+    /// @retval up to max_frames of readable audio, as one or two spans
+    Spans read_spans(uint32_t max_frames) {
+        uint64_t tail = consumer.index.load(std::memory_order_relaxed);
+        if (consumer.cached - tail < max_frames) {
+            consumer.cached = producer.index.load(std::memory_order_acquire);
+        }
+        uint32_t available = (uint32_t) (consumer.cached - tail);
+        return spans(tail, max_frames < available ? max_frames : available);
+    }
+
+    /// Releases frames read from the spans from read_spans() back to the producer.
+    void commit_read(uint32_t frames) {
+        consumer.index.store(consumer.index.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+
+    /// @retval frames readable right now; only a snapshot when called from the producer
+    uint32_t readable() const {
+        return (uint32_t) (producer.index.load(std::memory_order_acquire) - consumer.index.load(std::memory_order_acquire));
+    }
+
+private:
+    static constexpr size_t cache_line = 64;
+
+    Spans spans(uint64_t index, uint32_t frames) const {
+        Spans s;
+        uint32_t offset = (uint32_t) index & mask;
+        uint32_t to_end = capacity - offset;
+        s.first = data + (size_t) offset * frame_bytes;
+        s.first_frames = frames < to_end ? frames : to_end;
+        s.second_frames = frames - s.first_frames;
+        s.second = s.second_frames ? data : nullptr;
+        return s;
+    }
+
+    struct alignas(64) Side {
+        std::atomic<uint64_t> index{0}; // frames ever written (producer) or read (consumer)
+        uint64_t cached = 0;            // this side's last look at the other side's index
+    };
+
+    Side producer;
+    Side consumer;
+    alignas(64) char *data;
+    uint32_t capacity;
+    uint32_t mask;
+    uint32_t frame_bytes;
+};
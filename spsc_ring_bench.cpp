@@ -0,0 +1,81 @@
+// Throughput and latency of SpscAudioRing between two threads, no card needed.
+//   g++ -std=c++17 -O2 -pthread spsc_ring_bench.cpp -o spsc_ring_bench
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.h"
+
+using namespace std::chrono;
+using std::clog;
+
+static int64_t now_ns() {
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv) {
+    const uint32_t frame_bytes = argc > 1 ? atoi(argv[1]) : 4;   // 2 ch 16 bit
+    const uint32_t chunk = argc > 2 ? atoi(argv[2]) : 1920;      // one 25p frame
+    const uint64_t total = argc > 3 ? atoll(argv[3]) : 48000ull * 3600; // an hour of audio
+    const uint32_t capacity = 48000;
+
+    SpscAudioRing ring(capacity, frame_bytes);
+    std::vector<char> src((size_t) chunk * frame_bytes, 1);
+    std::vector<char> dst((size_t) chunk * frame_bytes);
+    std::vector<int64_t> latency;
+    latency.reserve(total / chunk + 1);
+
+    int64_t t0 = now_ns();
+    std::thread producer([&] {
+        uint64_t sent = 0;
+        while (sent < total) {
+            uint32_t n = (uint32_t) std::min<uint64_t>(chunk, total - sent);
+            SpscAudioRing::Spans s = ring.write_spans(n);
+            if (s.frames() < n) {
+                std::this_thread::yield();
+                continue;
+            }
+            // stamp each chunk so the consumer can see how long it sat in the ring
+            int64_t stamp = now_ns();
+            memcpy(src.data(), &stamp, sizeof(stamp));
+            memcpy(s.first, src.data(), (size_t) s.first_frames * frame_bytes);
+            if (s.second_frames) {
+                memcpy(s.second, src.data() + (size_t) s.first_frames * frame_bytes, (size_t) s.second_frames * frame_bytes);
+            }
+            ring.commit_write(n);
+            sent += n;
+        }
+    });
+
+    uint64_t received = 0;
+    while (received < total) {
+        uint32_t n = (uint32_t) std::min<uint64_t>(chunk, total - received);
+        SpscAudioRing::Spans s = ring.read_spans(n);
+        if (s.frames() < n) {
+            std::this_thread::yield();
+            continue;
+        }
+        memcpy(dst.data(), s.first, (size_t) s.first_frames * frame_bytes);
+        if (s.second_frames) {
+            memcpy(dst.data() + (size_t) s.first_frames * frame_bytes, s.second, (size_t) s.second_frames * frame_bytes);
+        }
+        ring.commit_read(n);
+        int64_t stamp;
+        memcpy(&stamp, dst.data(), sizeof(stamp));
+        latency.push_back(now_ns() - stamp);
+        received += n;
+    }
+    int64_t elapsed = now_ns() - t0;
+    producer.join();
+
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&](double p) { return latency[std::min(latency.size() - 1, (size_t) (p * latency.size()))] / 1000.0; };
+    double seconds = elapsed / 1e9;
+    clog << "frames " << total << " in " << seconds << " s, " << total / seconds / 48000 << "x real time at 48 kHz, "
+         << total * frame_bytes / seconds / 1e9 << " GB/s" << std::endl;
+    clog << "chunk latency us p50 " << pct(0.5) << " p99 " << pct(0.99) << " p99.9 " << pct(0.999)
+         << " max " << latency.back() / 1000.0 << std::endl;
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "DeckLinkAPI.h"
+
+/// A fixed ring of output frames carrying a test pattern that shows drops and repeats on the wire.
+///
+/// Each frame is 75% SMPTE colour bars with a white marker that steps one 48 pixel block to the right every
+/// frame, and a stripe across the top that carries the frame number as 32 black/white cells (MSB first, framed by
+/// a white cell on the left and a black one on the right). All frames are created and drawn up front; next() only
+/// rewrites the stripe and moves the marker in the frame it hands back, by copying prebuilt rows and row segments,
+/// so per frame cost is well under a megabyte of memcpy even at 2160p (about 0.3 ms) and nothing is allocated.
+/// Supports bmdFormat8BitYUV (UYVY) and bmdFormat10BitYUV (v210).
+class VideoFramePool {
+public:
+    static constexpr int counter_bits = 32;
+    static constexpr long marker_width = 48; // a whole number of UYVY pairs and of v210 groups
+
+    VideoFramePool(IDeckLinkOutput *output, long width, long height, BMDPixelFormat format)
+        : output(output), width(width), height(height), format(format) {
+        row_bytes = format == bmdFormat10BitYUV ? (width + 47) / 48 * 128 : width * 2;
+        stripe_rows = std::max<long>(height / 27, 4);
+        bars_end = height * 7 / 12;
+        castellation_end = height * 2 / 3;
+    }
+
+    ~VideoFramePool() {
+        for (Slot &s : slots) {
+            s.frame->Release();
+        }
+    }
+
+    VideoFramePool(const VideoFramePool &) = delete;
+    VideoFramePool &operator=(const VideoFramePool &) = delete;
+
+    /// Creates and draws count frames.
+    HRESULT create(uint32_t count) {
+        build_templates();
+        for (uint32_t i = 0; i < count; ++i) {
+            IDeckLinkMutableVideoFrame *f = nullptr;
+            HRESULT result = output->CreateVideoFrame(width, height, row_bytes, format, bmdFrameFlagDefault, &f);
+            if (result != S_OK) {
+                return result;
+            }
+            Slot s{f, nullptr, -1};
+            f->GetBytes((void **) &s.bytes);
+            for (long y = 0; y < height; ++y) {
+                memcpy(s.bytes + y * row_bytes, template_row(y), row_bytes);
+            }
+            slots.push_back(s);
+        }
+        return S_OK;
+    }
+
+    /// Draws frame_number into pool slot frame_number % size() and returns that frame. The caller must be done with
+    /// whatever it last did with that slot, e.g. by sizing the pool to the preroll depth for scheduled playout.
+    IDeckLinkMutableVideoFrame *next(uint64_t frame_number) {
+        Slot &s = slots[frame_number % slots.size()];
+        draw_counter(s, (uint32_t) frame_number);
+        draw_marker(s, (long) (frame_number % marker_positions()) * marker_width);
+        return s.frame;
+    }
+
+    uint32_t size() const { return (uint32_t) slots.size(); }
+    /// @retval pool slot i's frame, as next() last drew it
+    IDeckLinkMutableVideoFrame *frame(uint32_t i) const { return slots[i].frame; }
+    /// @retval the pixels of pool slot i, frame_bytes() long
+    uint8_t *bytes(uint32_t i) const { return slots[i].bytes; }
+    size_t frame_bytes() const { return (size_t) row_bytes * height; }
+    long marker_positions() const { return std::max<long>(width / marker_width, 1); }
+
+    /// Reads the frame number back out of a frame drawn by next(), e.g. one captured on a loopback input.
+    /// @retval false if the stripe framing cells are not where they should be
+    static bool read_counter(const uint8_t *bytes, long width, long height, long rowBytes, BMDPixelFormat format,
+                             uint32_t &frame_number) {
+        // sample the middle of the stripe, in the middle of each cell
+        const uint8_t *row = bytes + std::max<long>(height / 27, 4) / 2 * rowBytes;
+        auto luma = [&](long x) {
+            if (format == bmdFormat10BitYUV) {
+                const uint8_t *group = row + x / 6 * 16;
+                static const int word[6] = {0, 1, 1, 2, 3, 3};
+                static const int shift[6] = {10, 0, 20, 10, 0, 20};
+                uint32_t w;
+                memcpy(&w, group + word[x % 6] * 4, 4);
+                return (int) (w >> shift[x % 6] & 0x3ff) >> 2;
+            }
+            return (int) row[x * 2 + 1];
+        };
+        long cells = counter_bits + 2;
+        auto bit = [&](long cell) { return luma(cell * width / cells + width / cells / 2) > 128; };
+        if (!bit(0) || bit(cells - 1)) {
+            return false;
+        }
+        frame_number = 0;
+        for (long b = 0; b < counter_bits; ++b) {
+            frame_number = frame_number << 1 | (bit(b + 1) ? 1 : 0);
+        }
+        return true;
+    }
+
+private:
+    struct Slot {
+        IDeckLinkMutableVideoFrame *frame;
+        uint8_t *bytes;
+        long marker_x; // where the marker was last drawn, -1 for nowhere
+    };
+
+    struct Yuv {
+        uint16_t y, cb, cr; // 10 bit video levels
+    };
+
+    /// 75% bars and the lower bands in BT.709 10 bit levels, as in SMPTE RP 219
+    static constexpr Yuv white75{721, 512, 512}, yellow{674, 176, 543}, cyan{581, 589, 176}, green{534, 253, 207},
+        magenta{251, 771, 817}, red{204, 435, 848}, blue{111, 848, 481}, black{64, 512, 512}, white{940, 512, 512},
+        minus_i{244, 612, 395}, plus_q{141, 697, 606}, below_black{46, 512, 512}, above_black{99, 512, 512};
+
+    /// Packs one row of width pixels. Chroma is taken from the even pixel of each pair.
+    void pack(const Yuv *px, uint8_t *out) const {
+        if (format == bmdFormat10BitYUV) {
+            memset(out, 0, row_bytes);
+            uint32_t *w = reinterpret_cast<uint32_t *>(out);
+            for (long x = 0; x < width; x += 6, w += 4) {
+                Yuv p[6];
+                for (int k = 0; k < 6; ++k) {
+                    p[k] = px[std::min(x + k, width - 1)];
+                }
+                w[0] = p[0].cb | p[0].y << 10 | p[0].cr << 20;
+                w[1] = p[1].y | p[2].cb << 10 | p[2].y << 20;
+                w[2] = p[2].cr | p[3].y << 10 | p[4].cb << 20;
+                w[3] = p[4].y | p[4].cr << 10 | p[5].y << 20;
+            }
+            return;
+        }
+        for (long x = 0; x + 1 < width; x += 2, out += 4) {
+            out[0] = px[x].cb >> 2;
+            out[1] = px[x].y >> 2;
+            out[2] = px[x].cr >> 2;
+            out[3] = px[x + 1].y >> 2;
+        }
+    }
+
+    void build_templates() {
+        std::vector<Yuv> px(width);
+        auto band = [&](std::vector<uint8_t> &row, std::initializer_list<std::pair<Yuv, int>> parts, int total) {
+            long x = 0;
+            int sum = 0;
+            for (auto &part : parts) {
+                sum += part.second;
+                long end = width * sum / total;
+                std::fill(px.begin() + x, px.begin() + end, part.first);
+                x = end;
+            }
+            row.resize(row_bytes);
+            pack(px.data(), row.data());
+        };
+        band(bars_row, {{white75, 1}, {yellow, 1}, {cyan, 1}, {green, 1}, {magenta, 1}, {red, 1}, {blue, 1}}, 7);
+        band(castellation_row,
+             {{blue, 1}, {black, 1}, {magenta, 1}, {black, 1}, {cyan, 1}, {black, 1}, {white75, 1}}, 7);
+        band(bottom_row,
+             {{minus_i, 5}, {white, 5}, {plus_q, 5}, {black, 5}, {below_black, 1}, {black, 1}, {above_black, 1},
+              {black, 5}},
+             28);
+        band(marker_row, {{white, 1}}, 1);
+
+        // the stripe is packed into this row once per frame and then copied down the stripe
+        stripe_px.assign(width, black);
+        stripe_row.resize(row_bytes);
+    }
+
+    const uint8_t *template_row(long y) const {
+        if (y < bars_end) {
+            return bars_row.data();
+        }
+        if (y < castellation_end) {
+            return castellation_row.data();
+        }
+        return bottom_row.data();
+    }
+
+    void draw_counter(Slot &s, uint32_t frame_number) {
+        const long cells = counter_bits + 2;
+        for (long c = 0; c < cells; ++c) {
+            bool on = c == 0 || (c <= counter_bits && (frame_number >> (counter_bits - c) & 1));
+            std::fill(stripe_px.begin() + width * c / cells, stripe_px.begin() + width * (c + 1) / cells,
+                      on ? white : black);
+        }
+        pack(stripe_px.data(), stripe_row.data());
+        for (long y = 0; y < stripe_rows; ++y) {
+            memcpy(s.bytes + y * row_bytes, stripe_row.data(), row_bytes);
+        }
+    }
+
+    /// The marker runs down the bars band; the old one is put back from the bars template row.
+    void draw_marker(Slot &s, long x) {
+        long offset = marker_offset(x);
+        long old_offset = s.marker_x < 0 ? -1 : marker_offset(s.marker_x);
+        long bytes = std::min(marker_offset(marker_width), row_bytes - offset);
+        for (long y = stripe_rows; y < bars_end; ++y) {
+            uint8_t *row = s.bytes + y * row_bytes;
+            if (old_offset >= 0) {
+                memcpy(row + old_offset, bars_row.data() + old_offset, std::min(bytes, row_bytes - old_offset));
+            }
+            memcpy(row + offset, marker_row.data() + offset, bytes);
+        }
+        s.marker_x = x;
+    }
+
+    long marker_offset(long x) const { return format == bmdFormat10BitYUV ? x / 48 * 128 : x * 2; }
+
+    IDeckLinkOutput *output;
+    long width;
+    long height;
+    BMDPixelFormat format;
+    long row_bytes;
+    long stripe_rows;
+    long bars_end;
+    long castellation_end;
+
+    std::vector<Slot> slots;
+    std::vector<uint8_t> bars_row;
+    std::vector<uint8_t> castellation_row;
+    std::vector<uint8_t> bottom_row;
+    std::vector<uint8_t> marker_row;
+    std::vector<uint8_t> stripe_row;
+    std::vector<Yuv> stripe_px;
+};
+
+/// One VideoFramePool shown on several outputs, each from its own thread: frame n is drawn once, by whichever
+/// output asks for it first, and the rest get the same frame, so the pixels exist once however many outputs there
+/// are.
+///
+/// Each output holds the frame it shows from acquire() until release(), normally once the next one is on air, and a
+/// slot is never drawn over while any output holds it. Outputs paced on one frame grid ask for the same frame at
+/// about the same time; the pool has a slot for every frame from the one furthest ahead back to max_lag frames
+/// behind it, plus the one each output still holds. An output further behind than that gets no frame rather than a
+/// newer one, and one ahead of an output that still holds the slot it needs gets none either; both are counted, and
+/// the output shows its previous frame again.
+class SharedFramePool {
+public:
+    /// output: the one that creates the frames; any output can display them
+    SharedFramePool(IDeckLinkOutput *output, long width, long height, BMDPixelFormat format)
+        : pool(output, width, height, format) {}
+
+    /// max_lag: how many frames an output may fall behind the one furthest ahead and still be shown its frame
+    HRESULT create(uint32_t max_lag) {
+        HRESULT result = pool.create(max_lag + 2);
+        drawn.reset(new std::atomic<int64_t>[pool.size()]);
+        readers.reset(new std::atomic<uint32_t>[pool.size()]);
+        for (uint32_t i = 0; i < pool.size(); ++i) {
+            drawn[i].store(-1, std::memory_order_relaxed);
+            readers[i].store(0, std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    /// Frame n, drawn if no output has asked for it yet, and held for the caller until release(n); lock free once
+    /// it has been drawn.
+    /// @retval nullptr if the slot has moved on past n (counted in missed) or an older frame still held there keeps n
+    /// from being drawn (counted in blocked)
+    IDeckLinkVideoFrame *acquire(uint64_t n) {
+        uint32_t i = (uint32_t) (n % pool.size());
+        // the count goes up before the frame number is checked and the drawer marks the slot before checking the
+        // count, both sequentially consistent, so either this sees the slot change or the drawer sees this reader
+        readers[i].fetch_add(1);
+        if (drawn[i].load() == (int64_t) n) {
+            return pool.frame(i);
+        }
+        readers[i].fetch_sub(1);
+
+        std::lock_guard<std::mutex> guard(lock);
+        int64_t held = drawn[i].load();
+        if (held > (int64_t) n) {
+            missed.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (held < (int64_t) n) {
+            drawn[i].store(drawing);
+            // readers that only looked at the slot leave at once; one that still shows frame held does not
+            for (int spin = 0; readers[i].load() != 0; ++spin) {
+                if (spin == 100) {
+                    drawn[i].store(held);
+                    blocked.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                std::this_thread::yield();
+            }
+            pool.next(n);
+            drawn[i].store((int64_t) n);
+        }
+        readers[i].fetch_add(1);
+        return pool.frame(i);
+    }
+
+    /// Lets frame n's slot be drawn over again once no other output holds it.
+    void release(uint64_t n) { readers[n % pool.size()].fetch_sub(1, std::memory_order_release); }
+
+    const VideoFramePool &frames() const { return pool; }
+
+    std::atomic<long> missed{0};  // frames asked for after their slot had moved on to a newer one
+    std::atomic<long> blocked{0}; // frames that could not be drawn because an output still held the slot
+
+private:
+    static constexpr int64_t drawing = -2;
+
+    VideoFramePool pool;
+    std::unique_ptr<std::atomic<int64_t>[]> drawn;    // frame number each slot holds, or drawing
+    std::unique_ptr<std::atomic<uint32_t>[]> readers; // outputs holding each slot, and any checking it
+    std::mutex lock;                                  // drawing uses the pool's scratch rows
+};
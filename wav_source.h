@@ -0,0 +1,287 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "spsc_ring.h"
+
+/// Loops a PCM file from a read only memory mapping, for playout of real programme audio of any length.
+///
+/// read_spans() hands out pointers straight into the mapping, as one span or two where the loop wraps, so samples
+/// go from the page cache to WriteAudioSamples* with no copy in between. Opening only reads the header, so it takes
+/// the same time for a minute as for a day. A housekeeping thread keeps a few seconds ahead of the read position
+/// resident (MADV_WILLNEED, then touching each page so the playout thread never takes the fault) and drops
+/// everything more than a second behind it from both the mapping and the page cache, so memory use stays flat
+/// however long the file is. Files shorter than that window simply stay resident.
+///
+/// Reads RIFF/RF64/BW64 WAVE (BWF included, extra chunks skipped) with 16 or 32 bit integer PCM, or headerless
+/// little endian PCM described by the caller. Samples are passed through as they are in the file.
+class MappedAudioSource {
+public:
+    MappedAudioSource() = default;
+
+    ~MappedAudioSource() { close(); }
+
+    MappedAudioSource(const MappedAudioSource &) = delete;
+    MappedAudioSource &operator=(const MappedAudioSource &) = delete;
+
+    /// @retval false, with error() saying why, if the file can not be mapped or is not a PCM WAVE file
+    bool open_wav(const char *path) {
+        if (!map(path)) {
+            return false;
+        }
+        if (!parse_wave()) {
+            close();
+            return false;
+        }
+        return start();
+    }
+
+    /// Maps headerless interleaved little endian PCM.
+    bool open_raw(const char *path, uint32_t sample_rate, int channels, int bits) {
+        if (!map(path)) {
+            return false;
+        }
+        rate = sample_rate;
+        channel_count = channels;
+        sample_bits = bits;
+        data = base;
+        data_bytes = file_bytes;
+        return start();
+    }
+
+    void close() {
+        if (housekeeper.joinable()) {
+            stopping.store(true, std::memory_order_release);
+            housekeeper.join();
+        }
+        if (base) {
+            munmap(base, file_bytes);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        base = data = nullptr;
+        fd = -1;
+    }
+
+    const std::string &error() const { return message; }
+    uint32_t sample_rate() const { return rate; }
+    int channels() const { return channel_count; }
+    int bits() const { return sample_bits; }
+    uint32_t frame_bytes() const { return (uint32_t) channel_count * sample_bits / 8; }
+    /// @retval sample frames in one pass through the file
+    uint64_t frames() const { return data_bytes / frame_bytes(); }
+
+    // playout thread
+
+    /// @retval the next min(max_frames, frames()) sample frames as one or two spans; the read position does not move
+    SpscAudioRing::Spans read_spans(uint32_t max_frames) const {
+        SpscAudioRing::Spans s;
+        uint64_t n = std::min<uint64_t>(max_frames, frames());
+        uint64_t at = position % frames();
+        s.first = data + at * frame_bytes();
+        s.first_frames = (uint32_t) std::min<uint64_t>(n, frames() - at);
+        if (s.first_frames < n) {
+            s.second = data;
+            s.second_frames = (uint32_t) (n - s.first_frames);
+        }
+        return s;
+    }
+
+    void commit_read(uint32_t frames) {
+        position += frames;
+        played.store(position, std::memory_order_release);
+    }
+
+private:
+    static constexpr double ahead_seconds = 4.0;
+    static constexpr double behind_seconds = 1.0;
+
+    bool fail(const std::string &why) {
+        message = why;
+        return false;
+    }
+
+    bool map(const char *path) {
+        close();
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return fail(std::string("can not open ") + path + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            return fail(std::string(path) + " is empty");
+        }
+        file_bytes = (size_t) st.st_size;
+        void *p = mmap(nullptr, file_bytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            return fail(std::string("can not map ") + path + ": " + strerror(errno));
+        }
+        base = (char *) p;
+        madvise(base, file_bytes, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    static uint32_t le32(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    static uint64_t le64(const char *p) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    bool parse_wave() {
+        if (file_bytes < 12 || memcmp(base + 8, "WAVE", 4) != 0 ||
+            (memcmp(base, "RIFF", 4) != 0 && memcmp(base, "RF64", 4) != 0 && memcmp(base, "BW64", 4) != 0)) {
+            return fail("not a RIFF/RF64 WAVE file");
+        }
+        uint64_t ds64_data_bytes = 0;
+        bool have_fmt = false;
+        size_t at = 12;
+        while (at + 8 <= file_bytes) {
+            const char *id = base + at;
+            uint64_t size = le32(id + 4);
+            const char *body = id + 8;
+            bool header_chunk = memcmp(id, "ds64", 4) == 0 || memcmp(id, "fmt ", 4) == 0;
+            if (header_chunk && at + 8 + size > file_bytes) {
+                // a short data chunk still plays as far as it goes, but ds64 and fmt fields are read in full
+                return fail("truncated chunk");
+            }
+            if (memcmp(id, "ds64", 4) == 0 && size >= 16) {
+                ds64_data_bytes = le64(body + 8);
+            }
+            else if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+                uint16_t tag, bits;
+                memcpy(&tag, body, 2);
+                if (tag == 0xFFFE && size >= 26) {
+                    memcpy(&tag, body + 24, 2); // WAVE_FORMAT_EXTENSIBLE: the sub format GUID starts with the tag
+                }
+                memcpy(&bits, body + 14, 2);
+                uint16_t ch;
+                memcpy(&ch, body + 2, 2);
+                channel_count = ch;
+                rate = le32(body + 4);
+                sample_bits = bits;
+                if (tag != 1) {
+                    return fail("only integer PCM is supported, format tag " + std::to_string(tag));
+                }
+                if (bits != 16 && bits != 32) {
+                    return fail(std::to_string(bits) + " bit samples, only 16 and 32 can be sent as they are");
+                }
+                have_fmt = true;
+            }
+            else if (memcmp(id, "data", 4) == 0) {
+                if (!have_fmt) {
+                    return fail("data chunk before fmt chunk");
+                }
+                if (size == 0xFFFFFFFF && ds64_data_bytes) {
+                    size = ds64_data_bytes;
+                }
+                data = (char *) body;
+                data_bytes = (size_t) std::min<uint64_t>(size, file_bytes - (at + 8));
+                break;
+            }
+            at += 8 + size + (size & 1);
+        }
+        if (!data) {
+            return fail("no data chunk");
+        }
+        return true;
+    }
+
+    bool start() {
+        if (channel_count <= 0 || (sample_bits != 16 && sample_bits != 32) || frames() == 0) {
+            close();
+            return fail("no whole sample frames to play");
+        }
+        data_bytes = frames() * frame_bytes();
+        position = 0;
+        played.store(0, std::memory_order_relaxed);
+        stopping.store(false, std::memory_order_relaxed);
+        housekeeper = std::thread([this] { housekeep(); });
+        return true;
+    }
+
+    /// Calls f(pointer, bytes) for the part of the looped stream between absolute byte offsets begin and end, in
+    /// at most two pieces split at the loop point.
+    template <typename F>
+    void for_range(uint64_t begin, uint64_t end, F f) {
+        while (begin < end) {
+            uint64_t at = begin % data_bytes;
+            uint64_t n = std::min<uint64_t>(end - begin, data_bytes - at);
+            f(data + at, (size_t) n);
+            begin += n;
+        }
+    }
+
+    void housekeep() {
+        const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+        const uint64_t second = (uint64_t) rate * frame_bytes();
+        const uint64_t ahead = (uint64_t) (ahead_seconds * second) + page;
+        const uint64_t behind = (uint64_t) (behind_seconds * second) + page;
+        // a file that fits in the window is never dropped, it would only be read straight back
+        const bool drop = data_bytes > ahead + behind + 4 * page;
+        uint64_t prefetched = 0;
+        uint64_t dropped = 0;
+        while (!stopping.load(std::memory_order_acquire)) {
+            uint64_t pos = played.load(std::memory_order_acquire) * frame_bytes();
+            if (pos + ahead > prefetched) {
+                for_range(std::max(prefetched, pos), pos + ahead, [&](char *p, size_t n) {
+                    uintptr_t b = (uintptr_t) p & ~(page - 1);
+                    madvise((void *) b, (uintptr_t) p + n - b, MADV_WILLNEED);
+                    for (uintptr_t a = b; a < (uintptr_t) p + n; a += page) {
+                        (void) *(volatile const char *) a;
+                    }
+                });
+                prefetched = pos + ahead;
+            }
+            // up to a page boundary in the file, so the next range starts on the page this one stopped at
+            uint64_t limit = pos > behind ? pos - behind : 0;
+            limit -= std::min<uint64_t>(limit, (data - base + limit % data_bytes) % page);
+            if (drop && limit > dropped + 16 * page) {
+                for_range(dropped, limit, [&](char *p, size_t n) {
+                    // whole pages only, a shared edge page may still be wanted
+                    uintptr_t b = ((uintptr_t) p + page - 1) & ~(page - 1);
+                    uintptr_t e = ((uintptr_t) p + n) & ~(page - 1);
+                    if (e > b) {
+                        munlock((void *) b, e - b); // in case -realtime locked it as it was touched
+                        madvise((void *) b, e - b, MADV_DONTNEED);
+                        posix_fadvise(fd, (off_t) (b - (uintptr_t) base), (off_t) (e - b), POSIX_FADV_DONTNEED);
+                    }
+                });
+                dropped = limit;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+
+    int fd = -1;
+    char *base = nullptr;
+    size_t file_bytes = 0;
+    char *data = nullptr;
+    size_t data_bytes = 0;
+    uint32_t rate = 0;
+    int channel_count = 0;
+    int sample_bits = 0;
+    std::string message;
+
+    uint64_t position = 0; // playout thread only, sample frames read since the start, not wrapped
+    alignas(64) std::atomic<uint64_t> played{0};
+    std::atomic<bool> stopping{false};
+    std::thread housekeeper;
+};